@@ -6,6 +6,7 @@
  */
 
 #include "array.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,6 +24,7 @@ void * array_new(size_t elementSize, FreeNotify freeElement)
     Array *arr = calloc(sizeof(Array) + (elementSize * kDefaultCapacity), 1);
     arr->elementSize = elementSize;
     arr->capacity = kDefaultCapacity;
+    arr->freeElement = freeElement;
     return &arr->data;
 }
 
@@ -49,8 +51,13 @@ void * array_reserve(void *data, size_t size, bool create)
 
     if(size > arr->capacity)
     {
+        if(size > (SIZE_MAX - sizeof(Array)) / arr->elementSize)
+            return NULL;
+        Array *grown = realloc(arr, sizeof(Array) + (arr->elementSize * size));
+        if(!grown)
+            return NULL;
+        arr = grown;
         arr->capacity = size;
-        arr = realloc(arr, sizeof(Array) + (arr->elementSize * arr->capacity));
     }
     
     if(create && size > arr->size)
@@ -117,7 +124,7 @@ void array_shrink(void *data, size_t size, bool free)
     if(free && arr->freeElement)
     {
         for(size_t i = size; i < arr->size; ++i)
-            arr->freeElement(&data[i]);
+            arr->freeElement(data + (i * arr->elementSize));
     }
     
     arr->size = size;
@@ -128,3 +135,57 @@ size_t array_size(void *data)
     Array *arr = array_from_data(data);
     return arr->size;
 }
+
+size_t array_capacity(void *data)
+{
+    Array *arr = array_from_data(data);
+    return arr->capacity;
+}
+
+size_t array_allocated(void *data)
+{
+    if(!data)
+        return 0;
+    Array *arr = array_from_data(data);
+    return sizeof(Array) + (arr->elementSize * arr->capacity);
+}
+
+size_t array_slack(void *data)
+{
+    if(!data)
+        return 0;
+    Array *arr = array_from_data(data);
+    return arr->elementSize * (arr->capacity - arr->size);
+}
+
+void * array_trim(void *data)
+{
+    Array *arr = array_from_data(data);
+    
+    // Empty arrays keep room for one, like a new array keeps room
+    // for a few
+    size_t capacity = (arr->size > 0) ? arr->size : 1;
+    if(capacity < arr->capacity)
+    {
+        Array *trimmed = realloc(arr, sizeof(Array) + (arr->elementSize * capacity));
+        if(trimmed)
+        {
+            arr = trimmed;
+            arr->capacity = capacity;
+        }
+    }
+    return &arr->data;
+}
+
+void * array_copy(void *data)
+{
+    if(!data)
+        return NULL;
+    
+    Array *arr = array_from_data(data);
+    size_t capacity = (arr->size > 0) ? arr->size : 1;
+    Array *copy = malloc(sizeof(Array) + (arr->elementSize * capacity));
+    memcpy(copy, arr, sizeof(Array) + (arr->elementSize * arr->size));
+    copy->capacity = capacity;
+    return &copy->data;
+}
@@ -38,6 +38,9 @@ void array_free(void *array);
  * the array's length to match its new capacity (does not
  * zero the new space). This should always be called as
  * a = array_reserve(a, size);
+ * Returns NULL, leaving the array as it was, if the space
+ * can't be allocated, so check first if size comes from a
+ * file.
  */
 __attribute__((warn_unused_result))
 void * array_reserve(void *data, size_t size, bool create);
@@ -76,4 +79,37 @@ void array_shrink(void *array, size_t size, bool free);
  */
 size_t array_size(void *array);
 
+/*
+ * Returns the number of elements the array has room for
+ * before it has to grow.
+ */
+size_t array_capacity(void *array);
+
+/*
+ * Returns the bytes allocated for the array, including
+ * its header and unused capacity, or 0 for NULL.
+ */
+size_t array_allocated(void *array);
+
+/*
+ * Returns the bytes of unused capacity, or 0 for NULL.
+ */
+size_t array_slack(void *array);
+
+/*
+ * Reduces the array's capacity to its size, and returns
+ * a pointer to the array. This should always be called as
+ * a = array_trim(a);
+ */
+__attribute__((warn_unused_result))
+void * array_trim(void *array);
+
+/*
+ * Returns a new array with the same elements and freeElement,
+ * with room for just them, or NULL for NULL. Elements are
+ * copied byte for byte, so anything they point to is shared.
+ */
+__attribute__((warn_unused_result))
+void * array_copy(void *array);
+
 #endif /* array_h */
@@ -196,6 +196,16 @@ extension AppDelegate: NSOutlineViewDelegate, NSOutlineViewDataSource
         return false
     }
     
+    // Get tooltip, the number of pages of notes
+    func outlineView(_ outlineView: NSOutlineView, toolTipFor cell: NSCell, rect: NSRectPointer, tableColumn: NSTableColumn?, item: Any, mouseLocation: NSPoint) -> String
+    {
+        if let it = item as? NoteFile, it.pageCount > 0
+        {
+            return (it.pageCount == 1) ? "1 page" : String(format: "%i pages", it.pageCount)
+        }
+        return ""
+    }
+    
     // Get if selectable
     func outlineView(_ outlineView: NSOutlineView, shouldSelectItem item: Any) -> Bool
     {
@@ -258,6 +268,7 @@ class NoteFile : NSObject
 {
     var url: URL!
     var parent: NoteFile!
+    var pageCount: Int = 0 // Set when the parent lists its children
 
     var name: String {
         get {
@@ -386,10 +397,19 @@ class NoteFile : NSObject
         let options: FileManager.DirectoryEnumerationOptions = [.skipsHiddenFiles, .skipsPackageDescendants, .skipsSubdirectoryDescendants]
         if let enumerator = FileManager.default.enumerator(at: self.url, includingPropertiesForKeys:[URLResourceKey](), options: options, errorHandler: nil)
         {
+            // Notes are described from the directory's cache,
+            // which only reads the ones that changed
+            let cache = noted_dir_cache_open(self.url.path)
             while let url = enumerator.nextObject() as? URL
             {
-                self._children.append(NoteFile(url, self))
+                let child = NoteFile(url, self)
+                if let info = noted_dir_cache_peek(cache, url.lastPathComponent)
+                {
+                    child.pageCount = info.pointee.npages
+                }
+                self._children.append(child)
             }
+            _ = noted_dir_cache_close(cache)
         }
     }
     
@@ -426,15 +446,14 @@ class NoteFile : NSObject
         }
         
         // See if the note already exists, just in case
-        var c = noted_canvas_open(new.path)
-        if(c != nil)
+        if let info = noted_canvas_peek(new.path)
         {
-            noted_canvas_destroy(c)
+            free(info)
             return nil
         }
         
         // Create
-        c = noted_canvas_new(new.path)
+        let c = noted_canvas_new(new.path)
         if(c == nil)
         {
             return nil
@@ -11,6 +11,7 @@ import Cocoa
 class NCView: NSView
 {
     static var kPageWidth: CGFloat = 750
+    static let kStrokesPboardType = "com.zelbrium.noted.strokes"
     var canvas: OpaquePointer?
     var currentTool: NCInputTool = kNCPenTool
     
@@ -52,6 +53,13 @@ class NCView: NSView
         }
         
         noted_canvas_set_invalidate_callback(self.canvas, invalidate_callback, UnsafeMutableRawPointer(Unmanaged.passUnretained(self).toOpaque()))
+        noted_canvas_set_image_callback(self.canvas, image_callback, UnsafeMutableRawPointer(Unmanaged.passUnretained(self).toOpaque()))
+        
+        // For playing back with tools/noted-replay
+        if let recordPath = ProcessInfo.processInfo.environment["NOTED_RECORD_INPUT"]
+        {
+            noted_canvas_record_input(self.canvas, recordPath)
+        }
         
         var style = NCStrokeStyle()
         style.a = 255
@@ -60,6 +68,9 @@ class NCView: NSView
         style.b = 0
         style.thickness = Float(0.8 / NCView.kPageWidth)
         noted_canvas_set_stroke_style(canvas, style)
+        
+        // Points closer than this are too small to see at 100%
+        noted_canvas_set_simplify_tolerance(canvas, Float(0.25 / NCView.kPageWidth))
     }
 
     override func draw(_ rect: NSRect)
@@ -141,6 +152,19 @@ class NCView: NSView
         }
     }
     
+    // Images are decoded in the background, so the view is
+    // redrawn from the main thread once they're ready
+    let image_callback : @convention(c) (OpaquePointer?, UnsafeMutableRawPointer?) -> Void =
+    {
+        (c, s) -> Void in
+        
+        let `self`: NCView = Unmanaged<NCView>.fromOpaque(s!).takeUnretainedValue()
+        DispatchQueue.main.async
+        {
+            self.setNeedsDisplay(self.visibleRect)
+        }
+    }
+    
     override func mouseDown(with event: NSEvent)
     {
         if(self.canvas != nil)
@@ -185,7 +209,56 @@ class NCView: NSView
     
     func delete(_ sender: Any?)
     {
-        Swift.print("delete")
+        if(self.canvas != nil)
+        {
+            noted_canvas_delete_selection(self.canvas)
+        }
+    }
+    
+    func copy(_ sender: Any?)
+    {
+        if(self.canvas != nil)
+        {
+            var size: Int = 0
+            if let content = noted_canvas_copy(self.canvas, &size)
+            {
+                let pb = NSPasteboard.general()
+                pb.declareTypes([NCView.kStrokesPboardType], owner: nil)
+                pb.setData(Data(bytes: content, count: size), forType: NCView.kStrokesPboardType)
+                free(content)
+            }
+        }
+    }
+    
+    func cut(_ sender: Any?)
+    {
+        self.copy(sender)
+        self.delete(sender)
+    }
+    
+    func paste(_ sender: Any?)
+    {
+        if(self.canvas == nil)
+        {
+            return
+        }
+        
+        // Paste into the middle of what's visible
+        let pb = NSPasteboard.general()
+        let where = self.visibleRect.midY / self.frame.size.width
+        if let data = pb.data(forType: NCView.kStrokesPboardType)
+        {
+            data.withUnsafeBytes { (bytes: UnsafePointer<UInt8>) -> Void in
+                _ = noted_canvas_paste(self.canvas, bytes, data.count, Float(where))
+            }
+        }
+        else if let data = pb.data(forType: "public.png") ?? pb.data(forType: "public.jpeg")
+        {
+            // Half a page wide, centered
+            data.withUnsafeBytes { (bytes: UnsafePointer<UInt8>) -> Void in
+                _ = noted_canvas_insert_image(self.canvas, bytes, data.count, 0.25, Float(where), 0.5)
+            }
+        }
     }
     
 //    - (void)onRedo:(void *)v
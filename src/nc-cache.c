@@ -0,0 +1,161 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-cache.c: Surfaces that can always be made again, like
+ *   rendered PDF pages and decoded images, kept in one cache for
+ *   every canvas and thread. When it's over its size, the least
+ *   recently used surfaces are dropped.
+ */
+
+#include "nc-private.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Least recently used surfaces are dropped to stay under this
+static const size_t kSurfaceCacheSize = 128 << 20;
+
+struct CachedSurface_
+{
+    CachedSurface **list; // The owner's list it's in
+    unsigned int key;
+    cairo_surface_t *surface;
+    size_t size; // In bytes
+    CachedSurface *newer, *older; // Cache order
+    CachedSurface *sibling; // Next in the owner's list
+};
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static CachedSurface *newest, *oldest;
+static size_t cacheSize;
+
+static void drop_surface(CachedSurface *c);
+static void unlink_surface(CachedSurface *c);
+static void link_surface(CachedSurface *c);
+
+
+cairo_surface_t * surface_cache_get(CachedSurface **list, unsigned int key)
+{
+    unsigned int found;
+    cairo_surface_t *surface = surface_cache_get_nearest(list, key, &found);
+    if(surface && found != key)
+    {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+cairo_surface_t * surface_cache_get_nearest(CachedSurface **list, unsigned int key, unsigned int *found)
+{
+    pthread_mutex_lock(&cacheLock);
+    CachedSurface *best = NULL;
+    unsigned int bestDistance = 0;
+    for(CachedSurface *c = *list; c; c = c->sibling)
+    {
+        unsigned int distance = (c->key > key) ? c->key - key : key - c->key;
+        if(!best || distance < bestDistance || (distance == bestDistance && c->key < best->key))
+        {
+            best = c;
+            bestDistance = distance;
+        }
+    }
+    
+    cairo_surface_t *surface = NULL;
+    if(best)
+    {
+        unlink_surface(best);
+        link_surface(best);
+        surface = cairo_surface_reference(best->surface);
+        *found = best->key;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return surface;
+}
+
+void surface_cache_put(CachedSurface **list, unsigned int key, cairo_surface_t *surface)
+{
+    pthread_mutex_lock(&cacheLock);
+    
+    // Another thread may have made it in the meantime
+    for(CachedSurface *c = *list; c; c = c->sibling)
+    {
+        if(c->key == key)
+        {
+            pthread_mutex_unlock(&cacheLock);
+            return;
+        }
+    }
+    
+    CachedSurface *c = calloc(1, sizeof(CachedSurface));
+    c->list = list;
+    c->key = key;
+    c->surface = cairo_surface_reference(surface);
+    c->size = (size_t)cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+    c->sibling = *list;
+    *list = c;
+    link_surface(c);
+    cacheSize += c->size;
+    
+    while(cacheSize > kSurfaceCacheSize && oldest != c)
+        drop_surface(oldest);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+size_t surface_cache_size(CachedSurface **list)
+{
+    size_t size = 0;
+    pthread_mutex_lock(&cacheLock);
+    for(CachedSurface *c = *list; c; c = c->sibling)
+        size += sizeof(CachedSurface) + c->size;
+    pthread_mutex_unlock(&cacheLock);
+    return size;
+}
+
+void surface_cache_drop(CachedSurface **list)
+{
+    pthread_mutex_lock(&cacheLock);
+    while(*list)
+        drop_surface(*list);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// Only call with cacheLock held
+static void drop_surface(CachedSurface *c)
+{
+    CachedSurface **link = c->list;
+    while(*link != c)
+        link = &(*link)->sibling;
+    *link = c->sibling;
+    
+    unlink_surface(c);
+    cacheSize -= c->size;
+    cairo_surface_destroy(c->surface);
+    free(c);
+}
+
+// Takes c out of the cache order
+static void unlink_surface(CachedSurface *c)
+{
+    if(c->newer)
+        c->newer->older = c->older;
+    else
+        newest = c->older;
+    if(c->older)
+        c->older->newer = c->newer;
+    else
+        oldest = c->newer;
+    c->newer = c->older = NULL;
+}
+
+// Puts c first in the cache order
+static void link_surface(CachedSurface *c)
+{
+    c->older = newest;
+    c->newer = NULL;
+    if(newest)
+        newest->newer = c;
+    newest = c;
+    if(!oldest)
+        oldest = c;
+}
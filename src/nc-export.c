@@ -0,0 +1,187 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-export.c: Writes notebooks out as PDF, a page at a time.
+ *   Each page is drawn and finished before the next is read, so
+ *   exporting a notebook straight from its file only ever holds
+ *   one of its pages.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <cairo/cairo-pdf.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Canvas units to PDF points. Pages are a unit wide, and the
+// default page is US Letter, 8.5in (612pt) wide.
+static const double kPointsPerUnit = 612;
+
+// Strokes are drawn as curves when their points are far enough
+// apart at this magnification, which is about as far as a PDF
+// viewer is usually zoomed in.
+static const float kExportMagnification = 4;
+
+// A page background, recorded once and painted onto every page
+// like it. Cairo writes a recording surface that's painted more
+// than once as a single PDF form object, so the pattern's lines
+// are only in the file once.
+typedef struct
+{
+    NCPagePattern pattern;
+    unsigned int density;
+    float width, height;
+    cairo_surface_t *form;
+} Background;
+
+static bool export_pdf(const char *pdfPath, NotedCanvas *canvas, PageReader *reader, size_t npages, NCExportCallback callback, void *data);
+static cairo_surface_t * get_background(Background **backgrounds, Page *p);
+static void free_background(Background *b);
+
+
+bool noted_canvas_export_pdf(NotedCanvas *self, const char *pdfPath, NCExportCallback callback, void *data)
+{
+    return export_pdf(pdfPath, self, NULL, pages_count(self), callback, data);
+}
+
+bool noted_file_export_pdf(const char *path, const char *pdfPath, NCExportCallback callback, void *data)
+{
+    PageReader *reader = page_reader_open(path);
+    if(reader)
+    {
+        bool ok = export_pdf(pdfPath, NULL, reader, page_reader_count(reader), callback, data);
+        page_reader_close(reader);
+        return ok;
+    }
+    
+    // v1 files can only be read whole
+    NotedCanvas *canvas = noted_canvas_open(path);
+    if(!canvas)
+        return false;
+    bool ok = noted_canvas_export_pdf(canvas, pdfPath, callback, data);
+    noted_canvas_destroy(canvas);
+    return ok;
+}
+
+// Pages come from reader if there is one, otherwise canvas
+static bool export_pdf(const char *pdfPath, NotedCanvas *canvas, PageReader *reader, size_t npages, NCExportCallback callback, void *data)
+{
+    // Each page sets its own size before it's drawn
+    cairo_surface_t *pdf = cairo_pdf_surface_create(pdfPath, kPointsPerUnit, kPointsPerUnit);
+    cairo_t *cr = cairo_create(pdf);
+    Background *backgrounds = array_new(sizeof(Background), (FreeNotify)free_background);
+    PageBackground *lastPdf = NULL;
+    bool ok = cairo_status(cr) == CAIRO_STATUS_SUCCESS;
+    
+    for(size_t i = 0; ok && i < npages; ++i)
+    {
+        Page *p = reader ? page_reader_read(reader, i) : pages_get(canvas, i);
+        if(!p)
+        {
+            ok = false;
+            break;
+        }
+        
+        cairo_pdf_surface_set_size(pdf, p->width * kPointsPerUnit, p->height * kPointsPerUnit);
+        cairo_save(cr);
+        cairo_scale(cr, kPointsPerUnit, kPointsPerUnit);
+        
+        // PDF pages are drawn from their PDF, as vectors, rather
+        // than shared
+        if(p->background)
+        {
+            NCRect pb = {0, 0, p->width, p->height};
+            draw_page(cr, p, &pb, kExportMagnification);
+        }
+        else
+        {
+            cairo_set_source_surface(cr, get_background(&backgrounds, p), 0, 0);
+            cairo_paint(cr);
+        }
+        
+        draw_images(cr, NULL, p, NULL, kExportMagnification);
+        draw_texts(cr, p, NULL);
+        
+        cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(array_size(s->x) == 0)
+                continue;
+            
+            cairo_set_line_width(cr, s->style.thickness);
+            cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+            draw_stroke(cr, s, kExportMagnification);
+        }
+        
+        cairo_restore(cr);
+        cairo_show_page(cr);
+        
+        // The page is in the file now, so a page read for it is
+        // done with. Its PDF is kept open for the pages after it.
+        if(reader)
+        {
+            if(p->background)
+            {
+                page_background_release(lastPdf);
+                lastPdf = page_background_retain(p->background);
+            }
+            free_page(p);
+        }
+        
+        ok = cairo_status(cr) == CAIRO_STATUS_SUCCESS;
+        if(ok && callback && !callback(i + 1, npages, data))
+            ok = false;
+    }
+    
+    cairo_destroy(cr);
+    cairo_surface_finish(pdf);
+    if(cairo_surface_status(pdf) != CAIRO_STATUS_SUCCESS)
+        ok = false;
+    cairo_surface_destroy(pdf);
+    array_free(backgrounds);
+    page_background_release(lastPdf);
+    
+    // Cancelled or failed exports don't leave half a file
+    if(!ok)
+        remove(pdfPath);
+    return ok;
+}
+
+// The recorded background for pages like p, recording it if
+// it's the first
+static cairo_surface_t * get_background(Background **backgrounds, Page *p)
+{
+    size_t n = array_size(*backgrounds);
+    for(size_t i = 0; i < n; ++i)
+    {
+        Background *b = &(*backgrounds)[i];
+        if(b->pattern == p->pattern && b->density == p->density
+           && b->width == p->width && b->height == p->height)
+            return b->form;
+    }
+    
+    cairo_rectangle_t extents = {0, 0, p->width, p->height};
+    Background b = {
+        .pattern = p->pattern,
+        .density = p->density,
+        .width = p->width,
+        .height = p->height,
+        .form = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents)
+    };
+    
+    cairo_t *cr = cairo_create(b.form);
+    NCRect pb = {0, 0, p->width, p->height};
+    draw_page(cr, p, &pb, kExportMagnification);
+    cairo_destroy(cr);
+    
+    *backgrounds = array_append(*backgrounds, &b);
+    return b.form;
+}
+
+static void free_background(Background *b)
+{
+    cairo_surface_destroy(b->form);
+}
@@ -0,0 +1,265 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-filecache.c: Remembers what noted_canvas_peek found out
+ *   about the notebooks in a directory, in a hidden file there,
+ *   so browsing a folder only reads the notebooks that changed.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Cache file identifier. The cache never leaves the machine, so
+// it's written in host order; one from a machine with the other
+// byte order fails this check and is rebuilt.
+static const uint32_t kCacheMagic = 0x819a70e9;
+static const char *kCacheName = ".noted-cache";
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t nentries;
+    // Followed by nentries FileCacheEntries
+} FileCacheHeader;
+
+typedef struct
+{
+    uint32_t nameLength;
+    int32_t npages; // -1 if the file isn't a notebook
+    int64_t modified;
+    int64_t size;
+    uint64_t nstrokes;
+    // Followed by the name, without a terminator, then npages
+    // NCPageInfos
+} FileCacheEntry;
+
+typedef struct
+{
+    char *name;
+    int64_t modified, size; // Of the file when it was peeked
+    NCFileInfo *info; // NULL if the file isn't a notebook
+    bool used; // Peeked since the cache was opened
+} CacheEntry;
+
+struct NCDirCache
+{
+    char *dir;
+    CacheEntry *entries;
+    bool dirty;
+};
+
+static void load_cache(NCDirCache *cache);
+static bool write_cache(NCDirCache *cache);
+static CacheEntry * find_entry(NCDirCache *cache, const char *name);
+static char * join_path(const char *dir, const char *name);
+static void free_entry(CacheEntry *e);
+
+
+NCDirCache * noted_dir_cache_open(const char *dir)
+{
+    NCDirCache *cache = calloc(1, sizeof(NCDirCache));
+    cache->dir = strdup(dir);
+    cache->entries = array_new(sizeof(CacheEntry), (FreeNotify)free_entry);
+    load_cache(cache);
+    return cache;
+}
+
+const NCFileInfo * noted_dir_cache_peek(NCDirCache *cache, const char *name)
+{
+    char *path = join_path(cache->dir, name);
+    if(!path)
+        return NULL;
+    
+    struct stat st;
+    CacheEntry *e = find_entry(cache, name);
+    if(stat(path, &st) != 0)
+    {
+        free(path);
+        return NULL;
+    }
+    
+    if(e && e->modified == stat_mtime_ns(&st) && e->size == st.st_size)
+    {
+        free(path);
+        e->used = true;
+        return e->info;
+    }
+    
+    NCFileInfo *info = noted_canvas_peek(path);
+    free(path);
+    
+    if(!e)
+    {
+        CacheEntry n = {.name = strdup(name)};
+        cache->entries = array_append(cache->entries, &n);
+        e = &cache->entries[array_size(cache->entries) - 1];
+    }
+    
+    // Files that aren't notebooks are remembered too, so they
+    // aren't read again until they change
+    free(e->info);
+    e->info = info;
+    e->modified = stat_mtime_ns(&st);
+    e->size = st.st_size;
+    e->used = true;
+    cache->dirty = true;
+    return info;
+}
+
+bool noted_dir_cache_close(NCDirCache *cache)
+{
+    // Forget files that are gone
+    size_t n = array_size(cache->entries);
+    for(size_t i = 0; i < n; ++i)
+    {
+        CacheEntry *e = &cache->entries[i];
+        if(e->used)
+            continue;
+        
+        struct stat st;
+        char *path = join_path(cache->dir, e->name);
+        if(path && stat(path, &st) != 0)
+        {
+            array_remove(cache->entries, i, true);
+            --i;
+            --n;
+            cache->dirty = true;
+        }
+        free(path);
+    }
+    
+    bool ok = !cache->dirty || write_cache(cache);
+    
+    array_free(cache->entries);
+    free(cache->dir);
+    free(cache);
+    return ok;
+}
+
+static void load_cache(NCDirCache *cache)
+{
+    char *path = join_path(cache->dir, kCacheName);
+    FILE *f = path ? fopen(path, "rb") : NULL;
+    free(path);
+    if(!f)
+        return;
+    
+    FileCacheHeader header;
+    if(fread(&header, sizeof(FileCacheHeader), 1, f) != 1 || header.magic != kCacheMagic)
+        goto done;
+    
+    for(uint32_t i = 0; i < header.nentries; ++i)
+    {
+        FileCacheEntry fe;
+        if(fread(&fe, sizeof(FileCacheEntry), 1, f) != 1 || fe.nameLength > FILENAME_MAX)
+            goto done;
+        
+        // Same layout as noted_canvas_peek's results
+        size_t npages = (fe.npages > 0) ? fe.npages : 0;
+        char *name = malloc(fe.nameLength + 1);
+        NCFileInfo *info = (fe.npages >= 0) ? malloc(sizeof(NCFileInfo) + sizeof(NCPageInfo) * npages) : NULL;
+        if(!name || (fe.npages >= 0 && !info)
+           || fread(name, 1, fe.nameLength, f) != fe.nameLength
+           || (npages > 0 && fread(info + 1, sizeof(NCPageInfo), npages, f) != npages))
+        {
+            free(name);
+            free(info);
+            goto done;
+        }
+        name[fe.nameLength] = '\0';
+        
+        if(info)
+        {
+            *info = (NCFileInfo){
+                .npages = npages,
+                .pages = (NCPageInfo *)(info + 1),
+                .nstrokes = fe.nstrokes,
+                .modified = fe.modified,
+                .size = fe.size
+            };
+        }
+        
+        CacheEntry e = {name, fe.modified, fe.size, info, false};
+        cache->entries = array_append(cache->entries, &e);
+    }
+
+done:
+    fclose(f);
+}
+
+// Writes the cache file through a temp file, so a reader never
+// sees half of it
+static bool write_cache(NCDirCache *cache)
+{
+    char *path = join_path(cache->dir, kCacheName);
+    char *tmpPath = join_path(cache->dir, ".noted-cache.tmp");
+    FILE *f = tmpPath ? fopen(tmpPath, "wb") : NULL;
+    bool ok = false;
+    if(!path || !f)
+        goto done;
+    
+    size_t n = array_size(cache->entries);
+    FileCacheHeader header = {kCacheMagic, (uint32_t)n};
+    if(fwrite(&header, sizeof(FileCacheHeader), 1, f) != 1)
+        goto done;
+    
+    for(size_t i = 0; i < n; ++i)
+    {
+        CacheEntry *e = &cache->entries[i];
+        FileCacheEntry fe = {
+            .nameLength = (uint32_t)strlen(e->name),
+            .npages = e->info ? (int32_t)e->info->npages : -1,
+            .modified = e->modified,
+            .size = e->size,
+            .nstrokes = e->info ? e->info->nstrokes : 0
+        };
+        
+        if(fwrite(&fe, sizeof(FileCacheEntry), 1, f) != 1
+           || fwrite(e->name, 1, fe.nameLength, f) != fe.nameLength
+           || (e->info && fwrite(e->info->pages, sizeof(NCPageInfo), e->info->npages, f) != e->info->npages))
+            goto done;
+    }
+    
+    ok = true;
+
+done:
+    if(f && fclose(f) != 0)
+        ok = false;
+    if(ok && rename(tmpPath, path) != 0)
+        ok = false;
+    if(!ok && f)
+        remove(tmpPath);
+    free(path);
+    free(tmpPath);
+    return ok;
+}
+
+static CacheEntry * find_entry(NCDirCache *cache, const char *name)
+{
+    size_t n = array_size(cache->entries);
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(strcmp(cache->entries[i].name, name) == 0)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static char * join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if(path)
+        snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static void free_entry(CacheEntry *e)
+{
+    free(e->name);
+    free(e->info);
+}
@@ -0,0 +1,543 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-images.c: Pictures on pages. An image is kept as the PNG or
+ *   JPEG it was inserted as, which is also what's saved, and is
+ *   decoded into a pyramid of sizes, each half the one before,
+ *   as it's drawn. Drawing uses the smallest size that's still
+ *   as big as the image is on screen, so a photo is scaled down
+ *   once per zoom level rather than on every draw. Decoded sizes
+ *   are kept in the surface cache (see nc-cache.c), and canvases
+ *   with an image callback decode them on a thread of their own.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef NC_HAVE_JPEG
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+// Levels of an image's pyramid, at most; level n is 1/2^n of
+// the image's size
+static const unsigned int kMaxLevels = 16;
+
+// JPEGs can be decoded at down to 1/8 of their size, which is
+// much faster than decoding all of them and halving
+static const unsigned int kMaxJpegScale = 3;
+
+// Gray drawn in place of an image that isn't decoded yet
+static const double kPlaceholderGray = 0.9;
+
+typedef enum
+{
+    kImagePNG,
+    kImageJPEG,
+} ImageFormat;
+
+struct ImageData_
+{
+    unsigned int refs; // Changed atomically
+    uint8_t *encoded; // The image file's contents
+    size_t size;
+    ImageFormat format;
+    int width, height; // Of the full image, in pixels
+    unsigned int nlevels;
+    CachedSurface *levels; // Decoded, keyed by level
+    unsigned int pending; // Levels queued to decode, as bits; guarded by the queue's lock
+    bool failed; // Couldn't be decoded, so isn't tried again; atomic, as decode threads set it
+};
+
+typedef struct
+{
+    ImageData *data;
+    unsigned int level;
+} ImageJob;
+
+struct ImageQueue_
+{
+    NotedCanvas *canvas;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // Signalled when there are jobs, or on stop
+    pthread_t thread;
+    bool started, stop;
+    ImageJob *jobs; // Waiting to be decoded, oldest first
+    NCImageCallback callback;
+    void *callbackData;
+};
+
+static bool read_size(const uint8_t *data, size_t size, ImageFormat *format, int *width, int *height);
+static unsigned int level_for_width(ImageData *d, double width);
+static bool queue_decode(ImageQueue *q, ImageData *d, unsigned int level);
+static void * image_worker(void *data);
+static cairo_surface_t * decode_level(ImageData *d, unsigned int level);
+static cairo_surface_t * halve(cairo_surface_t *src);
+static void paint_image(cairo_t *cr, cairo_surface_t *surface, const NCRect *r);
+#ifdef NC_HAVE_JPEG
+static cairo_surface_t * decode_jpeg(const uint8_t *data, size_t size, unsigned int scale);
+#endif
+
+
+void noted_canvas_set_image_callback(NotedCanvas *self, NCImageCallback callback, void *data)
+{
+    ImageQueue *q = self->imageQueue;
+    if(!q)
+    {
+        if(!callback)
+            return;
+        if(!(q = calloc(1, sizeof(ImageQueue))))
+            return;
+        q->canvas = self;
+        q->jobs = array_new(sizeof(ImageJob), NULL);
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->cond, NULL);
+        self->imageQueue = q;
+    }
+    
+    pthread_mutex_lock(&q->lock);
+    q->callback = callback;
+    q->callbackData = data;
+    pthread_mutex_unlock(&q->lock);
+}
+
+ImageData * image_data_new(const void *data, size_t size)
+{
+    ImageFormat format;
+    int width, height;
+    if(!read_size(data, size, &format, &width, &height))
+        return NULL;
+    
+    ImageData *d = calloc(1, sizeof(ImageData));
+    if(!d || !(d->encoded = malloc(size)))
+    {
+        free(d);
+        return NULL;
+    }
+    memcpy(d->encoded, data, size);
+    d->refs = 1;
+    d->size = size;
+    d->format = format;
+    d->width = width;
+    d->height = height;
+    
+    d->nlevels = 1;
+    while(d->nlevels < kMaxLevels && (width >> d->nlevels) > 0 && (height >> d->nlevels) > 0)
+        ++d->nlevels;
+    return d;
+}
+
+ImageData * image_data_retain(ImageData *d)
+{
+    __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+    return d;
+}
+
+void image_data_release(ImageData *d)
+{
+    if(!d || __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    surface_cache_drop(&d->levels);
+    free(d->encoded);
+    free(d);
+}
+
+const uint8_t * image_data_encoded(ImageData *d, size_t *size)
+{
+    *size = d->size;
+    return d->encoded;
+}
+
+bool image_data_info(ImageData *d, int *width, int *height)
+{
+    *width = d->width;
+    *height = d->height;
+#ifdef NC_HAVE_JPEG
+    return true;
+#else
+    return d->format == kImagePNG;
+#endif
+}
+
+void draw_images(cairo_t *cr, NotedCanvas *canvas, Page *p, const NCRect *clip, float magnification)
+{
+    ImageQueue *q = canvas ? canvas->imageQueue : NULL;
+    bool vector = target_is_vector(cr);
+    
+    size_t n = array_size(p->images);
+    for(size_t i = 0; i < n; ++i)
+    {
+        Image *img = &p->images[i];
+        ImageData *d = img->data;
+        const NCRect *r = &img->bounds;
+        if(clip && (r->x2 < clip->x1 || r->x1 > clip->x2 || r->y2 < clip->y1 || r->y1 > clip->y2))
+            continue;
+        
+        cairo_surface_t *surface = NULL;
+        if(__atomic_load_n(&d->failed, __ATOMIC_RELAXED))
+        {
+            // Left as a placeholder
+        }
+        else if(vector)
+        {
+            // Vector targets get the whole image, and JPEGs go in
+            // as they are instead of encoded again
+            surface = decode_level(d, 0);
+            if(surface && d->format == kImageJPEG)
+            {
+                image_data_retain(d);
+                cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_JPEG, d->encoded, d->size,
+                                            (cairo_destroy_func_t)image_data_release, d);
+            }
+        }
+        else
+        {
+            double dx = r->x2 - r->x1, dy = 0;
+            cairo_user_to_device_distance(cr, &dx, &dy);
+            unsigned int level = level_for_width(d, hypot(dx, dy) * magnification);
+            
+            // A size that's cached stands in while the right one is
+            // decoded in the background
+            unsigned int found;
+            surface = surface_cache_get_nearest(&d->levels, level, &found);
+            if((!surface || found != level) && !(q && queue_decode(q, d, level)))
+            {
+                if(surface)
+                    cairo_surface_destroy(surface);
+                if((surface = decode_level(d, level)))
+                    surface_cache_put(&d->levels, level, surface);
+            }
+        }
+        
+        paint_image(cr, surface, r);
+    }
+}
+
+void images_stop(NotedCanvas *self)
+{
+    ImageQueue *q = self->imageQueue;
+    if(!q)
+        return;
+    
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    if(q->started)
+        pthread_join(q->thread, NULL);
+    
+    // Decodes that didn't start are dropped
+    size_t njobs = array_size(q->jobs);
+    for(size_t i = 0; i < njobs; ++i)
+    {
+        q->jobs[i].data->pending &= ~(1u << q->jobs[i].level);
+        image_data_release(q->jobs[i].data);
+    }
+    
+    array_free(q->jobs);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+    self->imageQueue = NULL;
+}
+
+size_t image_data_memory(ImageData *d, size_t *cached)
+{
+    *cached = surface_cache_size(&d->levels);
+    return sizeof(ImageData) + d->size;
+}
+
+void free_image(Image *img)
+{
+    image_data_release(img->data);
+}
+
+// Reads an image's size from its header, without decoding it.
+// Returns false if it isn't a PNG or JPEG.
+static bool read_size(const uint8_t *data, size_t size, ImageFormat *format, int *width, int *height)
+{
+    static const uint8_t kPngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    
+    // The IHDR chunk comes first, and starts with the size
+    if(size >= 24 && memcmp(data, kPngSignature, 8) == 0 && memcmp(data + 12, "IHDR", 4) == 0)
+    {
+        *format = kImagePNG;
+        *width = (int)((uint32_t)data[16] << 24 | data[17] << 16 | data[18] << 8 | data[19]);
+        *height = (int)((uint32_t)data[20] << 24 | data[21] << 16 | data[22] << 8 | data[23]);
+        return *width > 0 && *height > 0;
+    }
+    
+    // The size is in the start of frame segment, after any number
+    // of others
+    if(size < 4 || data[0] != 0xff || data[1] != 0xd8)
+        return false;
+    size_t i = 2;
+    while(i + 4 <= size && data[i] == 0xff)
+    {
+        uint8_t marker = data[i + 1];
+        size_t length = data[i + 2] << 8 | data[i + 3];
+        if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+        {
+            if(i + 9 > size)
+                return false;
+            *format = kImageJPEG;
+            *height = data[i + 5] << 8 | data[i + 6];
+            *width = data[i + 7] << 8 | data[i + 8];
+            return *width > 0 && *height > 0;
+        }
+        i += 2 + length;
+    }
+    return false;
+}
+
+// The smallest level that's at least width pixels wide
+static unsigned int level_for_width(ImageData *d, double width)
+{
+    unsigned int level = 0;
+    while(level + 1 < d->nlevels && (d->width >> (level + 1)) >= width)
+        ++level;
+    return level;
+}
+
+// Queues level of d to be decoded, unless it already is.
+// Returns false if the canvas decodes images as it draws them.
+static bool queue_decode(ImageQueue *q, ImageData *d, unsigned int level)
+{
+    pthread_mutex_lock(&q->lock);
+    if(!q->callback)
+    {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    
+    if(!q->started && !(q->started = pthread_create(&q->thread, NULL, image_worker, q) == 0))
+    {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    
+    if(!(d->pending & (1u << level)))
+    {
+        ImageJob job = {image_data_retain(d), level};
+        q->jobs = array_append(q->jobs, &job);
+        d->pending |= 1u << level;
+        pthread_cond_signal(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+static void * image_worker(void *data)
+{
+    ImageQueue *q = data;
+    bool ready = false; // Decoded since the callback was last called
+    
+    pthread_mutex_lock(&q->lock);
+    while(!q->stop)
+    {
+        size_t njobs = array_size(q->jobs);
+        if(njobs == 0)
+        {
+            // Everything asked for is decoded, so the canvas can
+            // be redrawn with it
+            if(ready && q->callback)
+            {
+                NCImageCallback callback = q->callback;
+                void *callbackData = q->callbackData;
+                pthread_mutex_unlock(&q->lock);
+                callback(q->canvas, callbackData);
+                pthread_mutex_lock(&q->lock);
+                ready = false;
+                continue;
+            }
+            pthread_cond_wait(&q->cond, &q->lock);
+            continue;
+        }
+        
+        // The newest request is the likeliest to still be on screen
+        ImageJob job = q->jobs[njobs - 1];
+        array_remove(q->jobs, njobs - 1, false);
+        pthread_mutex_unlock(&q->lock);
+        
+        cairo_surface_t *surface = decode_level(job.data, job.level);
+        if(surface)
+        {
+            surface_cache_put(&job.data->levels, job.level, surface);
+            cairo_surface_destroy(surface);
+            ready = true;
+        }
+        
+        pthread_mutex_lock(&q->lock);
+        job.data->pending &= ~(1u << job.level);
+        image_data_release(job.data);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// Decodes d at level, or returns NULL and marks d failed if it
+// can't be
+static cairo_surface_t * decode_level(ImageData *d, unsigned int level)
+{
+    cairo_surface_t *surface = NULL;
+    unsigned int decoded = 0; // Level the decoder gave
+    if(d->format == kImagePNG)
+        surface = thumbnail_decode(d->encoded, d->size);
+#ifdef NC_HAVE_JPEG
+    else
+    {
+        decoded = (level < kMaxJpegScale) ? level : kMaxJpegScale;
+        surface = decode_jpeg(d->encoded, d->size, decoded);
+    }
+#endif
+    
+    for(; surface && decoded < level; ++decoded)
+    {
+        cairo_surface_t *half = halve(surface);
+        cairo_surface_destroy(surface);
+        surface = half;
+    }
+    
+    if(!surface)
+        __atomic_store_n(&d->failed, true, __ATOMIC_RELAXED);
+    return surface;
+}
+
+// Scales a 32 bit surface down by half, averaging each 2x2 block
+static cairo_surface_t * halve(cairo_surface_t *src)
+{
+    cairo_format_t format = cairo_image_surface_get_format(src);
+    if(format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+        return NULL;
+    
+    int w = cairo_image_surface_get_width(src), h = cairo_image_surface_get_height(src);
+    int hw = (w > 1) ? w / 2 : 1, hh = (h > 1) ? h / 2 : 1;
+    cairo_surface_t *dst = cairo_image_surface_create(format, hw, hh);
+    if(cairo_surface_status(dst) != CAIRO_STATUS_SUCCESS)
+    {
+        cairo_surface_destroy(dst);
+        return NULL;
+    }
+    
+    cairo_surface_flush(src);
+    cairo_surface_flush(dst);
+    const uint8_t *in = cairo_image_surface_get_data(src);
+    uint8_t *out = cairo_image_surface_get_data(dst);
+    int inStride = cairo_image_surface_get_stride(src), outStride = cairo_image_surface_get_stride(dst);
+    
+    for(int y = 0; y < hh; ++y)
+    {
+        const uint8_t *r0 = in + (size_t)inStride * ((2 * y < h) ? 2 * y : h - 1);
+        const uint8_t *r1 = in + (size_t)inStride * ((2 * y + 1 < h) ? 2 * y + 1 : h - 1);
+        uint8_t *o = out + (size_t)outStride * y;
+        for(int x = 0; x < hw; ++x)
+        {
+            int x0 = 4 * ((2 * x < w) ? 2 * x : w - 1);
+            int x1 = 4 * ((2 * x + 1 < w) ? 2 * x + 1 : w - 1);
+            for(int c = 0; c < 4; ++c)
+                o[4 * x + c] = (r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) / 4;
+        }
+    }
+    
+    cairo_surface_mark_dirty(dst);
+    return dst;
+}
+
+// Paints surface into r, or a placeholder if it's NULL, and
+// releases surface
+static void paint_image(cairo_t *cr, cairo_surface_t *surface, const NCRect *r)
+{
+    cairo_save(cr);
+    cairo_new_path(cr);
+    if(surface)
+    {
+        cairo_translate(cr, r->x1, r->y1);
+        cairo_scale(cr, (r->x2 - r->x1) / cairo_image_surface_get_width(surface),
+                        (r->y2 - r->y1) / cairo_image_surface_get_height(surface));
+        cairo_set_source_surface(cr, surface, 0, 0);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+        cairo_paint(cr);
+        cairo_surface_destroy(surface);
+    }
+    else
+    {
+        cairo_set_source_rgb(cr, kPlaceholderGray, kPlaceholderGray, kPlaceholderGray);
+        cairo_rectangle(cr, r->x1, r->y1, r->x2 - r->x1, r->y2 - r->y1);
+        cairo_fill(cr);
+    }
+    cairo_restore(cr);
+}
+
+#ifdef NC_HAVE_JPEG
+
+typedef struct
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} JpegError;
+
+// libjpeg exits on errors unless they jump out
+static void jpeg_error(j_common_ptr info)
+{
+    longjmp(((JpegError *)info->err)->jump, 1);
+}
+
+// Decodes a JPEG at 1/2^scale of its size
+static cairo_surface_t * decode_jpeg(const uint8_t *data, size_t size, unsigned int scale)
+{
+    struct jpeg_decompress_struct info;
+    JpegError err;
+    cairo_surface_t *volatile surface = NULL;
+    uint8_t *volatile row = NULL;
+    
+    info.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error;
+    if(setjmp(err.jump))
+    {
+        jpeg_destroy_decompress(&info);
+        free(row);
+        if(surface)
+            cairo_surface_destroy(surface);
+        return NULL;
+    }
+    
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, (unsigned char *)data, size);
+    jpeg_read_header(&info, TRUE);
+    info.scale_num = 1;
+    info.scale_denom = 1 << scale;
+    info.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&info);
+    
+    surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, info.output_width, info.output_height);
+    row = malloc((size_t)info.output_width * 3);
+    if(!row || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+        longjmp(err.jump, 1);
+    
+    cairo_surface_flush(surface);
+    uint8_t *pixels = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    while(info.output_scanline < info.output_height)
+    {
+        uint32_t *dst = (uint32_t *)(pixels + (size_t)stride * info.output_scanline);
+        JSAMPROW rows[1] = {row};
+        jpeg_read_scanlines(&info, rows, 1);
+        for(unsigned int x = 0; x < info.output_width; ++x)
+            dst[x] = 0xff000000 | row[3 * x] << 16 | row[3 * x + 1] << 8 | row[3 * x + 2];
+    }
+    cairo_surface_mark_dirty(surface);
+    
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    free(row);
+    return surface;
+}
+
+#endif
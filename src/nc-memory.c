@@ -0,0 +1,141 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-memory.c: Accounting for the memory a canvas uses, page by
+ *   page, and giving back what arrays hold in reserve. Arrays
+ *   double as they grow, so a long session leaves most of them
+ *   with room they'll never use.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void page_memory(NotedCanvas *canvas, Page *p, NCMemoryStats *stats);
+static void add_array(NCMemoryStats *stats, NCMemoryKind kind, void *array);
+
+
+void noted_canvas_get_memory(NotedCanvas *self, NCMemoryStats *stats)
+{
+    memset(stats, 0, sizeof(NCMemoryStats));
+    for(Page *p = pages_first(self); p; p = page_next(p))
+        page_memory(self, p, stats);
+    
+    stats->live[kNCMemoryPages] += sizeof(NotedCanvas);
+    add_array(stats, kNCMemoryPages, self->damage);
+    add_array(stats, kNCMemoryPages, self->lassoX);
+    add_array(stats, kNCMemoryPages, self->lassoY);
+    
+    // Only used while saving, so all of it is slack in between
+    size_t saveBuffer = save_buffer_memory(self);
+    stats->live[kNCMemoryCaches] += saveBuffer;
+    stats->slack[kNCMemoryCaches] += saveBuffer;
+}
+
+bool noted_canvas_get_page_memory(NotedCanvas *self, size_t index, NCMemoryStats *stats)
+{
+    memset(stats, 0, sizeof(NCMemoryStats));
+    Page *p = pages_get(self, index);
+    if(!p)
+        return false;
+    page_memory(self, p, stats);
+    return true;
+}
+
+void noted_canvas_trim(NotedCanvas *self)
+{
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        // The stroke in progress keeps the room it has for the
+        // rest of its points, and has to be found again if the
+        // page's strokes move
+        Stroke *current = self->currentStroke;
+        size_t currentIndex = (current && current->page == p) ? (size_t)(current - p->strokes) : SIZE_MAX;
+        
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(j == currentIndex)
+                continue;
+            s->x = array_trim(s->x);
+            s->y = array_trim(s->y);
+            if(s->p)
+                s->p = array_trim(s->p);
+            if(s->outline)
+                s->outline = array_trim(s->outline);
+        }
+        
+        p->strokes = array_trim(p->strokes);
+        p->images = array_trim(p->images);
+        p->texts = array_trim(p->texts);
+        if(currentIndex != SIZE_MAX)
+            self->currentStroke = &p->strokes[currentIndex];
+    }
+    
+    if(self->damage)
+        self->damage = array_trim(self->damage);
+    
+    free(self->saveBuffer);
+    self->saveBuffer = NULL;
+}
+
+// Adds what p takes to stats
+static void page_memory(NotedCanvas *self, Page *p, NCMemoryStats *stats)
+{
+    stats->live[kNCMemoryPages] += sizeof(Page);
+    
+    // Headers are in the page's stroke array, and points in each
+    // stroke's own arrays
+    add_array(stats, kNCMemoryStrokes, p->strokes);
+    size_t nstrokes = array_size(p->strokes);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        Stroke *s = &p->strokes[j];
+        add_array(stats, kNCMemoryPoints, s->x);
+        add_array(stats, kNCMemoryPoints, s->y);
+        add_array(stats, kNCMemoryPoints, s->p);
+        add_array(stats, kNCMemoryPoints, s->outline);
+        
+        // Curves are drawn from control points in arrays on the
+        // stack, four for the points and four to work them out
+        size_t npoints = array_size(s->x);
+        size_t stack = (npoints > 2) ? 8 * sizeof(float) * npoints : 0;
+        if(stack > stats->stack)
+            stats->stack = stack;
+    }
+    
+    size_t cached;
+    add_array(stats, kNCMemoryPages, p->images);
+    size_t nimages = array_size(p->images);
+    for(size_t j = 0; j < nimages; ++j)
+    {
+        stats->live[kNCMemoryPages] += image_data_memory(p->images[j].data, &cached);
+        stats->live[kNCMemoryCaches] += cached;
+    }
+    
+    add_array(stats, kNCMemoryPages, p->texts);
+    size_t ntexts = array_size(p->texts);
+    for(size_t j = 0; j < ntexts; ++j)
+    {
+        stats->live[kNCMemoryPages] += strlen(p->texts[j].text) + 1;
+        stats->live[kNCMemoryCaches] += text_layout_memory(p->texts[j].layout);
+    }
+    
+    if(p->background)
+    {
+        stats->live[kNCMemoryPages] += page_background_memory(p->background, &cached);
+        stats->live[kNCMemoryCaches] += cached;
+    }
+    
+    stats->live[kNCMemoryCaches] += thumbnail_memory(self, p);
+    stats->live[kNCMemoryCaches] += page_snapshot_memory(p);
+}
+
+static void add_array(NCMemoryStats *stats, NCMemoryKind kind, void *array)
+{
+    stats->live[kind] += array_allocated(array);
+    stats->slack[kind] += array_slack(array);
+}
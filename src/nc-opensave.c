@@ -8,11 +8,26 @@
 #include "nc-private.h"
 #include "array.h"
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <math.h>
-#include <float.h>
+#include <stddef.h>
+#include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
+// File identifiers, one per format version
 static const uint32_t kMagic1 = 0x819a70ce;
+static const uint32_t kMagic2 = 0x819a70cf; // Adds stroke flags and pressure
+static const uint32_t kMagic3 = 0x819a70d0; // Adds the page table
 
 typedef struct
 {
@@ -21,6 +36,37 @@ typedef struct
     // Followed by npages FilePages
 } FileHeader;
 
+// Since v3, pages are self-contained blocks found through a
+// table, so they can be read independently of each other, or
+// moved between files as they are.
+typedef struct
+{
+    uint32_t npages;
+    uint16_t nundo;
+    uint16_t entrySize; // Of each FilePageEntry; newer fields are skipped
+    // Followed by npages FilePageEntries, then the page blocks
+} FileHeader3;
+
+typedef struct
+{
+    uint32_t offset; // From the start of the file
+    uint32_t size; // Of the block: a FilePage, its FileStrokes and FileRecords, and thumbnail
+    
+    // Since entrySize 24: the block's FilePage in short, so a
+    // file can be browsed from its table alone
+    uint32_t nstrokes;
+    uint16_t pattern; // NCPagePattern
+    uint16_t patternDensity;
+    float width, height;
+    
+    // Since entrySize 28: size of the PNG thumbnail at the end
+    // of the block, or 0 for none
+    uint32_t thumbSize;
+} FilePageEntry;
+
+// Size of the entries of the first v3 files
+static const size_t kMinPageEntrySize = offsetof(FilePageEntry, nstrokes);
+
 typedef struct
 {
     uint32_t nstrokes;
@@ -30,11 +76,60 @@ typedef struct
     // Followed by nstrokes FileStrokes
 } FilePage;
 
+// Records that follow a page's FileStrokes, to the end of its
+// block. Readers skip the types they don't know, and readers
+// from before records stop at the strokes.
+typedef enum
+{
+    kFileRecordBackground = 1, // A FileBackground
+    kFileRecordImage = 2, // A FileImage
+    kFileRecordText = 3, // A FileText
+} FileRecordType;
+
+typedef struct
+{
+    uint32_t type; // FileRecordType
+    uint32_t size; // Of what follows
+} FileRecord;
+
+// The PDF page behind a kNCPagePDF page
+typedef struct
+{
+    uint32_t index; // Page of the PDF, from 0
+    // Followed by the PDF's path, without a terminator, to the
+    // end of the record
+} FileBackground;
+
+// An image on the page, under its strokes
+typedef struct
+{
+    NCRect bounds; // Page coordinates
+    // Followed by the image's PNG or JPEG file, to the end of
+    // the record
+} FileImage;
+
+// A text box on the page, over its images and under its strokes
+typedef struct
+{
+    NCRect bounds; // Page coordinates; the height is redone from the text when read
+    float size; // Font size
+    uint8_t r, g, b, a;
+    // Followed by the text, in UTF-8 and without a terminator,
+    // to the end of the record
+} FileText;
+
+typedef enum
+{
+    kFileStrokePressure = 1 << 0,
+} FileStrokeFlags;
+
 typedef struct
 {
     uint32_t npoints;
     NCStrokeStyle style;
-    // Followed by npoints x's, then npoints y's
+    uint32_t flags; // FileStrokeFlags, since v2
+    // Followed by npoints x's, then npoints y's,
+    // then npoints pressures if kFileStrokePressure
 } FileStroke;
 
 //typedef struct
@@ -42,17 +137,118 @@ typedef struct
 //    uint16_t undoType;
 //} FileUndo;
 
+// Clipboard identifier. Clips are made of the same page and
+// stroke records as the current file version, so they can be
+// pasted into any canvas.
+static const uint32_t kClipMagic = 0x819a70e1; // Adds page block sizes
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t size; // Of the whole clip, including this header
+    uint32_t npages; // 0 for a clip of strokes
+    uint32_t nstrokes; // 0 for a clip of pages
+    // Followed by nstrokes FileStrokes, or npages page blocks,
+    // each after its size as a uint32
+} FileClip;
+
+
+// A page block to copy from an open file
+typedef struct
+{
+    FILE *f;
+    FilePageEntry entry;
+} BlockRef;
+
+// Output that records are encoded straight into, written out
+// whenever it fills up
+typedef struct
+{
+    int fd;
+    uint8_t *data;
+    size_t used, capacity;
+    bool failed;
+} SaveBuffer;
+
+static const size_t kSaveBufferSize = 1 << 20;
+
+// Strokes with a record bigger than this have their points
+// written from where they are instead of copied into the buffer
+static const size_t kDirectWriteSize = 1 << 16;
+
+// Pages of a v3 file being decoded by one or more threads. Each
+// thread takes the next page not yet taken until there are none
+// left, or until one fails.
+typedef struct
+{
+    int fd;
+    const FilePageEntry *table;
+    size_t npages;
+    size_t next; // Next page to take, atomically
+    bool failed;
+    Page **pages; // Decoded pages, in page order
+} DecodeJob;
+
+static const unsigned int kMaxDecodeThreads = 16;
+
+struct PageReader_
+{
+    FILE *f;
+    FilePageEntry *table;
+    uint8_t *block; // Last block read, reused for the next
+    size_t capacity;
+};
+
+// Decoding builds stroke outlines, which keep per point arrays on
+// the stack, so threads get a main thread sized stack
+static const size_t kDecodeStackSize = 8 << 20;
 
-NotedCanvas * load_canvas_v1(FILE *f);
 
-static float ntohf(float val);
-static float htonf(float val);
+static NotedCanvas * load_canvas(FILE *f, int version);
+static NotedCanvas * load_canvas_v3(FILE *f, unsigned int nthreads);
+static void * decode_worker(void *data);
+static bool read_at(int fd, void *dst, size_t size, off_t offset);
+static FilePageEntry * read_page_table(FILE *f, uint32_t magic);
+static void summarize_page(FilePageEntry *entry, const FilePage *fp);
+static void entry_to_file(FilePageEntry *entry);
+static FILE * open_blocks(const char *path, FilePageEntry **table);
+static bool write_blocks(const char *path, const BlockRef *blocks, size_t n);
+static BlockRef * append_blocks(BlockRef *blocks, FILE *f, const FilePageEntry *table, size_t first, size_t n);
+static bool same_file(const char *a, const char *b);
+static FILE * open_temp(const char *path, char **tmpPath);
+static bool commit_temp(FILE *f, char *tmpPath, const char *path, bool ok);
+static uint8_t * save_reserve(SaveBuffer *b, size_t size);
+static bool save_flush(SaveBuffer *b, const struct iovec *arrays, int narrays);
+static bool save_stroke(SaveBuffer *b, Stroke *s);
+static bool write_all(int fd, struct iovec *iov, int n);
+static size_t page_block_size(Page *p);
+static Page * decode_page(const uint8_t *src, const uint8_t *end, const FilePageEntry *e);
+static size_t records_size(Page *p);
+static bool save_records(SaveBuffer *b, Page *p);
+static uint8_t * encode_records(uint8_t *dst, Page *p);
+static uint8_t * encode_background(uint8_t *dst, Page *p);
+static uint8_t * encode_image_header(uint8_t *dst, Image *img);
+static uint8_t * encode_text(uint8_t *dst, TextBox *t);
+static const uint8_t * decode_records(const uint8_t *src, const uint8_t *end, Page *p);
+static size_t stroke_record_size(Stroke *s);
+static uint8_t * encode_stroke(uint8_t *dst, Stroke *s, float dx, float dy);
+static uint8_t * encode_stroke_header(uint8_t *dst, Stroke *s);
+static const uint8_t * decode_stroke(const uint8_t *src, const uint8_t *end, Stroke *s, float dx, float dy);
+static uint8_t * encode_floats(uint8_t *dst, const float *src, size_t n, float offset);
+static void decode_floats(float *dst, const uint8_t *src, size_t n);
+static void decode_points(Stroke *s, const uint8_t *xsrc, const uint8_t *ysrc, size_t n, float dx, float dy);
 
 
 NotedCanvas * noted_canvas_open(const char *path)
+{
+    return noted_canvas_open_with_threads(path, 0);
+}
+
+NotedCanvas * noted_canvas_open_with_threads(const char *path, unsigned int nthreads)
 {
     uint32_t magic = 0;
     NotedCanvas *canvas = NULL;
+    uint64_t start = stats_now();
     
     FILE *f = fopen(path, "rb");
     
@@ -66,18 +262,185 @@ NotedCanvas * noted_canvas_open(const char *path)
     }
     
     // Test file identifier
-    switch(magic)
+    if(magic == kMagic1)
+        canvas = load_canvas(f, 1);
+    else if(magic == kMagic2)
+        canvas = load_canvas(f, 2);
+    else if(magic == kMagic3)
+        canvas = load_canvas_v3(f, nthreads);
+    
+    if(canvas)
+        canvas->path = strdup(path);
+    
+    fclose(f);
+    if(canvas)
+        stats_end(canvas, kNCStatOpen, start);
+    return canvas;
+}
+
+NCFileInfo * noted_canvas_peek(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return NULL;
+    
+    struct stat st;
+    uint32_t magic = 0;
+    FilePageEntry *table = NULL;
+    NCFileInfo *info = NULL;
+    
+    if(fstat(fileno(f), &st) != 0 || fread(&magic, sizeof(uint32_t), 1, f) != 1)
+        goto done;
+    
+    if(magic != kMagic1)
+        table = read_page_table(f, magic);
+    else
     {
-        case kMagic1: canvas = load_canvas_v1(f); break;
+        // v1 files have nothing to go on but their strokes
+        NotedCanvas *canvas = noted_canvas_open(path);
+        if(!canvas)
+            goto done;
+        table = array_new(sizeof(FilePageEntry), NULL);
+        for(Page *p = pages_first(canvas); p; p = page_next(p))
+        {
+            FilePageEntry entry = {
+                .nstrokes = (uint32_t)array_size(p->strokes),
+                .pattern = p->pattern,
+                .patternDensity = p->density,
+                .width = p->width,
+                .height = p->height
+            };
+            table = array_append(table, &entry);
+        }
+        noted_canvas_destroy(canvas);
     }
+    if(!table)
+        goto done;
+    
+    // Pages are stored right after the info, so it's one free
+    size_t npages = array_size(table);
+    info = malloc(sizeof(NCFileInfo) + sizeof(NCPageInfo) * npages);
+    if(!info)
+        goto done;
     
-    canvas->path = strdup(path);
+    *info = (NCFileInfo){
+        .npages = npages,
+        .pages = (NCPageInfo *)(info + 1),
+        .modified = stat_mtime_ns(&st),
+        .size = st.st_size
+    };
+    for(size_t i = 0; i < npages; ++i)
+    {
+        info->pages[i] = (NCPageInfo){
+            .width = table[i].width,
+            .height = table[i].height,
+            .pattern = table[i].pattern,
+            .density = table[i].patternDensity,
+            .nstrokes = table[i].nstrokes,
+            .hasThumbnail = table[i].thumbSize > 0
+        };
+        info->nstrokes += table[i].nstrokes;
+    }
     
+done:
+    array_free(table);
     fclose(f);
-    return canvas;
+    return info;
+}
+
+cairo_surface_t * noted_file_get_thumbnail(const char *path, size_t index)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return NULL;
+    
+    uint32_t magic = 0;
+    FilePageEntry *table = NULL;
+    uint8_t *png = NULL;
+    cairo_surface_t *surface = NULL;
+    
+    // Only v3 files have thumbnails
+    if(fread(&magic, sizeof(uint32_t), 1, f) != 1 || magic != kMagic3
+       || !(table = read_page_table(f, magic)) || index >= array_size(table))
+        goto done;
+    
+    const FilePageEntry *e = &table[index];
+    if(e->thumbSize == 0 || !(png = malloc(e->thumbSize))
+       || !read_at(fileno(f), png, e->thumbSize, e->offset + e->size - e->thumbSize))
+        goto done;
+    surface = thumbnail_decode(png, e->thumbSize);
+
+done:
+    free(png);
+    array_free(table);
+    fclose(f);
+    return surface;
+}
+
+PageReader * page_reader_open(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return NULL;
+    
+    // v1 blocks can't be read on their own
+    uint32_t magic = 0;
+    FilePageEntry *table;
+    if(fread(&magic, sizeof(uint32_t), 1, f) != 1 || magic == kMagic1
+       || !(table = read_page_table(f, magic)))
+    {
+        fclose(f);
+        return NULL;
+    }
+    
+    PageReader *r = calloc(1, sizeof(PageReader));
+    if(!r)
+    {
+        array_free(table);
+        fclose(f);
+        return NULL;
+    }
+    r->f = f;
+    r->table = table;
+    return r;
+}
+
+size_t page_reader_count(PageReader *r)
+{
+    return array_size(r->table);
+}
+
+Page * page_reader_read(PageReader *r, size_t index)
+{
+    if(index >= array_size(r->table))
+        return NULL;
+    
+    const FilePageEntry *e = &r->table[index];
+    if(e->size > r->capacity)
+    {
+        uint8_t *b = realloc(r->block, e->size);
+        if(!b)
+            return NULL;
+        r->block = b;
+        r->capacity = e->size;
+    }
+    
+    if(!read_at(fileno(r->f), r->block, e->size, e->offset))
+        return NULL;
+    return decode_page(r->block, r->block + e->size - e->thumbSize, e);
+}
+
+void page_reader_close(PageReader *r)
+{
+    if(!r)
+        return;
+    array_free(r->table);
+    free(r->block);
+    fclose(r->f);
+    free(r);
 }
 
-NotedCanvas * load_canvas_v1(FILE *f)
+static NotedCanvas * load_canvas(FILE *f, int version)
 {
     // Load main canvas object
     FileHeader header;
@@ -89,9 +452,6 @@ NotedCanvas * load_canvas_v1(FILE *f)
     
     NotedCanvas *canvas = calloc(1, sizeof(NotedCanvas));
     
-    canvas->pages = array_new(sizeof(Page), (FreeNotify)free_page);
-    canvas->pages = array_reserve(canvas->pages, header.npages, false);
-    
     // Load each page
     for(int i = 0; i < header.npages; ++i)
     {
@@ -100,35 +460,37 @@ NotedCanvas * load_canvas_v1(FILE *f)
             goto fail;
         
         // Convert read page data to local endianness
-        fp.bounds.x1 = ntohf(fp.bounds.x1);
-        fp.bounds.x2 = ntohf(fp.bounds.x2);
-        fp.bounds.y1 = ntohf(fp.bounds.y1);
-        fp.bounds.y2 = ntohf(fp.bounds.y2);
+        fp.bounds.x1 = file_float(fp.bounds.x1);
+        fp.bounds.x2 = file_float(fp.bounds.x2);
+        fp.bounds.y1 = file_float(fp.bounds.y1);
+        fp.bounds.y2 = file_float(fp.bounds.y2);
         fp.nstrokes = ntohl(fp.nstrokes);
         fp.pattern = ntohs(fp.pattern);
         fp.patternDensity = ntohs(fp.patternDensity);
 
-        // Add read page data to canvas
-        canvas->pages = array_append(canvas->pages, NULL);
-        
-        Page *p = &canvas->pages[i];
-        
-        p->bounds = fp.bounds;
-        p->density = fp.patternDensity,
-        p->pattern = fp.pattern,
-        p->strokes = array_new(sizeof(Stroke), (FreeNotify)free_stroke);
+        // Add read page data to canvas. Pages are laid out from
+        // their sizes, so the stored position is only a hint. v1
+        // and v2 bounds are absolute, so far down a notebook the
+        // size can round; that happens once, since saves store it
+        // exactly from then on.
+        Page *p = page_new(fp.bounds.x2 - fp.bounds.x1, fp.bounds.y2 - fp.bounds.y1, fp.pattern, fp.patternDensity);
+        pages_insert(canvas, i, p);
         p->strokes = array_reserve(p->strokes, fp.nstrokes, false);
 
+        // v1 strokes don't have flags
+        size_t strokeSize = (version >= 2) ? sizeof(FileStroke) : offsetof(FileStroke, flags);
+        
         // For each stroke in page
         for(int j = 0; j < fp.nstrokes; ++j)
         {
-            FileStroke fs;
-            if(fread(&fs, sizeof(FileStroke), 1, f) != 1)
+            FileStroke fs = {0};
+            if(fread(&fs, strokeSize, 1, f) != 1)
                 goto fail;
             
             // Convert stroke data to local endianness
             fs.npoints = ntohl(fs.npoints);
-            fs.style.thickness = ntohf(fs.style.thickness);
+            fs.style.thickness = file_float(fs.style.thickness);
+            fs.flags = ntohl(fs.flags);
 
             // Add stroke
             p->strokes = array_append(p->strokes, NULL);
@@ -153,22 +515,19 @@ NotedCanvas * load_canvas_v1(FILE *f)
             if(fread(s->y, sizeof(float), fs.npoints, f) != fs.npoints)
                 goto fail;
             
-            // Calculate stroke's bounding box and maxDistSq
-            s->x[0] = ntohf(s->x[0]);
-            s->y[0] = ntohf(s->y[0]);
-            s->bounds.x1 = s->bounds.x2 = s->x[0];
-            s->bounds.y1 = s->bounds.y2 = s->y[0];
-            
-            for(int k = 1; k < fs.npoints; ++k)
+            if(fs.flags & kFileStrokePressure)
             {
-                s->x[k] = ntohf(s->x[k]);
-                s->y[k] = ntohf(s->y[k]);
-                rect_expand_by_point(&s->bounds, s->x[k], s->y[k]);
-                
-                float dsq = sq_dist(s->x[k], s->y[k], s->x[k - 1], s->y[k - 1]);
-                if(dsq > s->maxDistSq)
-                    s->maxDistSq = dsq;
+                s->p = array_new(sizeof(float), NULL);
+                s->p = array_reserve(s->p, fs.npoints, true);
+                if(fread(s->p, sizeof(float), fs.npoints, f) != fs.npoints)
+                    goto fail;
+                decode_floats(s->p, (uint8_t *)s->p, fs.npoints);
             }
+            
+            // Convert the points in place, getting the stroke's
+            // bounding box and maxDistSq in the same pass
+            decode_points(s, (uint8_t *)s->x, (uint8_t *)s->y, fs.npoints, 0, 0);
+            stroke_update_outline(s);
         }
     }
     
@@ -180,255 +539,1492 @@ fail:
 }
 
 
-bool noted_canvas_save(NotedCanvas *canvas, const char *path)
+// Pages are independent blocks, so they're decoded in parallel
+// and then put in order.
+static NotedCanvas * load_canvas_v3(FILE *f, unsigned int nthreads)
 {
-    FILE *f = fopen(path, "wb");
-    
-    if(f == NULL)
+    FilePageEntry *table = read_page_table(f, kMagic3);
+    if(!table)
         return NULL;
     
-    // Write file identifier
-    if(fwrite(&kMagic1, sizeof(uint32_t), 1, f) != 1)
+    size_t npages = array_size(table);
+    DecodeJob job = {
+        .fd = fileno(f),
+        .table = table,
+        .npages = npages,
+        .pages = calloc(npages ? npages : 1, sizeof(Page *))
+    };
+    NotedCanvas *canvas = calloc(1, sizeof(NotedCanvas));
+    pthread_t *threads = NULL;
+    if(!job.pages)
         goto fail;
     
-    // Write header
-    uint16_t npages = (uint16_t)array_size(canvas->pages);
+    if(nthreads == 0)
+    {
+        long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncores > 0) ? (unsigned int)ncores : 1;
+    }
+    if(nthreads > kMaxDecodeThreads)
+        nthreads = kMaxDecodeThreads;
+    if(nthreads > npages)
+        nthreads = (unsigned int)npages;
     
-    FileHeader header;
-    header.npages = htons(npages);
-    header.nundo = 0;
-    if(fwrite(&header, sizeof(FileHeader), 1, f) != 1)
+    // This thread is one of the decoders. If a thread can't be
+    // started, the ones that could take its share.
+    unsigned int nstarted = 0;
+    if(nthreads > 1 && (threads = malloc(sizeof(pthread_t) * nthreads)))
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, kDecodeStackSize);
+        for(unsigned int t = 1; t < nthreads; ++t)
+        {
+            if(pthread_create(&threads[nstarted], &attr, decode_worker, &job) == 0)
+                ++nstarted;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    
+    decode_worker(&job);
+    for(unsigned int t = 0; t < nstarted; ++t)
+        pthread_join(threads[t], NULL);
+    
+    if(job.failed)
+    {
+        for(size_t i = 0; i < npages; ++i)
+        {
+            if(job.pages[i])
+                free_page(job.pages[i]);
+        }
         goto fail;
+    }
     
-    // For each page
-    for(uint16_t i = 0; i < npages; ++i)
+    for(size_t i = 0; i < npages; ++i)
+        pages_insert(canvas, i, job.pages[i]);
+    
+    free(threads);
+    free(job.pages);
+    array_free(table);
+    return canvas;
+    
+fail:
+    free(threads);
+    free(job.pages);
+    array_free(table);
+    noted_canvas_destroy(canvas);
+    return NULL;
+}
+
+// Decodes pages of job until they're all taken. Each page's
+// block is read whole, then decoded from memory.
+static void * decode_worker(void *data)
+{
+    DecodeJob *job = data;
+    uint8_t *block = NULL;
+    size_t capacity = 0;
+    
+    while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
     {
-        uint32_t nstrokes = (uint32_t)array_size(canvas->pages[i].strokes);
-        
-        // Write page data
-        FilePage fp = {
-            .bounds = canvas->pages[i].bounds,
-            .nstrokes = nstrokes,
-            .pattern = canvas->pages[i].pattern,
-            .patternDensity = canvas->pages[i].density
-        };
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(i >= job->npages)
+            break;
         
-        // Convert to file endianness
-        fp.bounds.x1 = htonf(fp.bounds.x1);
-        fp.bounds.x2 = htonf(fp.bounds.x2);
-        fp.bounds.y1 = htonf(fp.bounds.y1);
-        fp.bounds.y2 = htonf(fp.bounds.y2);
-        fp.nstrokes = htonl(fp.nstrokes);
-        fp.pattern = htons(fp.pattern);
-        fp.patternDensity = htons(fp.patternDensity);
-        
-        if(fwrite(&fp, sizeof(FilePage), 1, f) != 1)
-            goto fail;
-        
-        // For each stroke in page
-        for(uint32_t j = 0; j < nstrokes; ++j)
+        const FilePageEntry *e = &job->table[i];
+        if(e->size > capacity)
         {
-            // Write stroke data
-            uint32_t npoints = (uint32_t)array_size(canvas->pages[i].strokes[j].x);
-            
-            FileStroke fs = {
-                .npoints = npoints,
-                .style = canvas->pages[i].strokes[j].style
-            };
-            
-            // Convert to file endianness
-            fs.npoints = htonl(fs.npoints);
-            fs.style.thickness = htonf(fs.style.thickness);
-            
-            if(fwrite(&fs, sizeof(FileStroke), 1, f) != 1)
-                goto fail;
-            
-            float p[npoints];
-            
-            // Convert x's to file endianness and write
-            memcpy(p, canvas->pages[i].strokes[j].x, sizeof(float) * npoints);
-            for(uint32_t k = 0; k < npoints; ++k)
-                p[k] = htonf(p[k]);
-            if(fwrite(p, sizeof(float), npoints, f) != npoints)
-                goto fail;
-            
-            // Convert y's and write
-            memcpy(p, canvas->pages[i].strokes[j].y, sizeof(float) * npoints);
-            for(uint32_t k = 0; k < npoints; ++k)
-                p[k] = htonf(p[k]);
-            if(fwrite(p, sizeof(float), npoints, f) != npoints)
+            uint8_t *b = realloc(block, e->size);
+            if(!b)
                 goto fail;
+            block = b;
+            capacity = e->size;
         }
+        
+        if(!read_at(job->fd, block, e->size, e->offset))
+            goto fail;
+        
+        const uint8_t *thumb = block + e->size - e->thumbSize;
+        job->pages[i] = decode_page(block, thumb, e);
+        if(!job->pages[i])
+            goto fail;
+        if(e->thumbSize > 0)
+            thumbnail_set_png(job->pages[i], thumb, e->thumbSize);
     }
     
-    fclose(f);
-    return true;
+    free(block);
+    return NULL;
     
 fail:
-    fclose(f);
-    return false;
+    __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+    free(block);
+    return NULL;
 }
 
-
-/*
- * Convert floats to a "network" byte order and back.
- * TODO: Test on a big-endian machine.
- * Modified from: https://github.com/MalcolmMcLean/ieee754
- */
-
-/*
- * Convert network-order float to host
- */
-static float ntohf(float val)
-{
-    unsigned long mask;
-    int sign;
-    int exponent;
-    int shift;
-    int i;
-    int significandbits = 23;
-    int expbits = 8;
-    double fnorm = 0.0;
-    double bitval;
-    double answer;
-    
-    union {
-        unsigned long lbuff;
-        float fbuff;
-    } buff;
-    
-    buff.fbuff = val;
-    
-    sign = (buff.lbuff & 0x80000000) ? -1 : 1;
-    mask = 0x00400000;
-    exponent = (buff.lbuff & 0x7F800000) >> 23;
-    bitval = 0.5;
-    for(i=0;i<significandbits;i++)
-    {
-        if(buff.lbuff & mask)
-            fnorm += bitval;
-        bitval /= 2;
-        mask >>= 1;
-    }
-    if(exponent == 0 && fnorm == 0.0)
-        return 0.0f;
-    shift = exponent - ((1 << (expbits - 1)) - 1); /* exponent = shift + bias */
-    
-    if(shift == 128 && fnorm != 0.0)
-        return (float) sqrt(-1.0);
-    if(shift == 128 && fnorm == 0.0)
-    {
-#ifdef INFINITY
-        return sign == 1 ? INFINITY : -INFINITY;
-#endif
-        return (sign * 1.0f)/0.0f;
-    }
-    if(shift > -127)
-    {
-        answer = ldexp(fnorm + 1.0, shift);
-        return (float) answer * sign;
-    }
-    else
+// pread, continuing after short reads
+static bool read_at(int fd, void *dst, size_t size, off_t offset)
+{
+    while(size > 0)
     {
-        if(fnorm == 0.0)
-        {
-            return 0.0f;
-        }
-        shift = -126;
-        while (fnorm < 1.0)
-        {
-            fnorm *= 2;
-            shift--;
-        }
-        answer = ldexp(fnorm, shift);
-        return (float) answer * sign;
+        ssize_t n = pread(fd, dst, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        
+        dst = (uint8_t *)dst + n;
+        size -= n;
+        offset += n;
     }
+    return true;
 }
 
-/*
- * Convert host float to network-order
- */
-static float htonf(float x)
+// Reads the page table of a v3 file, or builds one for a v2 file
+// by walking its page and stroke headers, skipping over the
+// points. Either way, f must be just past the magic number.
+// v2 page blocks are the same as v3's. v1 strokes are a
+// different size, so v1 files get no table.
+static FilePageEntry * read_page_table(FILE *f, uint32_t magic)
 {
-    int shift;
-    unsigned long sign, exp, hibits;
-    double fnorm, significand;
-    int expbits = 8;
-    int significandbits = 23;
+    FilePageEntry *table = array_new(sizeof(FilePageEntry), NULL);
     
-    union {
-        unsigned long lbuff;
-        float fbuff;
-    } buff;
+    // Page counts are checked against the file's size before
+    // making room for them, so a damaged header fails instead
+    // of allocating gigabytes
+    struct stat st;
+    if(fstat(fileno(f), &st) != 0)
+        goto fail;
     
-    /* zero (can't handle signed zero) */
-    if (x == 0)
+    if(magic == kMagic3)
     {
-        buff.lbuff = 0;
-        return buff.fbuff;
-    }
-    /* infinity */
-    if (x > FLT_MAX)
-    {
-        buff.lbuff = 128 + ((1 << (expbits - 1)) - 1);
-        buff.lbuff <<= (31 - expbits);
-        return buff.fbuff;
-    }
-    /* -infinity */
-    if (x < -FLT_MAX)
-    {
-        buff.lbuff = 128 + ((1 << (expbits - 1)) - 1);
-        buff.lbuff <<= (31 - expbits);
-        buff.lbuff |= (1 << 31);
-        return buff.fbuff;
-    }
-    /* NaN - dodgy because many compilers optimise out this test, but
-     *there is no portable isnan() */
-    if (x != x)
-    {
-        buff.lbuff = 128 + ((1 << (expbits - 1)) - 1);
-        buff.lbuff <<= (31 - expbits);
-        buff.lbuff |= 1234;
-        return buff.fbuff;
+        FileHeader3 header;
+        if(fread(&header, sizeof(FileHeader3), 1, f) != 1)
+            goto fail;
+        
+        uint32_t npages = ntohl(header.npages);
+        uint16_t entrySize = ntohs(header.entrySize);
+        if(entrySize < kMinPageEntrySize)
+            goto fail;
+        
+        if((uint64_t)npages * entrySize > (uint64_t)st.st_size)
+            goto fail;
+        
+        size_t readSize = (entrySize < sizeof(FilePageEntry)) ? entrySize : sizeof(FilePageEntry);
+        FilePageEntry *reserved = array_reserve(table, npages, true);
+        if(!reserved)
+            goto fail;
+        table = reserved;
+        for(uint32_t i = 0; i < npages; ++i)
+        {
+            memset(&table[i], 0, sizeof(FilePageEntry));
+            if(fread(&table[i], readSize, 1, f) != 1)
+                goto fail;
+            if(entrySize > readSize && fseek(f, entrySize - readSize, SEEK_CUR) != 0)
+                goto fail;
+            table[i].offset = ntohl(table[i].offset);
+            table[i].size = ntohl(table[i].size);
+            table[i].nstrokes = ntohl(table[i].nstrokes);
+            table[i].pattern = ntohs(table[i].pattern);
+            table[i].patternDensity = ntohs(table[i].patternDensity);
+            table[i].width = file_float(table[i].width);
+            table[i].height = file_float(table[i].height);
+            table[i].thumbSize = ntohl(table[i].thumbSize);
+            if(table[i].thumbSize > table[i].size)
+                goto fail;
+            
+            // Likewise blocks, which are read whole
+            if((uint64_t)table[i].offset + table[i].size > (uint64_t)st.st_size)
+                goto fail;
+        }
+        
+        // Entries without a summary get it from their blocks
+        for(uint32_t i = 0; i < npages && readSize < offsetof(FilePageEntry, thumbSize); ++i)
+        {
+            FilePage fp;
+            if(fseek(f, table[i].offset, SEEK_SET) != 0
+               || fread(&fp, sizeof(FilePage), 1, f) != 1)
+                goto fail;
+            summarize_page(&table[i], &fp);
+        }
+        return table;
     }
     
-    /* get the sign */
-    if (x < 0) { sign = 1; fnorm = -x; }
-    else { sign = 0; fnorm = x; }
+    if(magic != kMagic2)
+        goto fail;
     
-    /* get the normalized form of f and track the exponent */
-    shift = 0;
-    while (fnorm >= 2.0) { fnorm /= 2.0; shift++; }
-    while (fnorm < 1.0) { fnorm *= 2.0; shift--; }
+    FileHeader header;
+    if(fread(&header, sizeof(FileHeader), 1, f) != 1)
+        goto fail;
     
-    /* check for denormalized numbers */
-    if (shift < -126)
-    {
-        while (shift < -126) { fnorm /= 2.0; shift++; }
-        shift = -1023;
-    }
-    /* out of range. Set to infinity */
-    else if (shift > 128)
+    uint16_t npages = ntohs(header.npages);
+    if((uint64_t)npages * sizeof(FilePage) > (uint64_t)st.st_size)
+        goto fail;
+    FilePageEntry *reserved = array_reserve(table, npages, true);
+    if(!reserved)
+        goto fail;
+    table = reserved;
+    for(uint16_t i = 0; i < npages; ++i)
     {
-        buff.lbuff = 128 + ((1 << (expbits - 1)) - 1);
-        buff.lbuff <<= (31 - expbits);
-        buff.lbuff |= (sign << 31);
-        return buff.fbuff;
+        long start = ftell(f);
+        
+        FilePage fp;
+        if(start < 0 || fread(&fp, sizeof(FilePage), 1, f) != 1)
+            goto fail;
+        
+        uint32_t nstrokes = ntohl(fp.nstrokes);
+        for(uint32_t j = 0; j < nstrokes; ++j)
+        {
+            FileStroke fs;
+            if(fread(&fs, sizeof(FileStroke), 1, f) != 1)
+                goto fail;
+            
+            long npoints = ntohl(fs.npoints);
+            long nfloats = npoints * ((ntohl(fs.flags) & kFileStrokePressure) ? 3 : 2);
+            if(fseek(f, nfloats * sizeof(float), SEEK_CUR) != 0)
+                goto fail;
+        }
+        
+        long end = ftell(f);
+        if(end < 0 || end > UINT32_MAX || end > st.st_size)
+            goto fail;
+        table[i].offset = (uint32_t)start;
+        table[i].size = (uint32_t)(end - start);
+        summarize_page(&table[i], &fp);
     }
-    else
-        fnorm = fnorm - 1.0; /* take the significant bit off mantissa */
+    return table;
     
-    /* calculate the integer form of the significand */
-    /* hold it in a  double for now */
-    
-    significand = fnorm * ((1LL << significandbits) + 0.5f);
-    
-    
-    /* get the biased exponent */
-    exp = shift + ((1 << (expbits - 1)) - 1); /* shift + bias */
-    
-    hibits = (long)(significand);
-    buff.lbuff = (sign << 31) | (exp << (31 - expbits)) | hibits;
-    return buff.fbuff;
+fail:
+    array_free(table);
+    return NULL;
 }
 
+// Fills in entry's summary from a FilePage as read from file
+static void summarize_page(FilePageEntry *entry, const FilePage *fp)
+{
+    entry->nstrokes = ntohl(fp->nstrokes);
+    entry->pattern = ntohs(fp->pattern);
+    entry->patternDensity = ntohs(fp->patternDensity);
+    entry->width = file_float(fp->bounds.x2) - file_float(fp->bounds.x1);
+    entry->height = file_float(fp->bounds.y2) - file_float(fp->bounds.y1);
+}
+
+static void entry_to_file(FilePageEntry *entry)
+{
+    entry->offset = htonl(entry->offset);
+    entry->size = htonl(entry->size);
+    entry->nstrokes = htonl(entry->nstrokes);
+    entry->pattern = htons(entry->pattern);
+    entry->patternDensity = htons(entry->patternDensity);
+    entry->width = file_float(entry->width);
+    entry->height = file_float(entry->height);
+    entry->thumbSize = htonl(entry->thumbSize);
+}
+
+size_t save_buffer_memory(NotedCanvas *canvas)
+{
+    return canvas->saveBuffer ? kSaveBufferSize : 0;
+}
+
+bool noted_canvas_save(NotedCanvas *canvas, const char *path)
+{
+    uint64_t start = stats_now();
+    
+    // Kept for the next save; canvases are saved after every change
+    if(!canvas->saveBuffer)
+        canvas->saveBuffer = malloc(kSaveBufferSize);
+    if(!canvas->saveBuffer)
+        return false;
+    
+    char *tmpPath;
+    FILE *f = open_temp(path, &tmpPath);
+    if(!f)
+        return false;
+    
+    // Thumbnails being rendered are left out; they're saved with
+    // the next save once they're done
+    thumbnails_begin_save(canvas);
+    
+    // Written past f's stdio buffer, which stays empty
+    bool ok = false;
+    SaveBuffer b = {
+        .fd = fileno(f),
+        .data = canvas->saveBuffer,
+        .capacity = kSaveBufferSize
+    };
+    uint32_t npages = (uint32_t)pages_count(canvas);
+    
+    // Write file identifier and header
+    FileHeader3 header = {
+        .npages = htonl(npages),
+        .nundo = 0,
+        .entrySize = htons(sizeof(FilePageEntry))
+    };
+    uint8_t *dst = save_reserve(&b, sizeof(uint32_t) + sizeof(FileHeader3));
+    if(!dst)
+        goto done;
+    memcpy(dst, &kMagic3, sizeof(uint32_t));
+    memcpy(dst + sizeof(uint32_t), &header, sizeof(FileHeader3));
+    
+    // Write the page table. Blocks follow it in page order.
+    size_t offset = sizeof(uint32_t) + sizeof(FileHeader3) + sizeof(FilePageEntry) * npages;
+    for(Page *p = pages_first(canvas); p; p = page_next(p))
+    {
+        size_t thumbSize = 0;
+        thumbnail_current_png(p, &thumbSize);
+        size_t size = page_block_size(p) + thumbSize;
+        if(offset + size > UINT32_MAX || !(dst = save_reserve(&b, sizeof(FilePageEntry))))
+            goto done;
+        
+        FilePageEntry entry = {
+            .offset = (uint32_t)offset,
+            .size = (uint32_t)size,
+            .nstrokes = (uint32_t)array_size(p->strokes),
+            .pattern = p->pattern,
+            .patternDensity = p->density,
+            .width = p->width,
+            .height = p->height,
+            .thumbSize = (uint32_t)thumbSize
+        };
+        entry_to_file(&entry);
+        memcpy(dst, &entry, sizeof(FilePageEntry));
+        offset += size;
+    }
+    
+    // For each page
+    for(Page *p = pages_first(canvas); p; p = page_next(p))
+    {
+        uint32_t nstrokes = (uint32_t)array_size(p->strokes);
+        
+        // Write page data, converted to file endianness. Bounds are
+        // relative to the page, as in clips, so its size reads back
+        // exactly wherever it ends up.
+        FilePage fp = {
+            .bounds = {0, 0, file_float(p->width), file_float(p->height)},
+            .nstrokes = htonl(nstrokes),
+            .pattern = htons(p->pattern),
+            .patternDensity = htons(p->density)
+        };
+        if(!(dst = save_reserve(&b, sizeof(FilePage))))
+            goto done;
+        memcpy(dst, &fp, sizeof(FilePage));
+        
+        // Write each stroke in page
+        for(uint32_t j = 0; j < nstrokes; ++j)
+        {
+            if(!save_stroke(&b, &p->strokes[j]))
+                goto done;
+        }
+        
+        if(!save_records(&b, p))
+            goto done;
+        
+        size_t thumbSize = 0;
+        const uint8_t *thumb = thumbnail_current_png(p, &thumbSize);
+        if(thumb)
+        {
+            struct iovec png = {(void *)thumb, thumbSize};
+            if(!save_flush(&b, &png, 1))
+                goto done;
+        }
+    }
+    
+    ok = save_flush(&b, NULL, 0);
+    
+done:
+    ok = commit_temp(f, tmpPath, path, ok);
+    thumbnails_end_save(canvas, ok);
+    stats_end(canvas, kNCStatSave, start);
+    return ok;
+}
+
+
+long noted_file_get_n_pages(const char *path)
+{
+    FilePageEntry *table;
+    FILE *f = open_blocks(path, &table);
+    if(!f)
+        return -1;
+    
+    long npages = array_size(table);
+    array_free(table);
+    fclose(f);
+    return npages;
+}
+
+bool noted_file_copy_pages(const char *src, size_t index, size_t n, const char *dst, size_t dstIndex)
+{
+    FilePageEntry *srcTable, *dstTable;
+    FILE *fs = open_blocks(src, &srcTable);
+    if(!fs)
+        return false;
+    FILE *fd = open_blocks(dst, &dstTable);
+    if(!fd)
+    {
+        array_free(srcTable);
+        fclose(fs);
+        return false;
+    }
+    
+    bool ok = false;
+    size_t srcPages = array_size(srcTable), dstPages = array_size(dstTable);
+    if(index + n <= srcPages && n > 0)
+    {
+        if(dstIndex > dstPages)
+            dstIndex = dstPages;
+        
+        BlockRef *blocks = array_new(sizeof(BlockRef), NULL);
+        blocks = append_blocks(blocks, fd, dstTable, 0, dstIndex);
+        blocks = append_blocks(blocks, fs, srcTable, index, n);
+        blocks = append_blocks(blocks, fd, dstTable, dstIndex, dstPages - dstIndex);
+        ok = write_blocks(dst, blocks, array_size(blocks));
+        array_free(blocks);
+    }
+    
+    array_free(srcTable);
+    array_free(dstTable);
+    fclose(fs);
+    fclose(fd);
+    return ok;
+}
+
+bool noted_file_move_pages(const char *src, size_t index, size_t n, const char *dst, size_t dstIndex)
+{
+    if(!same_file(src, dst))
+    {
+        // src has to keep a page, which is checked before dst is
+        // written, so a move that can't finish changes neither
+        long npages = noted_file_get_n_pages(src);
+        if(npages < 0 || index + n > (size_t)npages || n >= (size_t)npages)
+            return false;
+        return noted_file_copy_pages(src, index, n, dst, dstIndex)
+            && noted_file_delete_pages(src, index, n);
+    }
+    
+    FilePageEntry *table;
+    FILE *f = open_blocks(src, &table);
+    if(!f)
+        return false;
+    
+    bool ok = false;
+    size_t npages = array_size(table);
+    if(index + n <= npages && n > 0)
+    {
+        // dstIndex counts the pages that stay, so it's where the
+        // first moved page ends up.
+        size_t rest = npages - n;
+        if(dstIndex > rest)
+            dstIndex = rest;
+        
+        FilePageEntry *kept = array_new(sizeof(FilePageEntry), NULL);
+        for(size_t i = 0; i < npages; ++i)
+            if(i < index || i >= index + n)
+                kept = array_append(kept, &table[i]);
+        
+        BlockRef *blocks = array_new(sizeof(BlockRef), NULL);
+        blocks = append_blocks(blocks, f, kept, 0, dstIndex);
+        blocks = append_blocks(blocks, f, table, index, n);
+        blocks = append_blocks(blocks, f, kept, dstIndex, rest - dstIndex);
+        ok = write_blocks(src, blocks, array_size(blocks));
+        array_free(blocks);
+        array_free(kept);
+    }
+    
+    array_free(table);
+    fclose(f);
+    return ok;
+}
+
+bool noted_file_delete_pages(const char *path, size_t index, size_t n)
+{
+    FilePageEntry *table;
+    FILE *f = open_blocks(path, &table);
+    if(!f)
+        return false;
+    
+    // Like a canvas, a file always keeps at least one page
+    bool ok = false;
+    size_t npages = array_size(table);
+    if(index + n <= npages && n < npages)
+    {
+        BlockRef *blocks = array_new(sizeof(BlockRef), NULL);
+        blocks = append_blocks(blocks, f, table, 0, index);
+        blocks = append_blocks(blocks, f, table, index + n, npages - index - n);
+        ok = write_blocks(path, blocks, array_size(blocks));
+        array_free(blocks);
+    }
+    
+    array_free(table);
+    fclose(f);
+    return ok;
+}
+
+// Opens a file for copying page blocks out of, reading its page
+// table. v1 files are upgraded in place first, since their
+// blocks can't be copied into a newer file as they are.
+static FILE * open_blocks(const char *path, FilePageEntry **table)
+{
+    for(int attempt = 0; attempt < 2; ++attempt)
+    {
+        FILE *f = fopen(path, "rb");
+        if(!f)
+            return NULL;
+        
+        uint32_t magic = 0;
+        if(fread(&magic, sizeof(uint32_t), 1, f) != 1)
+        {
+            fclose(f);
+            return NULL;
+        }
+        
+        if(magic != kMagic1)
+        {
+            *table = read_page_table(f, magic);
+            if(*table)
+                return f;
+            fclose(f);
+            return NULL;
+        }
+        
+        fclose(f);
+        
+        NotedCanvas *canvas = noted_canvas_open(path);
+        if(!canvas)
+            return NULL;
+        bool saved = noted_canvas_save(canvas, path);
+        noted_canvas_destroy(canvas);
+        if(!saved)
+            return NULL;
+    }
+    return NULL;
+}
+
+static BlockRef * append_blocks(BlockRef *blocks, FILE *f, const FilePageEntry *table, size_t first, size_t n)
+{
+    for(size_t i = first; i < first + n; ++i)
+    {
+        BlockRef b = {f, table[i]};
+        blocks = array_append(blocks, &b);
+    }
+    return blocks;
+}
+
+// Writes a v3 file made of the given page blocks, copied as raw
+// bytes. Only the header and page table are new.
+static bool write_blocks(const char *path, const BlockRef *blocks, size_t n)
+{
+    static const size_t kCopyBufferSize = 1 << 20;
+    
+    char *tmpPath;
+    FILE *f = open_temp(path, &tmpPath);
+    if(!f)
+        return false;
+    
+    bool ok = false;
+    FilePageEntry *table = malloc(sizeof(FilePageEntry) * (n ? n : 1));
+    uint8_t *buffer = malloc(kCopyBufferSize);
+    if(!table || !buffer)
+        goto done;
+    
+    FileHeader3 header = {
+        .npages = htonl((uint32_t)n),
+        .nundo = 0,
+        .entrySize = htons(sizeof(FilePageEntry))
+    };
+    
+    size_t offset = sizeof(uint32_t) + sizeof(FileHeader3) + sizeof(FilePageEntry) * n;
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(offset + blocks[i].entry.size > UINT32_MAX)
+            goto done;
+        table[i] = blocks[i].entry;
+        table[i].offset = (uint32_t)offset;
+        offset += table[i].size;
+        entry_to_file(&table[i]);
+    }
+    
+    if(fwrite(&kMagic3, sizeof(uint32_t), 1, f) != 1
+       || fwrite(&header, sizeof(FileHeader3), 1, f) != 1
+       || fwrite(table, sizeof(FilePageEntry), n, f) != n)
+        goto done;
+    
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(fseek(blocks[i].f, blocks[i].entry.offset, SEEK_SET) != 0)
+            goto done;
+        
+        for(size_t left = blocks[i].entry.size; left > 0;)
+        {
+            size_t chunk = (left < kCopyBufferSize) ? left : kCopyBufferSize;
+            if(fread(buffer, 1, chunk, blocks[i].f) != chunk
+               || fwrite(buffer, 1, chunk, f) != chunk)
+                goto done;
+            left -= chunk;
+        }
+    }
+    
+    ok = true;
+    
+done:
+    free(table);
+    free(buffer);
+    return commit_temp(f, tmpPath, path, ok);
+}
+
+static bool same_file(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    if(stat(a, &sa) != 0 || stat(b, &sb) != 0)
+        return false;
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Opens a new file next to path to write to instead of path, so
+// a failed write never leaves path half written. Finish with
+// commit_temp.
+static FILE * open_temp(const char *path, char **tmpPath)
+{
+    size_t len = strlen(path) + sizeof(".XXXXXX");
+    char *tmp = malloc(len);
+    if(!tmp)
+        return NULL;
+    snprintf(tmp, len, "%s.XXXXXX", path);
+    
+    int fd = mkstemp(tmp);
+    if(fd < 0)
+    {
+        free(tmp);
+        return NULL;
+    }
+    
+    // mkstemp makes files only the owner can read, so take on the
+    // mode of the file being replaced
+    struct stat st;
+    fchmod(fd, (stat(path, &st) == 0) ? (st.st_mode & 07777) : 0644);
+    
+    FILE *f = fdopen(fd, "wb");
+    if(!f)
+    {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return NULL;
+    }
+    
+    *tmpPath = tmp;
+    return f;
+}
+
+// Closes a file from open_temp, and if ok, puts it in place of
+// path. Otherwise the temp file is removed and path is untouched.
+static bool commit_temp(FILE *f, char *tmpPath, const char *path, bool ok)
+{
+    if(fflush(f) != 0 || fsync(fileno(f)) != 0)
+        ok = false;
+    if(fclose(f) != 0)
+        ok = false;
+    if(ok && rename(tmpPath, path) != 0)
+        ok = false;
+    if(!ok)
+        unlink(tmpPath);
+    free(tmpPath);
+    return ok;
+}
+
+
+void * clip_encode_strokes(NotedCanvas *canvas, float originX, float originY, size_t *size)
+{
+    size_t total = sizeof(FileClip);
+    uint32_t nstrokes = 0;
+    
+    for(Page *p = pages_first(canvas); p; p = page_next(p))
+    {
+        size_t n = array_size(p->strokes);
+        for(size_t j = 0; j < n; ++j)
+        {
+            if(!p->strokes[j].selected)
+                continue;
+            total += stroke_record_size(&p->strokes[j]);
+            ++nstrokes;
+        }
+    }
+    
+    if(nstrokes == 0 || total > UINT32_MAX)
+        return NULL;
+    
+    uint8_t *clip = malloc(total);
+    if(!clip)
+        return NULL;
+    
+    FileClip header = {
+        .magic = htonl(kClipMagic),
+        .size = htonl((uint32_t)total),
+        .npages = 0,
+        .nstrokes = htonl(nstrokes)
+    };
+    memcpy(clip, &header, sizeof(FileClip));
+    
+    uint8_t *dst = clip + sizeof(FileClip);
+    for(Page *p = pages_first(canvas); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        size_t n = array_size(p->strokes);
+        for(size_t j = 0; j < n; ++j)
+        {
+            if(p->strokes[j].selected)
+                dst = encode_stroke(dst, &p->strokes[j], pb.x1 - originX, pb.y1 - originY);
+        }
+    }
+    
+    *size = total;
+    return clip;
+}
+
+void * clip_encode_pages(NotedCanvas *canvas, size_t index, size_t n, size_t *size)
+{
+    if(index + n > pages_count(canvas) || n == 0)
+        return NULL;
+    
+    Page *first = pages_get(canvas, index);
+    size_t total = sizeof(FileClip);
+    Page *p = first;
+    for(size_t i = 0; i < n; ++i, p = page_next(p))
+        total += sizeof(uint32_t) + page_block_size(p);
+    
+    if(total > UINT32_MAX)
+        return NULL;
+    
+    uint8_t *clip = malloc(total);
+    if(!clip)
+        return NULL;
+    
+    FileClip header = {
+        .magic = htonl(kClipMagic),
+        .size = htonl((uint32_t)total),
+        .npages = htonl((uint32_t)n),
+        .nstrokes = 0
+    };
+    memcpy(clip, &header, sizeof(FileClip));
+    
+    uint8_t *dst = clip + sizeof(FileClip);
+    p = first;
+    for(size_t i = 0; i < n; ++i, p = page_next(p))
+    {
+        uint32_t nstrokes = (uint32_t)array_size(p->strokes);
+        uint32_t blockSize = htonl((uint32_t)page_block_size(p));
+        memcpy(dst, &blockSize, sizeof(uint32_t));
+        dst += sizeof(uint32_t);
+        
+        // Only the size matters when pasting
+        FilePage fp = {
+            .nstrokes = htonl(nstrokes),
+            .pattern = htons(p->pattern),
+            .patternDensity = htons(p->density),
+            .bounds = {0, 0, file_float(p->width), file_float(p->height)}
+        };
+        memcpy(dst, &fp, sizeof(FilePage));
+        dst += sizeof(FilePage);
+        
+        for(uint32_t j = 0; j < nstrokes; ++j)
+            dst = encode_stroke(dst, &p->strokes[j], 0, 0);
+        dst = encode_records(dst, p);
+    }
+    
+    *size = total;
+    return clip;
+}
+
+bool clip_decode(const void *content, size_t size, Page ***pages, Stroke **strokes)
+{
+    *pages = NULL;
+    *strokes = NULL;
+    
+    FileClip header;
+    if(!content || size < sizeof(FileClip))
+        return false;
+    memcpy(&header, content, sizeof(FileClip));
+    header.magic = ntohl(header.magic);
+    header.size = ntohl(header.size);
+    header.npages = ntohl(header.npages);
+    header.nstrokes = ntohl(header.nstrokes);
+    if(header.magic != kClipMagic || header.size > size)
+        return false;
+    
+    const uint8_t *src = (const uint8_t *)content + sizeof(FileClip);
+    const uint8_t *end = (const uint8_t *)content + header.size;
+    
+    if(header.npages == 0)
+    {
+        Stroke *s = array_new(sizeof(Stroke), NULL);
+        for(uint32_t j = 0; j < header.nstrokes && src; ++j)
+        {
+            s = array_append(s, NULL);
+            src = decode_stroke(src, end, &s[j], 0, 0);
+        }
+        
+        if(!src)
+        {
+            for(size_t j = 0; j < array_size(s); ++j)
+                free_stroke(&s[j]);
+            array_free(s);
+            return false;
+        }
+        
+        *strokes = s;
+        return true;
+    }
+    
+    Page **p = array_new(sizeof(Page *), NULL);
+    for(uint32_t i = 0; i < header.npages && src; ++i)
+    {
+        uint32_t blockSize;
+        if((size_t)(end - src) < sizeof(uint32_t))
+        {
+            src = NULL;
+            break;
+        }
+        memcpy(&blockSize, src, sizeof(uint32_t));
+        src += sizeof(uint32_t);
+        blockSize = ntohl(blockSize);
+        
+        Page *page = (blockSize <= (size_t)(end - src)) ? decode_page(src, src + blockSize, NULL) : NULL;
+        if(page)
+        {
+            p = array_append(p, &page);
+            src += blockSize;
+        }
+        else
+            src = NULL;
+    }
+    
+    if(!src)
+    {
+        for(size_t i = 0; i < array_size(p); ++i)
+            free_page(p[i]);
+        array_free(p);
+        return false;
+    }
+    
+    *pages = p;
+    return true;
+}
+
+// Size of p's block: a FilePage, its FileStrokes and its
+// FileRecords
+static size_t page_block_size(Page *p)
+{
+    size_t size = sizeof(FilePage);
+    size_t nstrokes = array_size(p->strokes);
+    for(size_t j = 0; j < nstrokes; ++j)
+        size += stroke_record_size(&p->strokes[j]);
+    return size + records_size(p);
+}
+
+// Reads a page block, which ends at end, into a new page, sized
+// from its table entry e. Clips have no table, so their pages are
+// sized from their bounds, which are relative to the page. Returns
+// NULL if the block is invalid.
+static Page * decode_page(const uint8_t *src, const uint8_t *end, const FilePageEntry *e)
+{
+    FilePage fp;
+    if((size_t)(end - src) < sizeof(FilePage))
+        return NULL;
+    memcpy(&fp, src, sizeof(FilePage));
+    src += sizeof(FilePage);
+    
+    // Only the size matters; pages are laid out in order. Blocks
+    // spliced from older files can still hold absolute bounds,
+    // whose difference rounds, but their entries are exact.
+    float width = e ? e->width : file_float(fp.bounds.x2) - file_float(fp.bounds.x1);
+    float height = e ? e->height : file_float(fp.bounds.y2) - file_float(fp.bounds.y1);
+    Page *p = page_new(width, height, ntohs(fp.pattern), ntohs(fp.patternDensity));
+    
+    uint32_t nstrokes = ntohl(fp.nstrokes);
+    p->strokes = array_reserve(p->strokes, nstrokes, false);
+    for(uint32_t j = 0; j < nstrokes; ++j)
+    {
+        p->strokes = array_append(p->strokes, NULL);
+        src = decode_stroke(src, end, &p->strokes[j], 0, 0);
+        p->strokes[j].page = p;
+        if(!src)
+        {
+            free_page(p);
+            return NULL;
+        }
+    }
+    
+    if(!decode_records(src, end, p))
+    {
+        free_page(p);
+        return NULL;
+    }
+    
+    // PDF pages without their PDF page are left blank
+    if(p->pattern == kNCPagePDF && !p->background)
+        p->pattern = kNCPageBlank;
+    return p;
+}
+
+// Size of p's FileRecords, with their headers
+static size_t records_size(Page *p)
+{
+    size_t size = 0;
+    if(p->background)
+    {
+        unsigned int index;
+        size += sizeof(FileRecord) + sizeof(FileBackground) + strlen(page_background_path(p->background, &index));
+    }
+    
+    size_t nimages = array_size(p->images);
+    for(size_t j = 0; j < nimages; ++j)
+    {
+        size_t encodedSize;
+        image_data_encoded(p->images[j].data, &encodedSize);
+        size += sizeof(FileRecord) + sizeof(FileImage) + encodedSize;
+    }
+    
+    size_t ntexts = array_size(p->texts);
+    for(size_t j = 0; j < ntexts; ++j)
+        size += sizeof(FileRecord) + sizeof(FileText) + strlen(p->texts[j].text);
+    return size;
+}
+
+static bool save_records(SaveBuffer *b, Page *p)
+{
+    uint8_t *dst;
+    if(p->background)
+    {
+        unsigned int index;
+        size_t size = sizeof(FileRecord) + sizeof(FileBackground) + strlen(page_background_path(p->background, &index));
+        if(!(dst = save_reserve(b, size)))
+            return false;
+        encode_background(dst, p);
+    }
+    
+    // Images are written from where they are rather than copied
+    // into the buffer
+    size_t nimages = array_size(p->images);
+    for(size_t j = 0; j < nimages; ++j)
+    {
+        if(!(dst = save_reserve(b, sizeof(FileRecord) + sizeof(FileImage))))
+            return false;
+        encode_image_header(dst, &p->images[j]);
+        
+        size_t encodedSize;
+        const uint8_t *encoded = image_data_encoded(p->images[j].data, &encodedSize);
+        struct iovec image = {(void *)encoded, encodedSize};
+        if(!save_flush(b, &image, 1))
+            return false;
+    }
+    
+    size_t ntexts = array_size(p->texts);
+    for(size_t j = 0; j < ntexts; ++j)
+    {
+        if(!(dst = save_reserve(b, sizeof(FileRecord) + sizeof(FileText) + strlen(p->texts[j].text))))
+            return false;
+        encode_text(dst, &p->texts[j]);
+    }
+    return true;
+}
+
+// Writes p's FileRecords. Returns the end of what was written.
+static uint8_t * encode_records(uint8_t *dst, Page *p)
+{
+    if(p->background)
+        dst = encode_background(dst, p);
+    
+    size_t nimages = array_size(p->images);
+    for(size_t j = 0; j < nimages; ++j)
+    {
+        dst = encode_image_header(dst, &p->images[j]);
+        size_t encodedSize;
+        const uint8_t *encoded = image_data_encoded(p->images[j].data, &encodedSize);
+        memcpy(dst, encoded, encodedSize);
+        dst += encodedSize;
+    }
+    
+    size_t ntexts = array_size(p->texts);
+    for(size_t j = 0; j < ntexts; ++j)
+        dst = encode_text(dst, &p->texts[j]);
+    return dst;
+}
+
+// Writes p's background record, header and all
+static uint8_t * encode_background(uint8_t *dst, Page *p)
+{
+    unsigned int index;
+    const char *path = page_background_path(p->background, &index);
+    size_t length = strlen(path);
+    FileRecord r = {
+        .type = htonl(kFileRecordBackground),
+        .size = htonl((uint32_t)(sizeof(FileBackground) + length))
+    };
+    FileBackground fb = {
+        .index = htonl(index)
+    };
+    memcpy(dst, &r, sizeof(FileRecord));
+    dst += sizeof(FileRecord);
+    memcpy(dst, &fb, sizeof(FileBackground));
+    dst += sizeof(FileBackground);
+    memcpy(dst, path, length);
+    return dst + length;
+}
+
+// Writes img's record header and FileImage, which its encoded
+// image follows
+static uint8_t * encode_image_header(uint8_t *dst, Image *img)
+{
+    size_t encodedSize;
+    image_data_encoded(img->data, &encodedSize);
+    FileRecord r = {
+        .type = htonl(kFileRecordImage),
+        .size = htonl((uint32_t)(sizeof(FileImage) + encodedSize))
+    };
+    FileImage fi = {
+        .bounds = {
+            file_float(img->bounds.x1), file_float(img->bounds.y1),
+            file_float(img->bounds.x2), file_float(img->bounds.y2)
+        }
+    };
+    memcpy(dst, &r, sizeof(FileRecord));
+    memcpy(dst + sizeof(FileRecord), &fi, sizeof(FileImage));
+    return dst + sizeof(FileRecord) + sizeof(FileImage);
+}
+
+// Writes t's record, header and all
+static uint8_t * encode_text(uint8_t *dst, TextBox *t)
+{
+    size_t length = strlen(t->text);
+    FileRecord r = {
+        .type = htonl(kFileRecordText),
+        .size = htonl((uint32_t)(sizeof(FileText) + length))
+    };
+    FileText ft = {
+        .bounds = {
+            file_float(t->bounds.x1), file_float(t->bounds.y1),
+            file_float(t->bounds.x2), file_float(t->bounds.y2)
+        },
+        .size = file_float(t->size),
+        .r = t->r, .g = t->g, .b = t->b, .a = t->a
+    };
+    memcpy(dst, &r, sizeof(FileRecord));
+    dst += sizeof(FileRecord);
+    memcpy(dst, &ft, sizeof(FileText));
+    dst += sizeof(FileText);
+    memcpy(dst, t->text, length);
+    return dst + length;
+}
+
+// Reads the FileRecords from src to end into p. Returns end, or
+// NULL if they're invalid.
+static const uint8_t * decode_records(const uint8_t *src, const uint8_t *end, Page *p)
+{
+    while(src < end)
+    {
+        FileRecord r;
+        if((size_t)(end - src) < sizeof(FileRecord))
+            return NULL;
+        memcpy(&r, src, sizeof(FileRecord));
+        src += sizeof(FileRecord);
+        r.type = ntohl(r.type);
+        r.size = ntohl(r.size);
+        if(r.size > (size_t)(end - src))
+            return NULL;
+        
+        if(r.type == kFileRecordBackground && r.size > sizeof(FileBackground) && !p->background)
+        {
+            FileBackground fb;
+            memcpy(&fb, src, sizeof(FileBackground));
+            size_t length = r.size - sizeof(FileBackground);
+            char *path = (length <= PATH_MAX) ? malloc(length + 1) : NULL;
+            if(path)
+            {
+                memcpy(path, src + sizeof(FileBackground), length);
+                path[length] = '\0';
+                p->background = page_background_new(path, ntohl(fb.index));
+                free(path);
+            }
+        }
+        else if(r.type == kFileRecordImage && r.size > sizeof(FileImage))
+        {
+            // Images that aren't PNGs or JPEGs are dropped
+            FileImage fi;
+            memcpy(&fi, src, sizeof(FileImage));
+            Image img = {
+                .data = image_data_new(src + sizeof(FileImage), r.size - sizeof(FileImage)),
+                .bounds = {
+                    file_float(fi.bounds.x1), file_float(fi.bounds.y1),
+                    file_float(fi.bounds.x2), file_float(fi.bounds.y2)
+                }
+            };
+            if(img.data)
+                p->images = array_append(p->images, &img);
+        }
+        else if(r.type == kFileRecordText && r.size > sizeof(FileText))
+        {
+            FileText ft;
+            memcpy(&ft, src, sizeof(FileText));
+            size_t length = r.size - sizeof(FileText);
+            TextBox t = {
+                .text = malloc(length + 1),
+                .bounds = {
+                    file_float(ft.bounds.x1), file_float(ft.bounds.y1),
+                    file_float(ft.bounds.x2), file_float(ft.bounds.y2)
+                },
+                .size = file_float(ft.size),
+                .r = ft.r, .g = ft.g, .b = ft.b, .a = ft.a
+            };
+            if(t.text && t.size > 0 && t.bounds.x2 > t.bounds.x1)
+            {
+                memcpy(t.text, src + sizeof(FileText), length);
+                t.text[length] = '\0';
+                text_box_update(&t);
+                p->texts = array_append(p->texts, &t);
+            }
+            else
+                free(t.text);
+        }
+        
+        src += r.size;
+    }
+    return src;
+}
+
+// Size of s as a FileStroke record and its points
+static size_t stroke_record_size(Stroke *s)
+{
+    size_t npoints = array_size(s->x);
+    return sizeof(FileStroke) + sizeof(float) * npoints * (s->p ? 3 : 2);
+}
+
+// Writes s as a FileStroke record to dst, moving its points by
+// dx, dy. Returns the end of what was written.
+static uint8_t * encode_stroke(uint8_t *dst, Stroke *s, float dx, float dy)
+{
+    uint32_t npoints = (uint32_t)array_size(s->x);
+    
+    dst = encode_stroke_header(dst, s);
+    dst = encode_floats(dst, s->x, npoints, dx);
+    dst = encode_floats(dst, s->y, npoints, dy);
+    if(s->p)
+        dst = encode_floats(dst, s->p, npoints, 0);
+    return dst;
+}
+
+// Writes just the FileStroke of s's record
+static uint8_t * encode_stroke_header(uint8_t *dst, Stroke *s)
+{
+    FileStroke fs = {
+        .npoints = htonl((uint32_t)array_size(s->x)),
+        .style = s->style,
+        .flags = htonl(s->p ? kFileStrokePressure : 0)
+    };
+    fs.style.thickness = file_float(fs.style.thickness);
+    memcpy(dst, &fs, sizeof(FileStroke));
+    return dst + sizeof(FileStroke);
+}
+
+// Reads a FileStroke record into s, moving its points by dx, dy.
+// Returns the end of the record, or NULL if it runs past end, in
+// which case s is left safe to free.
+static const uint8_t * decode_stroke(const uint8_t *src, const uint8_t *end, Stroke *s, float dx, float dy)
+{
+    *s = (Stroke){0};
+    s->x = array_new(sizeof(float), NULL);
+    s->y = array_new(sizeof(float), NULL);
+    
+    FileStroke fs;
+    if((size_t)(end - src) < sizeof(FileStroke))
+        return NULL;
+    memcpy(&fs, src, sizeof(FileStroke));
+    src += sizeof(FileStroke);
+    
+    fs.npoints = ntohl(fs.npoints);
+    fs.style.thickness = file_float(fs.style.thickness);
+    fs.flags = ntohl(fs.flags);
+    s->style = fs.style;
+    
+    size_t nfloats = (size_t)fs.npoints * ((fs.flags & kFileStrokePressure) ? 3 : 2);
+    if((size_t)(end - src) / sizeof(float) < nfloats)
+        return NULL;
+    
+    if(fs.npoints == 0)
+        return src;
+    
+    s->x = array_reserve(s->x, fs.npoints, true);
+    s->y = array_reserve(s->y, fs.npoints, true);
+    decode_points(s, src, src + sizeof(float) * fs.npoints, fs.npoints, dx, dy);
+    src += 2 * sizeof(float) * fs.npoints;
+    
+    if(fs.flags & kFileStrokePressure)
+    {
+        s->p = array_new(sizeof(float), NULL);
+        s->p = array_reserve(s->p, fs.npoints, true);
+        decode_floats(s->p, src, fs.npoints);
+        src += sizeof(float) * fs.npoints;
+    }
+    
+    stroke_update_outline(s);
+    return src;
+}
+
+// Room for size more bytes, which must fit in the buffer. Returns
+// NULL if making room failed.
+static uint8_t * save_reserve(SaveBuffer *b, size_t size)
+{
+    if(b->used + size > b->capacity && !save_flush(b, NULL, 0))
+        return NULL;
+    
+    uint8_t *dst = b->data + b->used;
+    b->used += size;
+    return dst;
+}
+
+// Writes out the buffer, followed by arrays, in one call
+static bool save_flush(SaveBuffer *b, const struct iovec *arrays, int narrays)
+{
+    struct iovec iov[4];
+    int n = 0;
+    
+    if(b->used > 0)
+        iov[n++] = (struct iovec){b->data, b->used};
+    for(int k = 0; k < narrays && n < 4; ++k)
+        iov[n++] = arrays[k];
+    
+    b->used = 0;
+    if(!b->failed && !write_all(b->fd, iov, n))
+        b->failed = true;
+    return !b->failed;
+}
+
+static bool save_stroke(SaveBuffer *b, Stroke *s)
+{
+    size_t size = stroke_record_size(s);
+    if(size <= kDirectWriteSize)
+    {
+        uint8_t *dst = save_reserve(b, size);
+        if(!dst)
+            return false;
+        encode_stroke(dst, s, 0, 0);
+        return true;
+    }
+    
+    uint8_t *dst = save_reserve(b, sizeof(FileStroke));
+    if(!dst)
+        return false;
+    encode_stroke_header(dst, s);
+    
+    size_t npoints = array_size(s->x);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // Points need converting, so they go through the buffer
+    const float *arrays[3] = {s->x, s->y, s->p};
+    size_t chunk = b->capacity / sizeof(float);
+    for(int a = 0; a < 3 && arrays[a]; ++a)
+    {
+        for(size_t k = 0; k < npoints; k += chunk)
+        {
+            size_t n = (npoints - k < chunk) ? npoints - k : chunk;
+            if(!(dst = save_reserve(b, n * sizeof(float))))
+                return false;
+            encode_floats(dst, arrays[a] + k, n, 0);
+        }
+    }
+    return true;
+#else
+    // Points are already in file order
+    struct iovec arrays[3] = {
+        {s->x, npoints * sizeof(float)},
+        {s->y, npoints * sizeof(float)},
+        {s->p, s->p ? npoints * sizeof(float) : 0}
+    };
+    return save_flush(b, arrays, 3);
+#endif
+}
+
+// writev, continuing after partial writes. Modifies iov.
+static bool write_all(int fd, struct iovec *iov, int n)
+{
+    while(n > 0)
+    {
+        ssize_t written = writev(fd, iov, n);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        
+        // Skip what was written, which can end partway into a vector
+        while(n > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if(n > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+
+// Floats in files are converted by file_float (see nc-private.h)
+static inline float load_file_float(const uint8_t *src)
+{
+    float v;
+    memcpy(&v, src, sizeof(float));
+    return file_float(v);
+}
+
+static uint8_t * encode_floats(uint8_t *dst, const float *src, size_t n, float offset)
+{
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    if(offset == 0)
+    {
+        memcpy(dst, src, n * sizeof(float));
+        return dst + n * sizeof(float);
+    }
+#endif
+    for(size_t k = 0; k < n; ++k)
+    {
+        float v = file_float(src[k] + offset);
+        memcpy(dst + k * sizeof(float), &v, sizeof(float));
+    }
+    return dst + n * sizeof(float);
+}
+
+// src may be dst, for data read straight into place
+static void decode_floats(float *dst, const uint8_t *src, size_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for(size_t k = 0; k < n; ++k)
+        dst[k] = load_file_float(src + k * sizeof(float));
+#else
+    memmove(dst, src, n * sizeof(float));
+#endif
+}
+
+// Converts a stroke's n x's and y's into s->x and s->y, moving
+// them by dx, dy, and finds its bounds and maxDistSq on the way,
+// so each point is only touched once. The sources may be s->x
+// and s->y themselves. The vector paths do four points at a
+// time, with each point's predecessor shifted in from the
+// previous four.
+static void decode_points(Stroke *s, const uint8_t *xsrc, const uint8_t *ysrc, size_t n, float dx, float dy)
+{
+    s->maxDistSq = 0;
+    if(n == 0)
+    {
+        s->bounds = (NCRect){0};
+        return;
+    }
+    
+    float px = load_file_float(xsrc) + dx;
+    float py = load_file_float(ysrc) + dy;
+    s->x[0] = px;
+    s->y[0] = py;
+    
+    NCRect bounds = {px, py, px, py};
+    float maxDistSq = 0;
+    size_t i = 1;
+
+#if (defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))) && __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    if(n >= 5)
+    {
+        float lanes[5][4];
+        const float *fx = (const float *)xsrc, *fy = (const float *)ysrc;
+#if defined(__SSE2__)
+        __m128 vdx = _mm_set1_ps(dx), vdy = _mm_set1_ps(dy);
+        __m128 lastX = _mm_set1_ps(px), lastY = _mm_set1_ps(py);
+        __m128 minX = lastX, maxX = lastX, minY = lastY, maxY = lastY;
+        __m128 maxD = _mm_setzero_ps();
+        
+        for(; i + 4 <= n; i += 4)
+        {
+            __m128 vx = _mm_add_ps(_mm_loadu_ps(fx + i), vdx);
+            __m128 vy = _mm_add_ps(_mm_loadu_ps(fy + i), vdy);
+            _mm_storeu_ps(s->x + i, vx);
+            _mm_storeu_ps(s->y + i, vy);
+            
+            // {last[3], v[0], v[1], v[2]}
+            __m128 prevX = _mm_shuffle_ps(_mm_shuffle_ps(lastX, vx, _MM_SHUFFLE(1, 0, 3, 3)), vx, _MM_SHUFFLE(2, 1, 2, 0));
+            __m128 prevY = _mm_shuffle_ps(_mm_shuffle_ps(lastY, vy, _MM_SHUFFLE(1, 0, 3, 3)), vy, _MM_SHUFFLE(2, 1, 2, 0));
+            __m128 ddx = _mm_sub_ps(vx, prevX), ddy = _mm_sub_ps(vy, prevY);
+            maxD = _mm_max_ps(maxD, _mm_add_ps(_mm_mul_ps(ddx, ddx), _mm_mul_ps(ddy, ddy)));
+            
+            minX = _mm_min_ps(minX, vx);
+            maxX = _mm_max_ps(maxX, vx);
+            minY = _mm_min_ps(minY, vy);
+            maxY = _mm_max_ps(maxY, vy);
+            lastX = vx;
+            lastY = vy;
+        }
+        
+        _mm_storeu_ps(lanes[0], minX);
+        _mm_storeu_ps(lanes[1], minY);
+        _mm_storeu_ps(lanes[2], maxX);
+        _mm_storeu_ps(lanes[3], maxY);
+        _mm_storeu_ps(lanes[4], maxD);
+#else
+        float32x4_t vdx = vdupq_n_f32(dx), vdy = vdupq_n_f32(dy);
+        float32x4_t lastX = vdupq_n_f32(px), lastY = vdupq_n_f32(py);
+        float32x4_t minX = lastX, maxX = lastX, minY = lastY, maxY = lastY;
+        float32x4_t maxD = vdupq_n_f32(0);
+        
+        for(; i + 4 <= n; i += 4)
+        {
+            float32x4_t vx = vaddq_f32(vld1q_f32(fx + i), vdx);
+            float32x4_t vy = vaddq_f32(vld1q_f32(fy + i), vdy);
+            vst1q_f32(s->x + i, vx);
+            vst1q_f32(s->y + i, vy);
+            
+            // {last[3], v[0], v[1], v[2]}
+            float32x4_t ddx = vsubq_f32(vx, vextq_f32(lastX, vx, 3));
+            float32x4_t ddy = vsubq_f32(vy, vextq_f32(lastY, vy, 3));
+            maxD = vmaxq_f32(maxD, vmlaq_f32(vmulq_f32(ddx, ddx), ddy, ddy));
+            
+            minX = vminq_f32(minX, vx);
+            maxX = vmaxq_f32(maxX, vx);
+            minY = vminq_f32(minY, vy);
+            maxY = vmaxq_f32(maxY, vy);
+            lastX = vx;
+            lastY = vy;
+        }
+        
+        vst1q_f32(lanes[0], minX);
+        vst1q_f32(lanes[1], minY);
+        vst1q_f32(lanes[2], maxX);
+        vst1q_f32(lanes[3], maxY);
+        vst1q_f32(lanes[4], maxD);
+#endif
+        for(int k = 0; k < 4; ++k)
+        {
+            rect_expand_by_point(&bounds, lanes[0][k], lanes[1][k]);
+            rect_expand_by_point(&bounds, lanes[2][k], lanes[3][k]);
+            if(lanes[4][k] > maxDistSq)
+                maxDistSq = lanes[4][k];
+        }
+        
+        px = s->x[i - 1];
+        py = s->y[i - 1];
+    }
+#endif
+    
+    for(; i < n; ++i)
+    {
+        float x = load_file_float(xsrc + i * sizeof(float)) + dx;
+        float y = load_file_float(ysrc + i * sizeof(float)) + dy;
+        s->x[i] = x;
+        s->y[i] = y;
+        
+        rect_expand_by_point(&bounds, x, y);
+        float dsq = sq_dist(x, y, px, py);
+        if(dsq > maxDistSq)
+            maxDistSq = dsq;
+        px = x;
+        py = y;
+    }
+    
+    s->bounds = bounds;
+    s->maxDistSq = maxDistSq;
+}
@@ -0,0 +1,286 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-pages.c: The canvas's page order and layout.
+ *   Pages are the nodes of a treap ordered by position, where
+ *   each node knows the number of pages and the total height
+ *   below it. A page's index and vertical offset come from
+ *   walking up to the root, and moving, inserting or removing
+ *   a page only relinks O(log n) nodes, so nothing about the
+ *   pages around it has to be rewritten.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+
+static Page * merge(Page *a, Page *b);
+static void split(Page *t, size_t index, Page **a, Page **b);
+static void update(Page *t);
+static unsigned int next_priority(void);
+
+static inline size_t count_of(Page *t)
+{
+    return t ? t->count : 0;
+}
+
+static inline float extent_of(Page *t)
+{
+    return t ? t->extent : 0;
+}
+
+// Space between pages
+static const float kPageGap = 0.01;
+
+
+Page * page_new(float width, float height, NCPagePattern pattern, unsigned int density)
+{
+    Page *p = calloc(1, sizeof(Page));
+    p->width = width;
+    p->height = height;
+    p->pattern = pattern;
+    p->density = density;
+    p->strokes = array_new(sizeof(Stroke), (FreeNotify)free_stroke);
+    p->images = array_new(sizeof(Image), (FreeNotify)free_image);
+    p->texts = array_new(sizeof(TextBox), (FreeNotify)free_text);
+    update(p);
+    return p;
+}
+
+size_t pages_count(NotedCanvas *self)
+{
+    return count_of(self->pageRoot);
+}
+
+float pages_height(NotedCanvas *self)
+{
+    // Every page is followed by a gap except the last
+    if(!self->pageRoot)
+        return 0;
+    return self->pageRoot->extent - kPageGap;
+}
+
+Page * pages_get(NotedCanvas *self, size_t index)
+{
+    Page *t = self->pageRoot;
+    while(t)
+    {
+        size_t nleft = count_of(t->left);
+        if(index < nleft)
+            t = t->left;
+        else if(index == nleft)
+            return t;
+        else
+        {
+            index -= nleft + 1;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+Page * pages_at_y(NotedCanvas *self, float y)
+{
+    Page *t = self->pageRoot;
+    while(t)
+    {
+        float above = extent_of(t->left);
+        if(y < above && t->left)
+            t = t->left;
+        else if(y < above + t->height + kPageGap || !t->right)
+            return t;
+        else
+        {
+            y -= above + t->height + kPageGap;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+Page * pages_first(NotedCanvas *self)
+{
+    Page *t = self->pageRoot;
+    while(t && t->left)
+        t = t->left;
+    return t;
+}
+
+Page * page_next(Page *p)
+{
+    if(p->right)
+    {
+        p = p->right;
+        while(p->left)
+            p = p->left;
+        return p;
+    }
+    
+    while(p->parent && p->parent->right == p)
+        p = p->parent;
+    return p->parent;
+}
+
+size_t page_index(Page *p)
+{
+    size_t index = count_of(p->left);
+    for(; p->parent; p = p->parent)
+    {
+        if(p->parent->right == p)
+            index += count_of(p->parent->left) + 1;
+    }
+    return index;
+}
+
+NCRect page_rect(Page *p)
+{
+    float y = extent_of(p->left);
+    for(Page *t = p; t->parent; t = t->parent)
+    {
+        if(t->parent->right == t)
+            y += extent_of(t->parent->left) + t->parent->height + kPageGap;
+    }
+    return (NCRect){0, y, p->width, y + p->height};
+}
+
+void pages_insert(NotedCanvas *self, size_t index, Page *p)
+{
+    Page *a, *b;
+    p->left = p->right = p->parent = NULL;
+    update(p);
+    
+    // Given here rather than in page_new, which can run on
+    // several threads at once while a file is opened
+    p->priority = next_priority();
+    
+    split(self->pageRoot, index, &a, &b);
+    self->pageRoot = merge(merge(a, p), b);
+    self->pageRoot->parent = NULL;
+}
+
+Page * pages_remove(NotedCanvas *self, size_t index)
+{
+    Page *a, *b, *p, *c;
+    split(self->pageRoot, index, &a, &b);
+    split(b, 1, &p, &c);
+    
+    self->pageRoot = merge(a, c);
+    if(self->pageRoot)
+        self->pageRoot->parent = NULL;
+    
+    if(p)
+        p->parent = NULL;
+    return p;
+}
+
+void pages_update(NotedCanvas *self, Page *p)
+{
+    // Sizes below p are unchanged; only p and its ancestors'
+    // totals need redoing.
+    for(; p; p = p->parent)
+        update(p);
+}
+
+void pages_free(NotedCanvas *self)
+{
+    // Free in order, detaching each page as it goes so the
+    // traversal never revisits a freed node.
+    Page *p = self->pageRoot;
+    while(p)
+    {
+        if(p->left)
+        {
+            Page *l = p->left;
+            p->left = NULL;
+            p = l;
+        }
+        else if(p->right)
+        {
+            Page *r = p->right;
+            p->right = NULL;
+            p = r;
+        }
+        else
+        {
+            Page *parent = p->parent;
+            free_page(p);
+            p = parent;
+        }
+    }
+    self->pageRoot = NULL;
+}
+
+// Joins two treaps, with all of a's pages before b's
+static Page * merge(Page *a, Page *b)
+{
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+    
+    if(a->priority > b->priority)
+    {
+        a->right = merge(a->right, b);
+        a->right->parent = a;
+        update(a);
+        return a;
+    }
+    else
+    {
+        b->left = merge(a, b->left);
+        b->left->parent = b;
+        update(b);
+        return b;
+    }
+}
+
+// Splits t into its first index pages (a) and the rest (b)
+static void split(Page *t, size_t index, Page **a, Page **b)
+{
+    if(!t)
+    {
+        *a = *b = NULL;
+        return;
+    }
+    
+    if(index <= count_of(t->left))
+    {
+        split(t->left, index, a, &t->left);
+        if(t->left)
+            t->left->parent = t;
+        if(*a)
+            (*a)->parent = NULL;
+        t->parent = NULL;
+        *b = t;
+    }
+    else
+    {
+        split(t->right, index - count_of(t->left) - 1, &t->right, b);
+        if(t->right)
+            t->right->parent = t;
+        if(*b)
+            (*b)->parent = NULL;
+        t->parent = NULL;
+        *a = t;
+    }
+    update(t);
+}
+
+static void update(Page *t)
+{
+    t->count = count_of(t->left) + 1 + count_of(t->right);
+    t->extent = extent_of(t->left) + t->height + kPageGap + extent_of(t->right);
+}
+
+// xorshift32; the treap only needs priorities to be spread out.
+// Canvases can be opened on several threads at once, so each
+// thread has its own state.
+static unsigned int next_priority(void)
+{
+    static __thread unsigned int state = 2463534242;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
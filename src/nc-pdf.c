@@ -0,0 +1,326 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-pdf.c: Pages with a page of a PDF behind them.
+ *   A PDF isn't opened until one of its pages is drawn, and then
+ *   only the pages that are drawn are read, so a notebook made
+ *   from a long PDF opens as fast as a blank one. Drawn pages
+ *   are kept as rasters at a few zoom levels, in the surface
+ *   cache (see nc-cache.c).
+ *   PDFs are read with poppler-glib. Without NC_HAVE_POPPLER,
+ *   PDF pages keep their PDF when saved but draw blank.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef NC_HAVE_POPPLER
+#include <poppler.h>
+#endif
+
+// Rasters are rendered at power of two widths from
+// kMinRasterWidth, the smallest that's at least as wide as the
+// page is drawn, so zooming only renders a page again when it
+// passes one of them. Past kMaxRasterWidth, only the part of the
+// page in the clip is rendered, on every draw.
+static const int kMinRasterWidth = 128;
+static const int kMaxRasterWidth = 4096;
+
+typedef struct PdfDocument_ PdfDocument;
+
+// An open PDF, shared by every background from it
+struct PdfDocument_
+{
+    char *path;
+    unsigned int refs; // Guarded by documentsLock
+    PdfDocument *next; // Guarded by documentsLock
+#ifdef NC_HAVE_POPPLER
+    pthread_mutex_t lock; // Poppler documents are used by one thread at a time
+    PopplerDocument *doc; // NULL until a page is first drawn
+    bool failed; // Couldn't be opened, so isn't tried again
+#endif
+};
+
+struct PageBackground_
+{
+    unsigned int refs; // Changed atomically
+    PdfDocument *doc;
+    unsigned int index;
+    CachedSurface *rasters; // Keyed by level: kMinRasterWidth << level wide
+};
+
+static pthread_mutex_t documentsLock = PTHREAD_MUTEX_INITIALIZER;
+static PdfDocument *documents;
+
+static PdfDocument * get_document(const char *path);
+static void release_document(PdfDocument *d);
+#ifdef NC_HAVE_POPPLER
+static bool open_document(PdfDocument *d);
+static PopplerPage * open_page(PageBackground *b);
+static cairo_surface_t * render_raster(PageBackground *b, int width);
+static void render_direct(cairo_t *cr, PageBackground *b, NCRect *pb);
+#endif
+
+
+PageBackground * page_background_new(const char *pdfPath, unsigned int index)
+{
+    PageBackground *b = calloc(1, sizeof(PageBackground));
+    b->refs = 1;
+    b->doc = get_document(pdfPath);
+    b->index = index;
+    return b;
+}
+
+PageBackground * page_background_retain(PageBackground *b)
+{
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+void page_background_release(PageBackground *b)
+{
+    if(!b || __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    surface_cache_drop(&b->rasters);
+    release_document(b->doc);
+    free(b);
+}
+
+const char * page_background_path(PageBackground *b, unsigned int *index)
+{
+    *index = b->index;
+    return b->doc->path;
+}
+
+size_t page_background_memory(PageBackground *b, size_t *cached)
+{
+    *cached = surface_cache_size(&b->rasters);
+    return sizeof(PageBackground);
+}
+
+Page ** pdf_import_pages(const char *pdfPath)
+{
+#ifdef NC_HAVE_POPPLER
+    // Notebooks can be opened from anywhere, so they keep the
+    // PDF's full path
+    char *path = realpath(pdfPath, NULL);
+    if(!path)
+        return NULL;
+    PdfDocument *d = get_document(path);
+    free(path);
+    
+    // Every page's size has to be read here to lay the pages out,
+    // but nothing is rendered until a page is drawn
+    Page **pages = NULL;
+    pthread_mutex_lock(&d->lock);
+    if(open_document(d))
+    {
+        int n = poppler_document_get_n_pages(d->doc);
+        pages = array_new(sizeof(Page *), NULL);
+        for(int i = 0; i < n; ++i)
+        {
+            PopplerPage *page = poppler_document_get_page(d->doc, i);
+            double width = 1, height = 1;
+            if(page)
+            {
+                poppler_page_get_size(page, &width, &height);
+                g_object_unref(page);
+            }
+            if(width <= 0 || height <= 0)
+                width = height = 1;
+            
+            Page *p = page_new(1, height / width, kNCPagePDF, 0);
+            p->background = page_background_new(d->path, i);
+            pages = array_append(pages, &p);
+        }
+        
+        if(array_size(pages) == 0)
+        {
+            array_free(pages);
+            pages = NULL;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    
+    release_document(d);
+    return pages;
+#else
+    return NULL;
+#endif
+}
+
+void draw_background(cairo_t *cr, Page *p, NCRect *pb, float magnification)
+{
+#ifdef NC_HAVE_POPPLER
+    PageBackground *b = p->background;
+    if(!b)
+        return;
+    
+    double dx = pb->x2 - pb->x1, dy = 0;
+    cairo_user_to_device_distance(cr, &dx, &dy);
+    double width = hypot(dx, dy) * magnification;
+    
+    // Vector targets, like PDF export, get the page as it is
+    if(target_is_vector(cr) || width > kMaxRasterWidth)
+    {
+        render_direct(cr, b, pb);
+        return;
+    }
+    
+    unsigned int level = 0;
+    while((kMinRasterWidth << level) < width)
+        ++level;
+    
+    cairo_surface_t *raster = surface_cache_get(&b->rasters, level);
+    if(!raster && (raster = render_raster(b, kMinRasterWidth << level)))
+        surface_cache_put(&b->rasters, level, raster);
+    if(!raster)
+        return;
+    
+    cairo_save(cr);
+    cairo_translate(cr, pb->x1, pb->y1);
+    cairo_scale(cr, (pb->x2 - pb->x1) / cairo_image_surface_get_width(raster),
+                    (pb->y2 - pb->y1) / cairo_image_surface_get_height(raster));
+    cairo_set_source_surface(cr, raster, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_paint(cr);
+    cairo_restore(cr);
+    cairo_surface_destroy(raster);
+#endif
+}
+
+// The document for path, opening the registry's entry for it
+// if it isn't there yet. The PDF itself isn't read.
+static PdfDocument * get_document(const char *path)
+{
+    pthread_mutex_lock(&documentsLock);
+    PdfDocument *d = documents;
+    while(d && strcmp(d->path, path) != 0)
+        d = d->next;
+    
+    if(d)
+        ++d->refs;
+    else
+    {
+        d = calloc(1, sizeof(PdfDocument));
+        d->path = strdup(path);
+        d->refs = 1;
+#ifdef NC_HAVE_POPPLER
+        pthread_mutex_init(&d->lock, NULL);
+#endif
+        d->next = documents;
+        documents = d;
+    }
+    pthread_mutex_unlock(&documentsLock);
+    return d;
+}
+
+static void release_document(PdfDocument *d)
+{
+    pthread_mutex_lock(&documentsLock);
+    if(--d->refs > 0)
+    {
+        pthread_mutex_unlock(&documentsLock);
+        return;
+    }
+    
+    PdfDocument **link = &documents;
+    while(*link != d)
+        link = &(*link)->next;
+    *link = d->next;
+    pthread_mutex_unlock(&documentsLock);
+
+#ifdef NC_HAVE_POPPLER
+    if(d->doc)
+        g_object_unref(d->doc);
+    pthread_mutex_destroy(&d->lock);
+#endif
+    free(d->path);
+    free(d);
+}
+
+#ifdef NC_HAVE_POPPLER
+
+// Opens d's PDF the first time it's needed. Only call with d's
+// lock held.
+static bool open_document(PdfDocument *d)
+{
+    if(!d->doc && !d->failed)
+    {
+        gchar *uri = g_filename_to_uri(d->path, NULL, NULL);
+        d->doc = uri ? poppler_document_new_from_file(uri, NULL, NULL) : NULL;
+        d->failed = !d->doc;
+        g_free(uri);
+    }
+    return d->doc != NULL;
+}
+
+// b's page of its PDF, or NULL. Only call with the document's
+// lock held.
+static PopplerPage * open_page(PageBackground *b)
+{
+    if(!open_document(b->doc))
+        return NULL;
+    return poppler_document_get_page(b->doc->doc, b->index);
+}
+
+// Renders b's page width pixels wide, or returns NULL if it
+// can't be read
+static cairo_surface_t * render_raster(PageBackground *b, int width)
+{
+    cairo_surface_t *surface = NULL;
+    pthread_mutex_lock(&b->doc->lock);
+    PopplerPage *page = open_page(b);
+    if(page)
+    {
+        double pw, ph;
+        poppler_page_get_size(page, &pw, &ph);
+        int height = (int)fmax(1, round(width * ph / pw));
+        
+        surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+        cairo_t *cr = cairo_create(surface);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_paint(cr);
+        cairo_scale(cr, width / pw, height / ph);
+        poppler_page_render(page, cr);
+        cairo_destroy(cr);
+        g_object_unref(page);
+        
+        if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+        {
+            cairo_surface_destroy(surface);
+            surface = NULL;
+        }
+    }
+    pthread_mutex_unlock(&b->doc->lock);
+    return surface;
+}
+
+// Renders b's page straight onto cr, within cr's clip
+static void render_direct(cairo_t *cr, PageBackground *b, NCRect *pb)
+{
+    pthread_mutex_lock(&b->doc->lock);
+    PopplerPage *page = open_page(b);
+    if(page)
+    {
+        double pw, ph;
+        poppler_page_get_size(page, &pw, &ph);
+        
+        cairo_save(cr);
+        cairo_rectangle(cr, pb->x1, pb->y1, pb->x2 - pb->x1, pb->y2 - pb->y1);
+        cairo_clip(cr);
+        cairo_translate(cr, pb->x1, pb->y1);
+        cairo_scale(cr, (pb->x2 - pb->x1) / pw, (pb->y2 - pb->y1) / ph);
+        poppler_page_render(page, cr);
+        cairo_restore(cr);
+        g_object_unref(page);
+    }
+    pthread_mutex_unlock(&b->doc->lock);
+}
+
+#endif
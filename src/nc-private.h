@@ -9,44 +9,243 @@
 #define nc_private_h
 
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "notedcanvas.h"
 
 typedef struct Page_ Page;
+typedef struct ThumbnailQueue_ ThumbnailQueue;
+typedef struct PageReader_ PageReader;
+typedef struct PageBackground_ PageBackground;
+typedef struct CachedSurface_ CachedSurface;
+typedef struct ImageData_ ImageData;
+typedef struct ImageQueue_ ImageQueue;
+typedef struct TextLayout_ TextLayout;
+typedef struct InputRecording_ InputRecording;
+typedef struct PageView_ PageView;
+typedef struct StrokePoints_ StrokePoints;
 
 typedef struct
 {
     Page *page; // Owner page
     float *x; // Array of xs
     float *y; // Array of ys
+    float *p; // Array of pressures, or NULL for constant width
+    float *outline; // Cached fill outline (x, y pairs) of variable width strokes, or NULL
     NCRect bounds;
     NCStrokeStyle style;
     float maxDistSq; // Longest distance (squared) between two consecutive points
+    bool selected;
+    StrokePoints *shared; // Copy of the points for snapshots, or NULL if they changed since (see nc-snapshot.c)
 } Stroke;
 
+typedef struct
+{
+    ImageData *data; // Shared with copies of the image
+    NCRect bounds; // In page coordinates
+} Image;
+
+typedef struct
+{
+    char *text; // UTF-8
+    NCRect bounds; // In page coordinates; the text wraps at its width, and its height follows
+    float size; // Font size
+    uint8_t r, g, b, a;
+    TextLayout *layout; // Shaped text, shared with copies, or NULL if there's nothing to draw
+} TextBox;
+
+typedef struct
+{
+    float x, y, pressure;
+    double time;
+} PenSample;
+
+typedef enum
+{
+    kSelectDragNone,
+    kSelectDragMove,
+    kSelectDragScale,
+} SelectDrag;
+
+/*
+ * A page's thumbnail (see nc-thumbs.c). The thumbnail thread
+ * holds a reference while rendering one, so it can outlive its
+ * page.
+ */
+typedef struct
+{
+    unsigned int refs; // Changed atomically
+    bool stale; // Page changed since its last render was queued
+    
+    // Guarded by the thumbnail queue's lock
+    unsigned int pending; // Renders queued or running
+    uint8_t *png; // As stored in the file, or NULL
+    size_t pngSize;
+    cairo_surface_t *surface; // png decoded for drawing, or NULL
+} Thumbnail;
+
 struct Page_
 {
     Stroke *strokes;
-    NCRect bounds;
+    Image *images; // Drawn under the strokes, in order
+    TextBox *texts; // Drawn over the images and under the strokes, in order
+    Thumbnail *thumb; // NULL until the page changes or one is loaded
+    float width, height; // Position comes from page_rect
     NCPagePattern pattern;
     unsigned int density;
+    PageBackground *background; // The PDF page behind it if pattern is kNCPagePDF, else NULL
+    PageView *view; // Copy for snapshots, or NULL if it changed since the last one
+    Page *left, *right, *parent; // Page tree links (see nc-pages.c)
+    unsigned int priority;
+    size_t count; // Pages in this subtree
+    float extent; // Height of this subtree's pages, with gaps
 };
 
 struct NotedCanvas_
 {
     NCInvalidateCallback invalidateCallback;
     void *callbackData;
+    NCWetInkCallback wetInkCallback;
+    void *wetInkData;
+    size_t wetInkDrawn; // Points of currentStroke already on the overlay
     unsigned long lastStroke; // Used for undo
-    Page *pages;
+    Page *pageRoot; // Page tree, in page order
     Stroke *currentStroke;
     float eraserPrevX, eraserPrevY;
     NCStrokeStyle currentStyle;
     char *path;
+    uint8_t *saveBuffer; // Reused by every save, or NULL
     bool inGesture; // True from input down to input up
+    unsigned int inputDepth; // > 0 while handling input
+    NCRect *damage; // Merged, non-overlapping rects waiting to be flushed
+    bool deferDamage; // Only flush damage on noted_canvas_flush_damage
+    float predictHorizon; // Seconds to predict ahead, 0 for off
+    PenSample predictHistory[3]; // Latest raw pen samples, page-relative
+    unsigned int predictCount;
+    bool hasPredictTail;
+    float predictX, predictY; // Provisional end of the stroke in progress
+    double predictTime; // Time predictX/Y were predicted for
+    NCPredictionStats predictStats;
+    float simplifyTolerance; // Canvas units, 0 for off
+    NCSelectMode selectMode;
+    float *lassoX, *lassoY; // Select tool path in progress, or NULL
+    unsigned long nselected;
+    NCRect selectionBounds; // Includes stroke thickness
+    SelectDrag selectDrag; // What the select tool is doing to the selection
+    cairo_matrix_t selectTransform; // Pending transform of the selection while dragging
+    float dragX, dragY; // Where the drag started
+    ThumbnailQueue *thumbQueue; // Created when thumbnails are first needed, or NULL
+    ImageQueue *imageQueue; // Created when an image callback is set, or NULL
+    InputRecording *recording; // See noted_canvas_record_input, or NULL
+    bool snapshotted; // Pages have copies for snapshots that changes have to drop
+#ifdef NC_STATS
+    NCStats stats; // Guarded by the stats lock (see nc-stats.c)
+#endif
 };
 
 void free_stroke(Stroke *s);
+void free_image(Image *img);
+void free_text(TextBox *t);
 void free_page(Page *p);
 
+/*
+ * Pages are kept in order in a balanced tree (see nc-pages.c).
+ * Finding a page's index or rect, finding a page by index or y,
+ * and inserting or removing a page all take O(log n).
+ */
+Page * page_new(float width, float height, NCPagePattern pattern, unsigned int density);
+size_t pages_count(NotedCanvas *canvas);
+float pages_height(NotedCanvas *canvas);
+Page * pages_get(NotedCanvas *canvas, size_t index);
+
+/*
+ * The page whose rect or the gap after it contains y. Above
+ * the first page is the first page, below the last the last.
+ */
+Page * pages_at_y(NotedCanvas *canvas, float y);
+
+/*
+ * In order iteration: for(p = pages_first(c); p; p = page_next(p))
+ */
+Page * pages_first(NotedCanvas *canvas);
+Page * page_next(Page *p);
+
+size_t page_index(Page *p);
+NCRect page_rect(Page *p);
+void pages_insert(NotedCanvas *canvas, size_t index, Page *p);
+Page * pages_remove(NotedCanvas *canvas, size_t index);
+
+/*
+ * Call after changing p's height.
+ */
+void pages_update(NotedCanvas *canvas, Page *p);
+
+/*
+ * Frees every page.
+ */
+void pages_free(NotedCanvas *canvas);
+
+/*
+ * Recalculates s's bounds and maxDistSq from its points.
+ */
+void stroke_update_metrics(Stroke *s);
+
+/*
+ * Removes points that are within tolerance of the line
+ * through their neighbors. Returns true if any were removed,
+ * in which case bounds and maxDistSq are updated.
+ */
+bool stroke_simplify(Stroke *s, float tolerance);
+
+/*
+ * Line width of s at point i, taking pressure into account.
+ */
+float stroke_width_at(Stroke *s, size_t i);
+
+/*
+ * Whether s's pressure varies enough for its width to follow it.
+ * Strokes that don't are drawn at their style's thickness, and
+ * get no outline.
+ */
+bool stroke_varies_pressure(Stroke *s);
+
+/*
+ * Rebuilds s->outline. Strokes with varying pressure get an
+ * outline that is filled instead of stroked, so it is computed
+ * once here instead of on every draw. Others get NULL.
+ */
+void stroke_update_outline(Stroke *s);
+
+/*
+ * Selects the strokes inside the polygon px, py (in canvas
+ * coordinates), adding to the current selection. Set box if
+ * the polygon is a rectangle, to skip point tests on strokes
+ * that are entirely inside it.
+ */
+void select_in_polygon(NotedCanvas *canvas, const float *px, const float *py, size_t npoly, bool box);
+
+/*
+ * Recalculates selectionBounds from the selected strokes.
+ */
+void selection_update_bounds(NotedCanvas *canvas);
+
+/*
+ * Bakes m into the selected strokes' points. Strokes that
+ * end up mostly on another page are moved to that page.
+ */
+void selection_apply_transform(NotedCanvas *canvas, const cairo_matrix_t *m);
+
+/*
+ * Moves every point of s by dx, dy.
+ */
+void stroke_translate(Stroke *s, float dx, float dy);
+
+/*
+ * Calculates the bezier control points for one dimension of a
+ * stroke's points (see nc-stroke.c). cp1 and cp2 need n-1 elements.
+ */
+void calculate_control_points(float *p, int n, float *cp1, float *cp2);
+
 inline void rect_expand_by_point(NCRect *a, float x, float y)
 {
     if(x > a->x2)
@@ -64,6 +263,313 @@ inline float sq_dist(float x1, float y1, float x2, float y2)
     return (x2-x1)*(x2-x1)+(y2-y1)*(y2-y1);
 }
 
+// A file's modified time in nanoseconds since the epoch
+static inline int64_t stat_mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+ * File floats are IEEE 754 singles in little-endian order. They
+ * used to go through a portable ntohf/htonf that, on little-endian
+ * machines, ended up passing each float's own bytes to fwrite, so
+ * that's what every existing file holds. Converting is a bit-cast:
+ * nothing at all on little-endian hosts, a byte swap elsewhere.
+ * Recordings store floats the same way.
+ */
+static inline float file_float(float v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint32_t u;
+    memcpy(&u, &v, sizeof(float));
+    u = __builtin_bswap32(u);
+    memcpy(&v, &u, sizeof(float));
+#endif
+    return v;
+}
+
 bool noted_canvas_save(NotedCanvas *canvas, const char *path);
 
+/*
+ * Bytes of the canvas's save buffer, which is kept between saves.
+ */
+size_t save_buffer_memory(NotedCanvas *canvas);
+
+/*
+ * Input recording (see nc-record.c). Only call while the canvas
+ * is recording. Times are on the canvas's input clock.
+ */
+void record_input(NotedCanvas *canvas, NCInputTool tool, const NCInputSample *sample, bool batched, bool first);
+void record_setting(NotedCanvas *canvas, const NCRecordEvent *event);
+
+/*
+ * Performance counters and tracing (see nc-stats.c), kept when
+ * built with NC_STATS. An operation is timed from a stats_now()
+ * at its start to a stats_end at its end, which also traces it.
+ * Without NC_STATS these are empty, and they compile away along
+ * with whatever is counted for them.
+ */
+#ifdef NC_STATS
+uint64_t stats_now(void);
+void stats_end(NotedCanvas *canvas, NCStatOp op, uint64_t start);
+void stats_end_draw(NotedCanvas *canvas, uint64_t start, unsigned long drawn, unsigned long culled, unsigned long points);
+void stats_end_erase(NotedCanvas *canvas, uint64_t start, unsigned long candidates, unsigned long rasterized, unsigned long erased);
+#else
+static inline uint64_t stats_now(void)
+{
+    return 0;
+}
+
+static inline void stats_end(NotedCanvas *canvas, NCStatOp op, uint64_t start)
+{
+}
+
+static inline void stats_end_draw(NotedCanvas *canvas, uint64_t start, unsigned long drawn, unsigned long culled, unsigned long points)
+{
+}
+
+static inline void stats_end_erase(NotedCanvas *canvas, uint64_t start, unsigned long candidates, unsigned long rasterized, unsigned long erased)
+{
+}
+#endif
+
+/*
+ * Reads the pages of a notebook file one at a time, for going
+ * through a file without holding all of it (see nc-opensave.c).
+ * Pages read are new and not on any canvas; free them with
+ * free_page. Returns NULL for v1 files, which can only be read
+ * whole.
+ */
+PageReader * page_reader_open(const char *path);
+size_t page_reader_count(PageReader *reader);
+Page * page_reader_read(PageReader *reader, size_t index);
+void page_reader_close(PageReader *reader);
+
+/*
+ * Drawing shared with thumbnails. Both draw in page coordinates,
+ * with magnification as for noted_canvas_draw.
+ */
+void draw_page(cairo_t *cr, Page *p, NCRect *pb, float magnification);
+void draw_stroke(cairo_t *cr, Stroke *s, float magnification);
+
+/*
+ * Drawing shared with snapshots (see nc-snapshot.c), which keep
+ * copies of pages instead of the canvas's own. draw_page_content
+ * draws p's images, text and strokes at pb, within clip. current
+ * is the stroke in progress if it's on p, which is left to the
+ * overlay with wetInk; with dragging, selected strokes are left
+ * to draw_selected_strokes. canvas may be NULL.
+ * draw_current_stroke draws the stroke in progress, which
+ * doesn't have its curves or outline yet, relative to its page.
+ */
+typedef struct
+{
+    unsigned long drawn, culled, points;
+} DrawCounts;
+
+void draw_page_content(cairo_t *cr, NotedCanvas *canvas, Page *p, const NCRect *pb, const NCRect *clip,
+                       float magnification, Stroke *current, bool wetInk, bool dragging, DrawCounts *counts);
+void draw_selected_strokes(cairo_t *cr, Page *p, const NCRect *pb, float magnification);
+void draw_selection_outline(cairo_t *cr, const float *lassoX, const float *lassoY, size_t nlasso, NCSelectMode mode, const NCRect *selection);
+void draw_current_stroke(cairo_t *cr, Stroke *s, float magnification);
+void draw_tail(cairo_t *cr, const NCRect *pb, Stroke *s, float x, float y);
+NCRect selection_rect(NotedCanvas *canvas);
+
+/*
+ * Snapshots copy each page once and share the copy until the
+ * page changes, and copy each stroke's points once and share
+ * them until they change. snapshot_mark drops the copies of the
+ * pages under r, whose strokes or selection changed. The stroke
+ * in progress isn't in the copies, so changes to it don't need
+ * marking. stroke_unshare drops s's copy of its points, and
+ * has to be called whenever they or its outline change.
+ */
+void snapshot_mark(NotedCanvas *canvas, const NCRect *r);
+void stroke_unshare(Stroke *s);
+void page_view_release(PageView *v);
+size_t page_snapshot_memory(Page *p);
+
+/*
+ * Cached surfaces (see nc-cache.c). Each owner keeps its
+ * surfaces in a list, initially NULL, by key; the cache can
+ * drop any of them whenever it needs room. Gets return a new
+ * reference, or NULL if the surface isn't cached.
+ * surface_cache_get_nearest returns the one whose key is
+ * closest to key, preferring the lower, and sets found to its
+ * key. Owners drop their list before they're freed.
+ */
+cairo_surface_t * surface_cache_get(CachedSurface **list, unsigned int key);
+cairo_surface_t * surface_cache_get_nearest(CachedSurface **list, unsigned int key, unsigned int *found);
+void surface_cache_put(CachedSurface **list, unsigned int key, cairo_surface_t *surface);
+void surface_cache_drop(CachedSurface **list);
+
+/*
+ * Bytes of the surfaces in an owner's list, as cached.
+ */
+size_t surface_cache_size(CachedSurface **list);
+
+// Whether cr draws to a vector surface, like a PDF, that keeps
+// what's drawn as it is instead of as pixels
+static inline bool target_is_vector(cairo_t *cr)
+{
+    cairo_surface_type_t type = cairo_surface_get_type(cairo_get_target(cr));
+    return type == CAIRO_SURFACE_TYPE_PDF || type == CAIRO_SURFACE_TYPE_PS
+        || type == CAIRO_SURFACE_TYPE_SVG || type == CAIRO_SURFACE_TYPE_RECORDING;
+}
+
+/*
+ * PDF page backgrounds (see nc-pdf.c). A background names a
+ * page of a PDF by the PDF's path, and is shared by the pages
+ * and page copies that show it. Nothing is read from the PDF
+ * until draw_background needs it.
+ */
+PageBackground * page_background_new(const char *pdfPath, unsigned int index);
+PageBackground * page_background_retain(PageBackground *b);
+void page_background_release(PageBackground *b);
+const char * page_background_path(PageBackground *b, unsigned int *index);
+
+/*
+ * Bytes the background takes, and sets cached to the bytes of
+ * its cached rasters.
+ */
+size_t page_background_memory(PageBackground *b, size_t *cached);
+
+/*
+ * New pages for the pages of the PDF at pdfPath, a unit wide
+ * and shaped like them, or NULL if it can't be read. Returns an
+ * array of pages that aren't on any canvas.
+ */
+Page ** pdf_import_pages(const char *pdfPath);
+
+/*
+ * Draws p's PDF page into pb. Called by draw_page.
+ */
+void draw_background(cairo_t *cr, Page *p, NCRect *pb, float magnification);
+
+/*
+ * Image data (see nc-images.c): an image file's contents, as
+ * saved, and its decoded sizes. image_data_new copies data, and
+ * returns NULL if it isn't a PNG or JPEG.
+ */
+ImageData * image_data_new(const void *data, size_t size);
+ImageData * image_data_retain(ImageData *d);
+void image_data_release(ImageData *d);
+const uint8_t * image_data_encoded(ImageData *d, size_t *size);
+
+/*
+ * The image's size in pixels, and whether it can be decoded
+ * (JPEGs need NC_HAVE_JPEG).
+ */
+bool image_data_info(ImageData *d, int *width, int *height);
+
+/*
+ * Bytes the image data takes, and sets cached to the bytes of
+ * its decoded sizes in the surface cache.
+ */
+size_t image_data_memory(ImageData *d, size_t *cached);
+
+/*
+ * Draws p's images that are within clip (page coordinates, or
+ * NULL for all), in page coordinates. With a canvas that has an
+ * image callback, images not decoded at the size they're drawn
+ * are drawn from the nearest size there is, and decoded on the
+ * canvas's image thread; otherwise they're decoded now.
+ */
+void draw_images(cairo_t *cr, NotedCanvas *canvas, Page *p, const NCRect *clip, float magnification);
+
+/*
+ * Stops the image thread, dropping decodes it hasn't started.
+ */
+void images_stop(NotedCanvas *canvas);
+
+/*
+ * Text boxes (see nc-text.c). A box's text is shaped into glyph
+ * runs by text_box_update, and drawing only places those runs,
+ * at any zoom. Call text_box_update after changing a box's text,
+ * width or size; it sets the box's height. text_box_copy shares
+ * the runs.
+ */
+void text_box_update(TextBox *t);
+TextBox text_box_copy(TextBox *t);
+
+/*
+ * Bytes of a box's shaped text, or 0 for NULL.
+ */
+size_t text_layout_memory(TextLayout *l);
+
+/*
+ * Draws p's text boxes that are within clip (page coordinates,
+ * or NULL for all), in page coordinates.
+ */
+void draw_texts(cairo_t *cr, Page *p, const NCRect *clip);
+
+/*
+ * Thumbnails (see nc-thumbs.c). Changes to the canvas mark the
+ * pages they touch as stale, and thumbnails_update has those
+ * rendered again on the thumbnail thread.
+ */
+void thumbnails_mark(NotedCanvas *canvas, const NCRect *r);
+void thumbnails_update(NotedCanvas *canvas);
+
+/*
+ * Keeps renders from finishing while a save is in progress, so
+ * thumbnail_current_png stays put. ok is whether it saved.
+ */
+void thumbnails_begin_save(NotedCanvas *canvas);
+void thumbnails_end_save(NotedCanvas *canvas, bool ok);
+
+/*
+ * Waits for queued renders and stops the thumbnail thread.
+ * Returns true if renders changed a png since the last save.
+ */
+bool thumbnails_stop(NotedCanvas *canvas);
+
+/*
+ * A page's last finished png, or NULL if it has none yet. It
+ * may be behind the page while a render is pending, in which
+ * case thumbnails_stop reports the newer one unsaved once done.
+ * Only call between thumbnails_begin_save and _end_save.
+ */
+const uint8_t * thumbnail_current_png(Page *p, size_t *size);
+
+/*
+ * Gives a page the png stored for it. The page mustn't be on a
+ * canvas yet.
+ */
+void thumbnail_set_png(Page *p, const uint8_t *png, size_t size);
+void thumbnail_release(Thumbnail *t);
+
+/*
+ * Bytes of p's thumbnail, as a png and decoded.
+ */
+size_t thumbnail_memory(NotedCanvas *canvas, Page *p);
+
+/*
+ * Decodes a thumbnail png, or returns NULL if it's not valid.
+ */
+cairo_surface_t * thumbnail_decode(const uint8_t *png, size_t size);
+
+/*
+ * Clipboard contents, encoded with the file format's records
+ * (see nc-opensave.c). The strokes clip holds the selected
+ * strokes with points relative to originX, originY; the pages
+ * clip holds n pages from index. Both return a malloc'd clip
+ * and set size, or return NULL.
+ */
+void * clip_encode_strokes(NotedCanvas *canvas, float originX, float originY, size_t *size);
+void * clip_encode_pages(NotedCanvas *canvas, size_t index, size_t n, size_t *size);
+
+/*
+ * Decodes a clip into a new array of either pages or strokes,
+ * setting the other to NULL. Decoded strokes have their metrics
+ * and outlines ready, but no owner page. Returns false if the
+ * clip isn't valid.
+ */
+bool clip_decode(const void *content, size_t size, Page ***pages, Stroke **strokes);
+
+
 #endif /* nc_private_h */
@@ -0,0 +1,277 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-record.c: Recording a canvas's input to a file, to be
+ *   played back later against a fresh canvas (see
+ *   tools/noted-replay.c). Every input sample is kept as it was
+ *   handed to the canvas, with when it happened and whether it
+ *   came in a batch, along with the settings that change what
+ *   input does, so a recording played back at any speed leaves
+ *   the canvas as it was.
+ *   A recording is a magic number followed by fixed size
+ *   records, with integers in network order and floats stored
+ *   like the notebook format's.
+ */
+
+#include "nc-private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+static const uint32_t kRecordMagic = 0x819a7201;
+
+enum
+{
+    kRecordBatched = 1, // Part of a noted_canvas_input_batch call
+    kRecordBatchStart = 2, // The first sample of that call
+};
+
+typedef struct
+{
+    uint8_t kind; // NCRecordKind
+    uint8_t tool; // NCInputTool, for input
+    uint8_t state; // NCInputState, for input
+    uint8_t flags;
+    int32_t delta; // Microseconds since the previous record
+    union
+    {
+        struct { float x, y, pressure; } sample;
+        struct { uint8_t r, g, b, a; float thickness; } style;
+        uint32_t selectMode;
+        float value; // Simplify tolerance or prediction horizon
+    };
+} RecordEntry;
+
+struct InputRecording_
+{
+    FILE *f;
+    bool started; // Whether origin is set
+    double origin; // Time of the first input, in seconds
+    int64_t micros; // Time of the last record, from origin
+};
+
+struct NCRecording_
+{
+    FILE *f;
+    int64_t micros; // Time of the last record read
+    NCInputSample *samples;
+    size_t nsamples, capacity;
+    bool hasNext; // Whether next was read ahead, past the end of a batch
+    RecordEntry next;
+};
+
+static void write_entry(InputRecording *r, RecordEntry *e, double time);
+static bool read_entry(NCRecording *r, RecordEntry *e);
+static bool add_sample(NCRecording *r, RecordEntry *e);
+
+
+bool noted_canvas_record_input(NotedCanvas *self, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if(!f)
+        return false;
+    
+    uint32_t magic = htonl(kRecordMagic);
+    if(fwrite(&magic, sizeof(uint32_t), 1, f) != 1)
+    {
+        fclose(f);
+        return false;
+    }
+    
+    noted_canvas_stop_recording(self);
+    self->recording = calloc(1, sizeof(InputRecording));
+    self->recording->f = f;
+    
+    // Settings made before now still matter to playback, so they
+    // start the recording
+    record_setting(self, &(NCRecordEvent){.kind = kNCRecordStyle, .style = self->currentStyle});
+    record_setting(self, &(NCRecordEvent){.kind = kNCRecordSelectMode, .selectMode = self->selectMode});
+    record_setting(self, &(NCRecordEvent){.kind = kNCRecordSimplify, .value = self->simplifyTolerance});
+    record_setting(self, &(NCRecordEvent){.kind = kNCRecordPrediction, .value = self->predictHorizon});
+    return true;
+}
+
+void noted_canvas_stop_recording(NotedCanvas *self)
+{
+    if(!self->recording)
+        return;
+    fclose(self->recording->f);
+    free(self->recording);
+    self->recording = NULL;
+}
+
+void record_input(NotedCanvas *self, NCInputTool tool, const NCInputSample *sample, bool batched, bool first)
+{
+    RecordEntry e = {
+        .kind = kNCRecordInput,
+        .tool = tool,
+        .state = sample->state,
+        .flags = batched ? (kRecordBatched | (first ? kRecordBatchStart : 0)) : 0,
+        .sample = {file_float(sample->x), file_float(sample->y), file_float(sample->pressure)},
+    };
+    write_entry(self->recording, &e, sample->timestamp);
+}
+
+void record_setting(NotedCanvas *self, const NCRecordEvent *event)
+{
+    RecordEntry e = {.kind = event->kind};
+    switch(event->kind)
+    {
+        case kNCRecordStyle:
+            e.style.r = event->style.r;
+            e.style.g = event->style.g;
+            e.style.b = event->style.b;
+            e.style.a = event->style.a;
+            e.style.thickness = file_float(event->style.thickness);
+            break;
+        case kNCRecordSelectMode:
+            e.selectMode = htonl(event->selectMode);
+            break;
+        case kNCRecordSimplify:
+        case kNCRecordPrediction:
+            e.value = file_float(event->value);
+            break;
+        case kNCRecordInput:
+            return;
+    }
+    write_entry(self->recording, &e, event->time);
+}
+
+NCRecording * noted_recording_open(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return NULL;
+    
+    uint32_t magic;
+    if(fread(&magic, sizeof(uint32_t), 1, f) != 1 || ntohl(magic) != kRecordMagic)
+    {
+        fclose(f);
+        return NULL;
+    }
+    
+    NCRecording *r = calloc(1, sizeof(NCRecording));
+    r->f = f;
+    return r;
+}
+
+bool noted_recording_read(NCRecording *r, NCRecordEvent *event)
+{
+    RecordEntry e;
+    if(r->hasNext)
+    {
+        e = r->next;
+        r->hasNext = false;
+    }
+    else if(!read_entry(r, &e))
+        return false;
+    
+    memset(event, 0, sizeof(NCRecordEvent));
+    event->kind = e.kind;
+    event->time = r->micros / 1e6;
+    switch(e.kind)
+    {
+        case kNCRecordInput:
+            // A batch goes on until a record that doesn't continue
+            // it, which is kept for the next read
+            r->nsamples = 0;
+            if(!add_sample(r, &e))
+                return false;
+            while((e.flags & kRecordBatched) && read_entry(r, &r->next))
+            {
+                if(r->next.kind != kNCRecordInput || (r->next.flags & kRecordBatchStart) || !(r->next.flags & kRecordBatched))
+                {
+                    r->hasNext = true;
+                    break;
+                }
+                if(!add_sample(r, &r->next))
+                    return false;
+            }
+            event->tool = e.tool;
+            event->samples = r->samples;
+            event->nsamples = r->nsamples;
+            event->batch = (e.flags & kRecordBatched) != 0;
+            return true;
+        case kNCRecordStyle:
+            event->style.r = e.style.r;
+            event->style.g = e.style.g;
+            event->style.b = e.style.b;
+            event->style.a = e.style.a;
+            event->style.thickness = file_float(e.style.thickness);
+            return true;
+        case kNCRecordSelectMode:
+            event->selectMode = ntohl(e.selectMode);
+            return true;
+        case kNCRecordSimplify:
+        case kNCRecordPrediction:
+            event->value = file_float(e.value);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void noted_recording_close(NCRecording *r)
+{
+    if(!r)
+        return;
+    fclose(r->f);
+    free(r->samples);
+    free(r);
+}
+
+// Writes e at time, in seconds on the canvas's input clock
+static void write_entry(InputRecording *r, RecordEntry *e, double time)
+{
+    // Times count from the first input, so settings made before
+    // it are at 0
+    if(!r->started && e->kind == kNCRecordInput)
+    {
+        r->origin = time;
+        r->started = true;
+    }
+    int64_t micros = r->started ? llround((time - r->origin) * 1e6) : 0;
+    
+    int64_t delta = micros - r->micros;
+    if(delta > INT32_MAX)
+        delta = INT32_MAX;
+    else if(delta < INT32_MIN)
+        delta = INT32_MIN;
+    r->micros += delta;
+    e->delta = htonl((uint32_t)(int32_t)delta);
+    fwrite(e, sizeof(RecordEntry), 1, r->f);
+}
+
+static bool read_entry(NCRecording *r, RecordEntry *e)
+{
+    if(fread(e, sizeof(RecordEntry), 1, r->f) != 1)
+        return false;
+    r->micros += (int32_t)ntohl((uint32_t)e->delta);
+    return true;
+}
+
+// Adds e's sample to the samples of the event being read
+static bool add_sample(NCRecording *r, RecordEntry *e)
+{
+    if(r->nsamples == r->capacity)
+    {
+        size_t capacity = r->capacity ? r->capacity * 2 : 64;
+        NCInputSample *samples = realloc(r->samples, sizeof(NCInputSample) * capacity);
+        if(!samples)
+            return false;
+        r->samples = samples;
+        r->capacity = capacity;
+    }
+    
+    r->samples[r->nsamples++] = (NCInputSample){
+        .state = e->state,
+        .x = file_float(e->sample.x),
+        .y = file_float(e->sample.y),
+        .pressure = file_float(e->sample.pressure),
+        .timestamp = r->micros / 1e6,
+    };
+    return true;
+}
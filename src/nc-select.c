@@ -0,0 +1,267 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-select.c: Finding the strokes inside a lasso or box.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+static size_t count_points_in_polygon(const float *x, const float *y, size_t n, const float *px, const float *py, size_t npoly);
+
+// A lassoed stroke is selected when at least this much of it is inside
+static const float kMinInsideFraction = 0.5;
+
+
+void select_in_polygon(NotedCanvas *self, const float *px, const float *py, size_t npoly, bool box)
+{
+    if(npoly < 3)
+        return;
+    
+    NCRect polyBounds = {px[0], py[0], px[0], py[0]};
+    for(size_t i = 1; i < npoly; ++i)
+        rect_expand_by_point(&polyBounds, px[i], py[i]);
+    
+    // Polygon in page coordinates, so stroke points can be
+    // tested without offsetting each one.
+    float *ppx = malloc(sizeof(float) * 2 * npoly), *ppy = ppx + npoly;
+    if(!ppx)
+        return;
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        
+        if(polyBounds.x1 >= pb.x2 || polyBounds.x2 <= pb.x1
+           || polyBounds.y1 >= pb.y2 || polyBounds.y2 <= pb.y1)
+            continue;
+        
+        NCRect rel = {
+            polyBounds.x1 - pb.x1, polyBounds.y1 - pb.y1,
+            polyBounds.x2 - pb.x1, polyBounds.y2 - pb.y1
+        };
+        for(size_t k = 0; k < npoly; ++k)
+        {
+            ppx[k] = px[k] - pb.x1;
+            ppy[k] = py[k] - pb.y1;
+        }
+        
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(s->selected)
+                continue;
+            
+            // Narrow down by bounds first. Most strokes are
+            // rejected here without looking at their points.
+            if(s->bounds.x1 > rel.x2 || s->bounds.x2 < rel.x1
+               || s->bounds.y1 > rel.y2 || s->bounds.y2 < rel.y1)
+                continue;
+            
+            // Anything entirely inside a box is selected
+            if(box && s->bounds.x1 >= rel.x1 && s->bounds.x2 <= rel.x2
+               && s->bounds.y1 >= rel.y1 && s->bounds.y2 <= rel.y2)
+            {
+                s->selected = true;
+                ++self->nselected;
+                continue;
+            }
+            
+            size_t npoints = array_size(s->x);
+            size_t inside = count_points_in_polygon(s->x, s->y, npoints, ppx, ppy, npoly);
+            if(npoints > 0 && inside >= ceilf(npoints * kMinInsideFraction))
+            {
+                s->selected = true;
+                ++self->nselected;
+            }
+        }
+    }
+    
+    free(ppx);
+    selection_update_bounds(self);
+    snapshot_mark(self, &self->selectionBounds);
+}
+
+void selection_update_bounds(NotedCanvas *self)
+{
+    bool any = false;
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(!s->selected)
+                continue;
+            
+            NCRect r = s->bounds;
+            r.x1 += pb.x1 - s->style.thickness;
+            r.y1 += pb.y1 - s->style.thickness;
+            r.x2 += pb.x1 + s->style.thickness;
+            r.y2 += pb.y1 + s->style.thickness;
+            
+            if(!any)
+                self->selectionBounds = r;
+            else
+            {
+                rect_expand_by_point(&self->selectionBounds, r.x1, r.y1);
+                rect_expand_by_point(&self->selectionBounds, r.x2, r.y2);
+            }
+            any = true;
+        }
+    }
+    
+    if(!any)
+        self->selectionBounds = (NCRect){0};
+}
+
+void selection_apply_transform(NotedCanvas *self, const cairo_matrix_t *m)
+{
+    // Line widths scale with the strokes, like they did while
+    // the transform was drawn by cairo.
+    float scale = sqrt(fabs(m->xx * m->yy - m->xy * m->yx));
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        float ox = pb.x1, oy = pb.y1;
+        
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(!s->selected)
+                continue;
+            
+            stroke_unshare(s);
+            size_t npoints = array_size(s->x);
+            for(size_t k = 0; k < npoints; ++k)
+            {
+                double x = s->x[k] + ox, y = s->y[k] + oy;
+                cairo_matrix_transform_point(m, &x, &y);
+                s->x[k] = x - ox;
+                s->y[k] = y - oy;
+            }
+            
+            s->style.thickness *= scale;
+            stroke_update_metrics(s);
+            stroke_update_outline(s);
+        }
+    }
+    
+    // Re-parent strokes whose center is now on another page. A
+    // moved stroke may be visited again on its new page, but then
+    // it's already home.
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(!s->selected)
+                continue;
+            
+            float cx = pb.x1 + (s->bounds.x1 + s->bounds.x2) / 2;
+            float cy = pb.y1 + (s->bounds.y1 + s->bounds.y2) / 2;
+            Page *target = pages_at_y(self, cy);
+            if(!target || target == p)
+                continue;
+            
+            // Stay put if the center is off the page
+            NCRect tb = page_rect(target);
+            if(cx < tb.x1 || cx >= tb.x2 || cy < tb.y1 || cy >= tb.y2)
+                continue;
+            
+            Stroke moved = *s;
+            moved.page = target;
+            stroke_translate(&moved, pb.x1 - tb.x1, pb.y1 - tb.y1);
+            target->strokes = array_append(target->strokes, &moved);
+            
+            array_remove(p->strokes, j, false);
+            --j;
+            --nstrokes;
+        }
+    }
+    
+    selection_update_bounds(self);
+}
+
+// Even-odd crossing test: a point is inside if a ray from it to
+// the right crosses the polygon's edges an odd number of times.
+// The vector paths test four points against each edge at once,
+// keeping the running parity in a mask.
+static size_t count_points_in_polygon(const float *x, const float *y, size_t n, const float *px, const float *py, size_t npoly)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i);
+        __m128 inside = _mm_setzero_ps();
+        
+        for(size_t a = npoly - 1, b = 0; b < npoly; a = b++)
+        {
+            if(py[a] == py[b])
+                continue; // Horizontal edges are never crossed
+            
+            __m128 ay = _mm_set1_ps(py[a]), by = _mm_set1_ps(py[b]);
+            __m128 straddles = _mm_xor_ps(_mm_cmpgt_ps(ay, vy), _mm_cmpgt_ps(by, vy));
+            __m128 slope = _mm_set1_ps((px[b] - px[a]) / (py[b] - py[a]));
+            __m128 xint = _mm_add_ps(_mm_set1_ps(px[a]), _mm_mul_ps(_mm_sub_ps(vy, ay), slope));
+            inside = _mm_xor_ps(inside, _mm_and_ps(straddles, _mm_cmplt_ps(vx, xint)));
+        }
+        
+        count += __builtin_popcount(_mm_movemask_ps(inside));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; i + 4 <= n; i += 4)
+    {
+        float32x4_t vx = vld1q_f32(x + i), vy = vld1q_f32(y + i);
+        uint32x4_t inside = vdupq_n_u32(0);
+        
+        for(size_t a = npoly - 1, b = 0; b < npoly; a = b++)
+        {
+            if(py[a] == py[b])
+                continue; // Horizontal edges are never crossed
+            
+            float32x4_t ay = vdupq_n_f32(py[a]), by = vdupq_n_f32(py[b]);
+            uint32x4_t straddles = veorq_u32(vcgtq_f32(ay, vy), vcgtq_f32(by, vy));
+            float32x4_t slope = vdupq_n_f32((px[b] - px[a]) / (py[b] - py[a]));
+            float32x4_t xint = vmlaq_f32(vdupq_n_f32(px[a]), vsubq_f32(vy, ay), slope);
+            inside = veorq_u32(inside, vandq_u32(straddles, vcltq_f32(vx, xint)));
+        }
+        
+        // Each true lane is all ones; shift down to 1 and add up
+        count += vaddvq_u32(vshrq_n_u32(inside, 31));
+    }
+#endif
+    
+    for(; i < n; ++i)
+    {
+        bool inside = false;
+        for(size_t a = npoly - 1, b = 0; b < npoly; a = b++)
+        {
+            if((py[a] > y[i]) != (py[b] > y[i])
+               && x[i] < px[a] + (y[i] - py[a]) * ((px[b] - px[a]) / (py[b] - py[a])))
+                inside = !inside;
+        }
+        count += inside;
+    }
+    
+    return count;
+}
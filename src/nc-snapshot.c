@@ -0,0 +1,359 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-snapshot.c: Read-only copies of a canvas, for drawing on
+ *   one thread while input changes the canvas on another. Each
+ *   page keeps a copy of itself, made for the first snapshot
+ *   after it changes, that every snapshot until the next change
+ *   shares. The copy's strokes share points with the canvas's:
+ *   each stroke keeps a copy of its points, made once and kept
+ *   until they change, so copying a page again only copies its
+ *   stroke headers. The stroke in progress changes with every
+ *   sample, so it's left out of the pages' copies, and each
+ *   snapshot copies it on its own.
+ *   Changing a page or stroke only drops its reference to its
+ *   copy; snapshots still drawing hold their own, and the last
+ *   one to let go frees it. Nothing a snapshot holds is written
+ *   again, so drawing one takes no locks.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct PageView_
+{
+    unsigned int refs; // Changed atomically
+    Page *page; // Not on any canvas
+    size_t without; // Index of the stroke in progress left out, or SIZE_MAX
+};
+
+struct StrokePoints_
+{
+    unsigned int refs; // Changed atomically
+    float *x, *y, *p, *outline; // As the stroke's were, never changed
+};
+
+typedef struct
+{
+    PageView *view;
+    NCRect rect; // Where the page was
+} SnapshotPage;
+
+struct NCSnapshot_
+{
+    unsigned int refs; // Changed atomically
+    SnapshotPage *pages; // In order
+    size_t npages;
+    float height;
+    size_t currentPage; // Index of the stroke in progress's page, or SIZE_MAX
+    Stroke current; // Copy of the stroke in progress, if there's a currentPage
+    bool wetInk; // The stroke in progress was on the wet ink overlay
+    bool hasTail;
+    float tailX, tailY; // End of the predicted tail
+    unsigned long nselected;
+    NCRect selection; // With the pending transform
+    bool dragging;
+    cairo_matrix_t selectTransform;
+    float *lassoX, *lassoY; // Select tool path in progress, or NULL
+    size_t nlasso;
+    NCSelectMode selectMode;
+};
+
+static PageView * view_new(Page *p, Stroke *current);
+static StrokePoints * points_new(Stroke *s);
+static void points_release(StrokePoints *sp);
+static float * copy_floats(const float *src, size_t n);
+
+
+NCSnapshot * noted_canvas_snapshot(NotedCanvas *self)
+{
+    NCSnapshot *s = calloc(1, sizeof(NCSnapshot));
+    s->refs = 1;
+    s->pages = malloc(sizeof(SnapshotPage) * pages_count(self));
+    s->height = pages_height(self);
+    s->currentPage = SIZE_MAX;
+    self->snapshotted = true;
+    
+    Stroke *current = self->currentStroke;
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        Stroke *pageCurrent = (current && current->page == p) ? current : NULL;
+        
+        // A copy made during a stroke is only good until it's
+        // done, which marks the page anyway
+        size_t without = pageCurrent ? (size_t)(pageCurrent - p->strokes) : SIZE_MAX;
+        if(p->view && p->view->without != SIZE_MAX && p->view->without != without)
+        {
+            page_view_release(p->view);
+            p->view = NULL;
+        }
+        
+        if(!p->view)
+            p->view = view_new(p, pageCurrent);
+        __atomic_add_fetch(&p->view->refs, 1, __ATOMIC_RELAXED);
+        
+        if(pageCurrent)
+        {
+            s->currentPage = s->npages;
+            s->current = *current;
+            s->current.page = p->view->page;
+            s->current.x = array_copy(current->x);
+            s->current.y = array_copy(current->y);
+            s->current.p = array_copy(current->p);
+            s->current.outline = NULL;
+            s->current.shared = NULL;
+        }
+        s->pages[s->npages++] = (SnapshotPage){p->view, page_rect(p)};
+    }
+    
+    s->wetInk = self->wetInkCallback != NULL;
+    s->hasTail = self->hasPredictTail;
+    s->tailX = self->predictX;
+    s->tailY = self->predictY;
+    
+    s->nselected = self->nselected;
+    s->selection = selection_rect(self);
+    s->dragging = self->selectDrag != kSelectDragNone;
+    s->selectTransform = self->selectTransform;
+    s->selectMode = self->selectMode;
+    s->nlasso = self->lassoX ? array_size(self->lassoX) : 0;
+    if(s->nlasso > 0)
+    {
+        s->lassoX = copy_floats(self->lassoX, s->nlasso);
+        s->lassoY = copy_floats(self->lassoY, s->nlasso);
+    }
+    return s;
+}
+
+NCSnapshot * noted_snapshot_retain(NCSnapshot *s)
+{
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    return s;
+}
+
+void noted_snapshot_release(NCSnapshot *s)
+{
+    if(!s || __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    if(s->currentPage != SIZE_MAX)
+        free_stroke(&s->current);
+    for(size_t i = 0; i < s->npages; ++i)
+        page_view_release(s->pages[i].view);
+    free(s->pages);
+    free(s->lassoX);
+    free(s->lassoY);
+    free(s);
+}
+
+void noted_snapshot_draw(NCSnapshot *s, cairo_t *cr, float magnification)
+{
+    NCRect clip;
+    {
+        double x1, y1, x2, y2;
+        cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+        clip = (NCRect){x1, y1, x2, y2};
+    }
+    
+    // Pages are in order, so the first that reaches the clip is
+    // found by bisection
+    size_t first = 0, last = s->npages;
+    while(first < last)
+    {
+        size_t mid = first + (last - first) / 2;
+        if(s->pages[mid].rect.y2 < clip.y1)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    for(size_t i = first; i < s->npages && s->pages[i].rect.y1 <= clip.y2; ++i)
+    {
+        NCRect *pb = &s->pages[i].rect;
+        if(pb->x2 >= clip.x1 && pb->x1 <= clip.x2)
+            draw_page(cr, s->pages[i].view->page, pb, magnification);
+    }
+    
+    // Strokes can hang off their page, as in noted_canvas_draw
+    DrawCounts counts = {0};
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    for(size_t i = 0; i < s->npages; ++i)
+    {
+        NCRect *pb = &s->pages[i].rect;
+        draw_page_content(cr, NULL, s->pages[i].view->page, pb, &clip, magnification, NULL, s->wetInk, s->dragging, &counts);
+        
+        // The stroke in progress is the newest on its page
+        if(i == s->currentPage && !s->wetInk)
+        {
+            NCRect r = s->current.bounds;
+            float pad = s->current.style.thickness;
+            if(r.x1 - pad + pb->x1 < clip.x2 && r.x2 + pad + pb->x1 > clip.x1
+               && r.y1 - pad + pb->y1 < clip.y2 && r.y2 + pad + pb->y1 > clip.y1)
+            {
+                cairo_save(cr);
+                cairo_translate(cr, pb->x1, pb->y1);
+                draw_current_stroke(cr, &s->current, magnification);
+                cairo_restore(cr);
+            }
+        }
+    }
+    
+    NCRect *sel = &s->selection;
+    if(s->dragging && sel->x2 >= clip.x1 && sel->x1 <= clip.x2 && sel->y2 >= clip.y1 && sel->y1 <= clip.y2)
+    {
+        cairo_save(cr);
+        cairo_transform(cr, &s->selectTransform);
+        for(size_t i = 0; i < s->npages; ++i)
+            draw_selected_strokes(cr, s->pages[i].view->page, &s->pages[i].rect, magnification);
+        cairo_restore(cr);
+    }
+    
+    if(!s->wetInk && s->hasTail && s->currentPage != SIZE_MAX)
+        draw_tail(cr, &s->pages[s->currentPage].rect, &s->current, s->tailX, s->tailY);
+    
+    draw_selection_outline(cr, s->lassoX, s->lassoY, s->nlasso, s->selectMode, (s->nselected > 0) ? sel : NULL);
+}
+
+float noted_snapshot_get_height(NCSnapshot *s)
+{
+    return s->height;
+}
+
+void snapshot_mark(NotedCanvas *self, const NCRect *r)
+{
+    if(!self->snapshotted)
+        return;
+    
+    // Strokes can reach past their page, but never past its rows:
+    // they start on it, and moved strokes go to the page under
+    // their center. Changes to a stroke mark all of it.
+    for(Page *p = pages_at_y(self, r->y1); p; p = page_next(p))
+    {
+        if(page_rect(p).y1 > r->y2)
+            break;
+        page_view_release(p->view);
+        p->view = NULL;
+    }
+}
+
+void stroke_unshare(Stroke *s)
+{
+    points_release(s->shared);
+    s->shared = NULL;
+}
+
+void page_view_release(PageView *v)
+{
+    if(!v || __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free_page(v->page);
+    free(v);
+}
+
+size_t page_snapshot_memory(Page *p)
+{
+    size_t size = 0;
+    if(p->view)
+    {
+        Page *copy = p->view->page;
+        size += sizeof(PageView) + sizeof(Page) + array_allocated(copy->strokes)
+                + array_allocated(copy->images) + array_allocated(copy->texts);
+    }
+    
+    // Points are counted with the strokes they were copied from
+    size_t nstrokes = array_size(p->strokes);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        StrokePoints *sp = p->strokes[j].shared;
+        if(sp)
+        {
+            size += sizeof(StrokePoints) + array_allocated(sp->x) + array_allocated(sp->y)
+                    + array_allocated(sp->p) + array_allocated(sp->outline);
+        }
+    }
+    return size;
+}
+
+// A copy of p held by the page, for snapshots to share, without
+// current, the stroke in progress if it's on p. Images, PDF pages
+// and shaped text never change, so those are shared, and so are
+// the points of the other strokes.
+static PageView * view_new(Page *p, Stroke *current)
+{
+    Page *copy = page_new(p->width, p->height, p->pattern, p->density);
+    if(p->background)
+        copy->background = page_background_retain(p->background);
+    
+    array_free(copy->images);
+    copy->images = array_copy(p->images);
+    size_t nimages = array_size(copy->images);
+    for(size_t j = 0; j < nimages; ++j)
+        image_data_retain(copy->images[j].data);
+    
+    array_free(copy->texts);
+    copy->texts = array_copy(p->texts);
+    size_t ntexts = array_size(copy->texts);
+    for(size_t j = 0; j < ntexts; ++j)
+        copy->texts[j] = text_box_copy(&p->texts[j]);
+    
+    // The copies' strokes only hold a reference to their points
+    size_t nstrokes = array_size(p->strokes);
+    array_free(copy->strokes);
+    copy->strokes = array_new(sizeof(Stroke), (FreeNotify)stroke_unshare);
+    copy->strokes = array_reserve(copy->strokes, nstrokes, false);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        Stroke *s = &p->strokes[j];
+        if(s == current)
+            continue;
+        if(!s->shared)
+            s->shared = points_new(s);
+        __atomic_add_fetch(&s->shared->refs, 1, __ATOMIC_RELAXED);
+        
+        Stroke c = *s;
+        c.page = copy;
+        c.x = s->shared->x;
+        c.y = s->shared->y;
+        c.p = s->shared->p;
+        c.outline = s->shared->outline;
+        copy->strokes = array_append(copy->strokes, &c);
+    }
+    
+    PageView *v = malloc(sizeof(PageView));
+    v->refs = 1;
+    v->page = copy;
+    v->without = current ? (size_t)(current - p->strokes) : SIZE_MAX;
+    return v;
+}
+
+// A copy of s's points, held by s until they change
+static StrokePoints * points_new(Stroke *s)
+{
+    StrokePoints *sp = malloc(sizeof(StrokePoints));
+    sp->refs = 1;
+    sp->x = array_copy(s->x);
+    sp->y = array_copy(s->y);
+    sp->p = array_copy(s->p);
+    sp->outline = array_copy(s->outline);
+    return sp;
+}
+
+static void points_release(StrokePoints *sp)
+{
+    if(!sp || __atomic_sub_fetch(&sp->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    array_free(sp->x);
+    array_free(sp->y);
+    array_free(sp->p);
+    array_free(sp->outline);
+    free(sp);
+}
+
+static float * copy_floats(const float *src, size_t n)
+{
+    float *dst = malloc(sizeof(float) * n);
+    memcpy(dst, src, sizeof(float) * n);
+    return dst;
+}
@@ -0,0 +1,208 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-stats.c: Performance counters and tracing, for finding
+ *   where the time goes on real notebooks. Each canvas counts
+ *   its draws, input, erasing, opens and saves, with a latency
+ *   histogram for each, and every timed operation can also be
+ *   written to a Chrome trace. All of it is only built with
+ *   NC_STATS; without it, the calls in the canvas compile away.
+ */
+
+#include "nc-private.h"
+#include <string.h>
+#ifdef NC_STATS
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+static const char *kOpNames[kNCStatCount] = {
+    [kNCStatDraw] = "draw",
+    [kNCStatInput] = "input",
+    [kNCStatErase] = "erase",
+    [kNCStatOpen] = "open",
+    [kNCStatSave] = "save",
+};
+
+// Canvases can be drawn on several threads at once, so every
+// canvas's counters are changed under this
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace; // Also read without traceLock, to skip tracing quickly
+static bool traceEmpty; // No events written yet
+static unsigned int nextThreadId;
+
+static void record(NotedCanvas *canvas, NCStatOp op, uint64_t start, uint64_t end);
+static void trace_event(NCStatOp op, uint64_t start, uint64_t end, const char *args);
+static unsigned int thread_id(void);
+
+
+uint64_t stats_now(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if(timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void stats_end(NotedCanvas *canvas, NCStatOp op, uint64_t start)
+{
+    uint64_t end = stats_now();
+    record(canvas, op, start, end);
+    trace_event(op, start, end, NULL);
+}
+
+void stats_end_draw(NotedCanvas *canvas, uint64_t start, unsigned long drawn, unsigned long culled, unsigned long points)
+{
+    uint64_t end = stats_now();
+    pthread_mutex_lock(&statsLock);
+    canvas->stats.strokesDrawn += drawn;
+    canvas->stats.strokesCulled += culled;
+    canvas->stats.pointsDrawn += points;
+    pthread_mutex_unlock(&statsLock);
+    record(canvas, kNCStatDraw, start, end);
+    
+    if(__atomic_load_n(&trace, __ATOMIC_RELAXED))
+    {
+        char args[128];
+        snprintf(args, sizeof(args), "{\"drawn\":%lu,\"culled\":%lu,\"points\":%lu}", drawn, culled, points);
+        trace_event(kNCStatDraw, start, end, args);
+    }
+}
+
+void stats_end_erase(NotedCanvas *canvas, uint64_t start, unsigned long candidates, unsigned long rasterized, unsigned long erased)
+{
+    uint64_t end = stats_now();
+    pthread_mutex_lock(&statsLock);
+    canvas->stats.eraseCandidates += candidates;
+    canvas->stats.eraseRasterizations += rasterized;
+    canvas->stats.strokesErased += erased;
+    pthread_mutex_unlock(&statsLock);
+    record(canvas, kNCStatErase, start, end);
+    
+    if(__atomic_load_n(&trace, __ATOMIC_RELAXED))
+    {
+        char args[128];
+        snprintf(args, sizeof(args), "{\"candidates\":%lu,\"rasterized\":%lu,\"erased\":%lu}", candidates, rasterized, erased);
+        trace_event(kNCStatErase, start, end, args);
+    }
+}
+
+#endif
+
+bool noted_canvas_get_stats(NotedCanvas *self, NCStats *stats, bool reset)
+{
+#ifdef NC_STATS
+    pthread_mutex_lock(&statsLock);
+    *stats = self->stats;
+    if(reset)
+        memset(&self->stats, 0, sizeof(NCStats));
+    pthread_mutex_unlock(&statsLock);
+    return true;
+#else
+    memset(stats, 0, sizeof(NCStats));
+    return false;
+#endif
+}
+
+bool noted_trace_start(const char *path)
+{
+#ifdef NC_STATS
+    FILE *f = fopen(path, "w");
+    if(!f)
+        return false;
+    
+    noted_trace_stop();
+    pthread_mutex_lock(&traceLock);
+    fputs("[\n", f);
+    traceEmpty = true;
+    __atomic_store_n(&trace, f, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&traceLock);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void noted_trace_stop(void)
+{
+#ifdef NC_STATS
+    pthread_mutex_lock(&traceLock);
+    FILE *f = trace;
+    __atomic_store_n(&trace, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&traceLock);
+    
+    if(f)
+    {
+        fputs("\n]\n", f);
+        fclose(f);
+    }
+#endif
+}
+
+#ifdef NC_STATS
+
+// Adds an operation that ran from start to end (nanoseconds)
+// to canvas's counters
+static void record(NotedCanvas *canvas, NCStatOp op, uint64_t start, uint64_t end)
+{
+    uint64_t micros = (end - start) / 1000;
+    unsigned int bucket = 0;
+    while(bucket + 1 < kNCStatBuckets && micros >= (2ull << bucket))
+        ++bucket;
+    
+    double seconds = (end - start) / 1e9;
+    pthread_mutex_lock(&statsLock);
+    NCOpStats *s = &canvas->stats.ops[op];
+    ++s->count;
+    s->totalTime += seconds;
+    if(seconds > s->maxTime)
+        s->maxTime = seconds;
+    ++s->histogram[bucket];
+    pthread_mutex_unlock(&statsLock);
+}
+
+// Writes a complete event to the trace, if there is one. args is
+// a JSON object, or NULL.
+static void trace_event(NCStatOp op, uint64_t start, uint64_t end, const char *args)
+{
+    if(!__atomic_load_n(&trace, __ATOMIC_RELAXED))
+        return;
+    
+    unsigned int tid = thread_id();
+    pthread_mutex_lock(&traceLock);
+    if(trace)
+    {
+        fprintf(trace, "%s{\"name\":\"%s\",\"cat\":\"canvas\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+                traceEmpty ? "" : ",\n", kOpNames[op], start / 1e3, (end - start) / 1e3, (int)getpid(), tid);
+        if(args)
+            fprintf(trace, ",\"args\":%s", args);
+        fputc('}', trace);
+        traceEmpty = false;
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+// A small number for the calling thread, for the trace
+static unsigned int thread_id(void)
+{
+    static __thread unsigned int tid;
+    if(tid == 0)
+        tid = __atomic_add_fetch(&nextThreadId, 1, __ATOMIC_RELAXED);
+    return tid;
+}
+
+#endif
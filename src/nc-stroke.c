@@ -0,0 +1,390 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-stroke.c: Stroke geometry that isn't drawing or input.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static float sq_dist_to_segment(float px, float py, float ax, float ay, float bx, float by);
+static void append_point(float **outline, float x, float y);
+
+// Width range of pressure strokes, as multiples of the style's thickness
+static const float kMinPressureWidth = 0.2;
+static const float kMaxPressureWidth = 2.0;
+
+// Strokes whose pressure varies less than this are drawn at constant width
+static const float kMinPressureRange = 0.05;
+
+// Outlines follow the stroke's curve with about this spacing (canvas units)
+static const float kOutlineStep = 0.002;
+static const int kMaxOutlineSubdivisions = 8;
+static const int kCapSegments = 6;
+
+
+void stroke_update_metrics(Stroke *s)
+{
+    size_t npoints = array_size(s->x);
+
+    s->maxDistSq = 0;
+    if(npoints == 0)
+    {
+        s->bounds = (NCRect){0};
+        return;
+    }
+
+    s->bounds.x1 = s->bounds.x2 = s->x[0];
+    s->bounds.y1 = s->bounds.y2 = s->y[0];
+
+    for(size_t i = 1; i < npoints; ++i)
+    {
+        rect_expand_by_point(&s->bounds, s->x[i], s->y[i]);
+
+        float dsq = sq_dist(s->x[i], s->y[i], s->x[i - 1], s->y[i - 1]);
+        if(dsq > s->maxDistSq)
+            s->maxDistSq = dsq;
+    }
+}
+
+// Ramer-Douglas-Peucker: keep the end points, then recursively
+// keep the point furthest from the line between the kept points
+// around it, until no point is further than tolerance. Uses an
+// explicit stack since strokes can be long.
+bool stroke_simplify(Stroke *s, float tolerance)
+{
+    size_t npoints = array_size(s->x);
+    if(tolerance <= 0 || npoints < 3)
+        return false;
+
+    bool *keep = calloc(npoints, sizeof(bool));
+    size_t *stack = malloc(sizeof(size_t) * 2 * npoints);
+    if(!keep || !stack)
+    {
+        free(keep);
+        free(stack);
+        return false;
+    }
+
+    float tolSq = tolerance * tolerance;
+    size_t top = 0;
+
+    keep[0] = keep[npoints - 1] = true;
+    stack[top++] = 0;
+    stack[top++] = npoints - 1;
+
+    while(top > 0)
+    {
+        size_t last = stack[--top];
+        size_t first = stack[--top];
+
+        float maxSq = 0;
+        size_t maxIndex = 0;
+        for(size_t i = first + 1; i < last; ++i)
+        {
+            float dsq = sq_dist_to_segment(s->x[i], s->y[i], s->x[first], s->y[first], s->x[last], s->y[last]);
+            if(dsq > maxSq)
+            {
+                maxSq = dsq;
+                maxIndex = i;
+            }
+        }
+
+        if(maxSq > tolSq)
+        {
+            keep[maxIndex] = true;
+            stack[top++] = first;
+            stack[top++] = maxIndex;
+            stack[top++] = maxIndex;
+            stack[top++] = last;
+        }
+    }
+
+    // Compact the kept points to the front
+    size_t n = 0;
+    for(size_t i = 0; i < npoints; ++i)
+    {
+        if(!keep[i])
+            continue;
+        s->x[n] = s->x[i];
+        s->y[n] = s->y[i];
+        if(s->p)
+            s->p[n] = s->p[i];
+        ++n;
+    }
+
+    free(keep);
+    free(stack);
+
+    if(n == npoints)
+        return false;
+
+    stroke_unshare(s);
+    array_shrink(s->x, n, false);
+    array_shrink(s->y, n, false);
+    if(s->p)
+        array_shrink(s->p, n, false);
+    stroke_update_metrics(s);
+    return true;
+}
+
+void stroke_translate(Stroke *s, float dx, float dy)
+{
+    stroke_unshare(s);
+    
+    size_t npoints = array_size(s->x);
+    for(size_t i = 0; i < npoints; ++i)
+    {
+        s->x[i] += dx;
+        s->y[i] += dy;
+    }
+    
+    if(s->outline)
+    {
+        size_t n = array_size(s->outline);
+        for(size_t i = 0; i < n; i += 2)
+        {
+            s->outline[i] += dx;
+            s->outline[i + 1] += dy;
+        }
+    }
+    
+    s->bounds.x1 += dx;
+    s->bounds.y1 += dy;
+    s->bounds.x2 += dx;
+    s->bounds.y2 += dy;
+}
+
+float stroke_width_at(Stroke *s, size_t i)
+{
+    if(!s->p)
+        return s->style.thickness;
+    
+    // A pressure of 0.5 (a normal press) is the style's thickness
+    float f = s->p[i] * 2;
+    if(f < kMinPressureWidth)
+        f = kMinPressureWidth;
+    else if(f > kMaxPressureWidth)
+        f = kMaxPressureWidth;
+    return s->style.thickness * f;
+}
+
+bool stroke_varies_pressure(Stroke *s)
+{
+    size_t npoints = array_size(s->x);
+    if(!s->p || npoints < 2)
+        return false;
+    
+    float pmin = s->p[0], pmax = s->p[0];
+    for(size_t i = 1; i < npoints; ++i)
+    {
+        if(s->p[i] < pmin)
+            pmin = s->p[i];
+        if(s->p[i] > pmax)
+            pmax = s->p[i];
+    }
+    return pmax - pmin >= kMinPressureRange;
+}
+
+// Builds the filled outline of a variable width stroke: down the
+// left side of the stroke's curve, around a round end cap, back
+// up the right side, and around the start cap. Drawing it is then
+// a single fill, no matter how the width varies.
+void stroke_update_outline(Stroke *s)
+{
+    stroke_unshare(s);
+    array_free(s->outline);
+    s->outline = NULL;
+    
+    if(!stroke_varies_pressure(s))
+        return;
+    size_t npoints = array_size(s->x);
+    
+    // Sample the centerline along the same beziers the constant
+    // width renderer uses, with the width at each sample.
+    float *xc = malloc(sizeof(float) * 4 * npoints);
+    float *xc1 = xc, *xc2 = xc + npoints, *yc1 = xc + 2 * npoints, *yc2 = xc + 3 * npoints;
+    if(!xc)
+        return;
+    if(npoints > 2)
+    {
+        calculate_control_points(s->x, (int)npoints, xc1, xc2);
+        calculate_control_points(s->y, (int)npoints, yc1, yc2);
+    }
+    
+    float *cx = array_new(sizeof(float), NULL);
+    float *cy = array_new(sizeof(float), NULL);
+    float *cw = array_new(sizeof(float), NULL);
+    
+    for(size_t j = 0; j < npoints - 1; ++j)
+    {
+        float w0 = stroke_width_at(s, j), w1 = stroke_width_at(s, j + 1);
+        int steps = (int)ceilf(sqrtf(sq_dist(s->x[j], s->y[j], s->x[j + 1], s->y[j + 1])) / kOutlineStep);
+        if(steps < 1)
+            steps = 1;
+        else if(steps > kMaxOutlineSubdivisions)
+            steps = kMaxOutlineSubdivisions;
+        
+        for(int k = 0; k < steps; ++k)
+        {
+            float t = (float)k / steps, u = 1 - t;
+            float x, y;
+            if(npoints > 2)
+            {
+                x = u*u*u * s->x[j] + 3*u*u*t * xc1[j] + 3*u*t*t * xc2[j] + t*t*t * s->x[j + 1];
+                y = u*u*u * s->y[j] + 3*u*u*t * yc1[j] + 3*u*t*t * yc2[j] + t*t*t * s->y[j + 1];
+            }
+            else
+            {
+                x = u * s->x[j] + t * s->x[j + 1];
+                y = u * s->y[j] + t * s->y[j + 1];
+            }
+            float w = (u * w0 + t * w1) / 2;
+            cx = array_append(cx, &x);
+            cy = array_append(cy, &y);
+            cw = array_append(cw, &w);
+        }
+    }
+    {
+        float w = stroke_width_at(s, npoints - 1) / 2;
+        cx = array_append(cx, &s->x[npoints - 1]);
+        cy = array_append(cy, &s->y[npoints - 1]);
+        cw = array_append(cw, &w);
+    }
+    free(xc);
+    
+    // Normals at each centerline sample. Repeated points reuse
+    // the previous normal.
+    size_t n = array_size(cx);
+    float *nx = malloc(sizeof(float) * 2 * n), *ny = nx + n;
+    float *outline = array_new(sizeof(float), NULL);
+    if(!nx)
+        goto done;
+    outline = array_reserve(outline, 4 * (n + kCapSegments), false);
+    
+    float lastNx = 0, lastNy = -1;
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t a = (i > 0) ? i - 1 : 0, b = (i + 1 < n) ? i + 1 : n - 1;
+        float tx = cx[b] - cx[a], ty = cy[b] - cy[a];
+        float len = sqrtf(tx * tx + ty * ty);
+        if(len > 0)
+        {
+            lastNx = -ty / len;
+            lastNy = tx / len;
+        }
+        nx[i] = lastNx;
+        ny[i] = lastNy;
+    }
+    
+    for(size_t i = 0; i < n; ++i)
+        append_point(&outline, cx[i] + nx[i] * cw[i], cy[i] + ny[i] * cw[i]);
+    
+    // End cap, turning from the left normal to the right one
+    float a = atan2f(ny[n - 1], nx[n - 1]);
+    for(int k = 1; k < kCapSegments; ++k)
+    {
+        float t = a - M_PI * k / kCapSegments;
+        append_point(&outline, cx[n - 1] + cosf(t) * cw[n - 1], cy[n - 1] + sinf(t) * cw[n - 1]);
+    }
+    
+    for(size_t i = n; i-- > 0;)
+        append_point(&outline, cx[i] - nx[i] * cw[i], cy[i] - ny[i] * cw[i]);
+    
+    // Start cap
+    a = atan2f(ny[0], nx[0]) + M_PI;
+    for(int k = 1; k < kCapSegments; ++k)
+    {
+        float t = a - M_PI * k / kCapSegments;
+        append_point(&outline, cx[0] + cosf(t) * cw[0], cy[0] + sinf(t) * cw[0]);
+    }
+    
+    s->outline = outline;
+    outline = NULL;
+
+done:
+    free(nx);
+    array_free(outline);
+    array_free(cx);
+    array_free(cy);
+    array_free(cw);
+}
+
+// Matches bezier curves to the given points. This function takes
+// only one dimension of the points at a time, so this function
+// should be called twice: once to calculate x control points,
+// again to calculate y. cp1 and cp2 are outputs, and should each
+// be allocated with at least n-1 elements.
+// Code converted from the SVG + JavaScript demo found here:
+// https://www.particleincell.com/2012/bezier-splines/
+void calculate_control_points(float *p, int n, float *cp1, float *cp2)
+{
+    --n;
+    
+    // rhs vector
+    float a[n], b[n], c[n], r[n];
+    
+    // left most segment
+    a[0] = 0;
+    b[0] = 2;
+    c[0] = 1;
+    r[0] = p[0] + (2 * p[1]);
+    
+    // internal segments
+    for (int i = 1; i < n - 1; ++i)
+    {
+        a[i] = 1;
+        b[i] = 4;
+        c[i] = 1;
+        r[i] = 4 * p[i] + 2 * p[i+1];
+    }
+    
+    // right segment
+    a[n-1] = 2;
+    b[n-1] = 7;
+    c[n-1] = 0;
+    r[n-1] = 8 * p[n-1] + p[n];
+    
+    // solves Ax=b with the Thomas algorithm (from Wikipedia)
+    for (int i = 1; i < n; ++i)
+    {
+        float m = a[i] / b[i-1];
+        b[i] = b[i] - m * c[i - 1];
+        r[i] = r[i] - m * r[i-1];
+    }
+    
+    cp1[n-1] = r[n-1] / b[n-1];
+    for (int i = n - 2; i >= 0; --i)
+        cp1[i] = (r[i] - c[i] * cp1[i+1]) / b[i];
+    
+    // we have cp1, now compute cp2
+    for (int i = 0; i < n-1; i++)
+        cp2[i] = (2 * p[i+1]) - cp1[i+1];
+    
+    cp2[n-1] = 0.5 * (p[n] + cp1[n-1]);
+}
+
+static void append_point(float **outline, float x, float y)
+{
+    *outline = array_append(*outline, &x);
+    *outline = array_append(*outline, &y);
+}
+
+static float sq_dist_to_segment(float px, float py, float ax, float ay, float bx, float by)
+{
+    float dx = bx - ax, dy = by - ay;
+    float lenSq = dx * dx + dy * dy;
+    if(lenSq == 0)
+        return sq_dist(px, py, ax, ay);
+
+    float t = ((px - ax) * dx + (py - ay) * dy) / lenSq;
+    if(t < 0)
+        t = 0;
+    else if(t > 1)
+        t = 1;
+    return sq_dist(px, py, ax + t * dx, ay + t * dy);
+}
@@ -0,0 +1,303 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-text.c: Typed text on pages. A text box's text is shaped
+ *   once, when it's made or changed, into runs of positioned
+ *   glyphs, and drawing only hands those runs to cairo. Shaping
+ *   is done without hinting, so the runs fit every zoom level,
+ *   and cairo keeps the glyphs it rasterizes for each size, so
+ *   redrawing a page of text costs about what a page of strokes
+ *   does. Runs never change once made, so copies of a box and
+ *   threads drawing it at once share them.
+ *   Text is shaped and wrapped with pango. Without
+ *   NC_HAVE_PANGO, cairo's own text API is used instead, which
+ *   only breaks lines at newlines.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef NC_HAVE_PANGO
+#include <pango/pangocairo.h>
+#endif
+
+// Text is shaped at this many times its size, since font sizes
+// in canvas units are far smaller than fonts are designed for
+static const double kShapeScale = 1000;
+
+#ifdef NC_HAVE_PANGO
+static const char *kFontFamily = "Sans";
+#else
+static const char *kFontFamily = "sans-serif";
+#endif
+
+typedef struct
+{
+    cairo_font_face_t *face;
+    cairo_matrix_t fontMatrix; // In canvas units
+    cairo_glyph_t *glyphs; // Positioned from the box's top left
+    int nglyphs;
+} GlyphRun;
+
+struct TextLayout_
+{
+    unsigned int refs; // Changed atomically
+    GlyphRun *runs;
+    size_t nruns;
+    float height;
+};
+
+// Shaping shares one font map, which is only used by one thread
+// at a time
+static pthread_mutex_t shapeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static TextLayout * shape(const char *text, float width, float size);
+static void add_run(TextLayout *l, cairo_scaled_font_t *font, const cairo_glyph_t *glyphs, int nglyphs);
+static void layout_release(TextLayout *l);
+
+
+void text_box_update(TextBox *t)
+{
+    layout_release(t->layout);
+    t->layout = shape(t->text, t->bounds.x2 - t->bounds.x1, t->size);
+    t->bounds.y2 = t->bounds.y1 + (t->layout ? t->layout->height : t->size);
+}
+
+TextBox text_box_copy(TextBox *t)
+{
+    TextBox copy = *t;
+    copy.text = strdup(t->text);
+    if(t->layout)
+        __atomic_add_fetch(&t->layout->refs, 1, __ATOMIC_RELAXED);
+    return copy;
+}
+
+size_t text_layout_memory(TextLayout *l)
+{
+    if(!l)
+        return 0;
+    
+    size_t size = sizeof(TextLayout) + sizeof(GlyphRun) * l->nruns;
+    for(size_t i = 0; i < l->nruns; ++i)
+        size += sizeof(cairo_glyph_t) * l->runs[i].nglyphs;
+    return size;
+}
+
+void free_text(TextBox *t)
+{
+    free(t->text);
+    layout_release(t->layout);
+}
+
+void draw_texts(cairo_t *cr, Page *p, const NCRect *clip)
+{
+    size_t n = array_size(p->texts);
+    for(size_t i = 0; i < n; ++i)
+    {
+        TextBox *t = &p->texts[i];
+        const NCRect *r = &t->bounds;
+        if(!t->layout || (clip && (r->x2 < clip->x1 || r->x1 > clip->x2 || r->y2 < clip->y1 || r->y1 > clip->y2)))
+            continue;
+        
+        cairo_save(cr);
+        cairo_translate(cr, r->x1, r->y1);
+        cairo_set_source_rgba(cr, t->r / 255.f, t->g / 255.f, t->b / 255.f, t->a / 255.f);
+        for(size_t j = 0; j < t->layout->nruns; ++j)
+        {
+            GlyphRun *run = &t->layout->runs[j];
+            cairo_set_font_face(cr, run->face);
+            cairo_set_font_matrix(cr, &run->fontMatrix);
+            cairo_show_glyphs(cr, run->glyphs, run->nglyphs);
+        }
+        cairo_restore(cr);
+    }
+}
+
+#ifdef NC_HAVE_PANGO
+
+// Shapes text into a new layout, wrapped at width, or returns
+// NULL if there's nothing to draw
+static TextLayout * shape(const char *text, float width, float size)
+{
+    static PangoContext *context;
+    
+    pthread_mutex_lock(&shapeLock);
+    if(!context)
+    {
+        // Glyphs aren't fitted to pixels, so where they go doesn't
+        // depend on the size they're drawn at
+        context = pango_font_map_create_context(pango_cairo_font_map_new());
+        cairo_font_options_t *options = cairo_font_options_create();
+        cairo_font_options_set_hint_style(options, CAIRO_HINT_STYLE_NONE);
+        cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+        pango_cairo_context_set_font_options(context, options);
+        cairo_font_options_destroy(options);
+    }
+    
+    PangoLayout *layout = pango_layout_new(context);
+    PangoFontDescription *font = pango_font_description_from_string(kFontFamily);
+    pango_font_description_set_absolute_size(font, size * kShapeScale * PANGO_SCALE);
+    pango_layout_set_font_description(layout, font);
+    pango_font_description_free(font);
+    pango_layout_set_width(layout, (int)(width * kShapeScale * PANGO_SCALE));
+    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+    pango_layout_set_text(layout, text, -1);
+    
+    TextLayout *l = calloc(1, sizeof(TextLayout));
+    l->refs = 1;
+    
+    cairo_glyph_t *glyphs = NULL;
+    PangoLayoutIter *iter = pango_layout_get_iter(layout);
+    do
+    {
+        // Runs are NULL at the end of each line
+        PangoLayoutRun *run = pango_layout_iter_get_run_readonly(iter);
+        if(!run)
+            continue;
+        
+        PangoRectangle extents;
+        pango_layout_iter_get_run_extents(iter, NULL, &extents);
+        int x = extents.x;
+        int baseline = pango_layout_iter_get_baseline(iter);
+        
+        PangoGlyphString *string = run->glyphs;
+        glyphs = realloc(glyphs, sizeof(cairo_glyph_t) * (string->num_glyphs ? string->num_glyphs : 1));
+        int nglyphs = 0;
+        for(int i = 0; i < string->num_glyphs; ++i)
+        {
+            PangoGlyphInfo *g = &string->glyphs[i];
+            if(g->glyph != PANGO_GLYPH_EMPTY && !(g->glyph & PANGO_GLYPH_UNKNOWN_FLAG))
+            {
+                glyphs[nglyphs].index = g->glyph;
+                glyphs[nglyphs].x = (double)(x + g->geometry.x_offset) / PANGO_SCALE;
+                glyphs[nglyphs].y = (double)(baseline + g->geometry.y_offset) / PANGO_SCALE;
+                ++nglyphs;
+            }
+            x += g->geometry.width;
+        }
+        
+        cairo_scaled_font_t *scaled = pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(run->item->analysis.font));
+        if(scaled)
+            add_run(l, scaled, glyphs, nglyphs);
+    } while(pango_layout_iter_next_run(iter));
+    pango_layout_iter_free(iter);
+    free(glyphs);
+    
+    int height;
+    pango_layout_get_size(layout, NULL, &height);
+    l->height = height / (kShapeScale * PANGO_SCALE);
+    g_object_unref(layout);
+    pthread_mutex_unlock(&shapeLock);
+    
+    if(l->nruns == 0)
+    {
+        layout_release(l);
+        return NULL;
+    }
+    return l;
+}
+
+#else
+
+static TextLayout * shape(const char *text, float width, float size)
+{
+    pthread_mutex_lock(&shapeLock);
+    cairo_font_face_t *face = cairo_toy_font_face_create(kFontFamily, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_matrix_t fontMatrix, ctm;
+    cairo_matrix_init_scale(&fontMatrix, size * kShapeScale, size * kShapeScale);
+    cairo_matrix_init_identity(&ctm);
+    cairo_font_options_t *options = cairo_font_options_create();
+    cairo_font_options_set_hint_style(options, CAIRO_HINT_STYLE_NONE);
+    cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+    cairo_scaled_font_t *font = cairo_scaled_font_create(face, &fontMatrix, &ctm, options);
+    cairo_font_options_destroy(options);
+    cairo_font_face_destroy(face);
+    
+    cairo_font_extents_t extents;
+    cairo_scaled_font_extents(font, &extents);
+    
+    TextLayout *l = calloc(1, sizeof(TextLayout));
+    l->refs = 1;
+    
+    double y = extents.ascent;
+    for(const char *line = text; line; y += extents.height)
+    {
+        const char *next = strchr(line, '\n');
+        int length = next ? (int)(next - line) : (int)strlen(line);
+        
+        cairo_glyph_t *glyphs = NULL;
+        int nglyphs = 0;
+        if(length > 0 && cairo_scaled_font_text_to_glyphs(font, 0, y, line, length, &glyphs, &nglyphs,
+                                                          NULL, NULL, NULL) == CAIRO_STATUS_SUCCESS)
+        {
+            add_run(l, font, glyphs, nglyphs);
+            cairo_glyph_free(glyphs);
+        }
+        line = next ? next + 1 : NULL;
+    }
+    l->height = (y - extents.ascent) / kShapeScale;
+    cairo_scaled_font_destroy(font);
+    pthread_mutex_unlock(&shapeLock);
+    
+    if(l->nruns == 0)
+    {
+        layout_release(l);
+        return NULL;
+    }
+    return l;
+}
+
+#endif
+
+// Adds a run of glyphs shaped at kShapeScale to l, in canvas units
+static void add_run(TextLayout *l, cairo_scaled_font_t *font, const cairo_glyph_t *glyphs, int nglyphs)
+{
+    if(nglyphs <= 0)
+        return;
+    
+    GlyphRun *run = NULL;
+    GlyphRun *runs = realloc(l->runs, sizeof(GlyphRun) * (l->nruns + 1));
+    cairo_glyph_t *copy = malloc(sizeof(cairo_glyph_t) * nglyphs);
+    if(runs)
+    {
+        l->runs = runs;
+        run = &runs[l->nruns];
+    }
+    if(!run || !copy)
+    {
+        free(copy);
+        return;
+    }
+    
+    for(int i = 0; i < nglyphs; ++i)
+    {
+        copy[i].index = glyphs[i].index;
+        copy[i].x = glyphs[i].x / kShapeScale;
+        copy[i].y = glyphs[i].y / kShapeScale;
+    }
+    run->face = cairo_font_face_reference(cairo_scaled_font_get_font_face(font));
+    cairo_scaled_font_get_font_matrix(font, &run->fontMatrix);
+    cairo_matrix_t scale;
+    cairo_matrix_init_scale(&scale, 1 / kShapeScale, 1 / kShapeScale);
+    cairo_matrix_multiply(&run->fontMatrix, &run->fontMatrix, &scale);
+    run->glyphs = copy;
+    run->nglyphs = nglyphs;
+    ++l->nruns;
+}
+
+static void layout_release(TextLayout *l)
+{
+    if(!l || __atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    for(size_t i = 0; i < l->nruns; ++i)
+    {
+        cairo_font_face_destroy(l->runs[i].face);
+        free(l->runs[i].glyphs);
+    }
+    free(l->runs);
+    free(l);
+}
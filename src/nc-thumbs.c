@@ -0,0 +1,539 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * nc-thumbs.c: Small pictures of pages, for an overview of a
+ *   notebook. Pages that changed are copied, cut down to what
+ *   shows at thumbnail size, and rendered on a thread of their
+ *   own, so neither drawing nor input waits for them. Thumbnails
+ *   are saved with their pages as PNGs.
+ */
+
+#include "nc-private.h"
+#include "array.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+// Width of rendered thumbnails, in pixels
+static const int kThumbnailWidth = 96;
+
+// Points of a page's copy closer than this (thumbnail pixels)
+// to the last point kept are dropped
+static const float kMinPointSpacing = 0.5;
+
+// Thinner lines than this (thumbnail pixels) would fade out
+static const float kMinLineWidth = 0.75;
+
+// Rendering strokes as curves keeps per point arrays on the
+// stack, so the thread gets a main thread sized stack
+static const size_t kThumbnailStackSize = 8 << 20;
+
+// Space around each page of the overview, as a fraction of the
+// cell width
+static const float kOverviewMargin = 1.f/16.f;
+
+// A copy of a page to render, and the thumbnail it's for
+typedef struct
+{
+    Thumbnail *thumb;
+    Page *page;
+} ThumbnailJob;
+
+struct ThumbnailQueue_
+{
+    NotedCanvas *canvas;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // Signalled when there are jobs, or on stop
+    pthread_t thread;
+    bool started, stop;
+    ThumbnailJob *jobs; // Waiting to be rendered, oldest first
+    bool unsaved; // Renders changed a png since the last save
+    NCThumbnailCallback callback;
+    void *callbackData;
+};
+
+// A png being written to or read from memory
+typedef struct
+{
+    uint8_t *data;
+    size_t size, capacity;
+} PngBuffer;
+
+static ThumbnailQueue * get_queue(NotedCanvas *canvas);
+static Thumbnail * get_thumbnail(Page *p);
+static Page * copy_page(Page *p);
+static void * thumbnail_worker(void *data);
+static cairo_surface_t * render_page(Page *p, PngBuffer *png);
+static cairo_status_t write_png(void *closure, const unsigned char *data, unsigned int length);
+static cairo_status_t read_png(void *closure, unsigned char *data, unsigned int length);
+
+
+void noted_canvas_set_thumbnail_callback(NotedCanvas *self, NCThumbnailCallback callback, void *data)
+{
+    ThumbnailQueue *q = get_queue(self);
+    if(!q)
+        return;
+    
+    pthread_mutex_lock(&q->lock);
+    q->callback = callback;
+    q->callbackData = data;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void noted_canvas_draw_overview(NotedCanvas *self, cairo_t *cr, size_t index, size_t n, unsigned int columns, float cellWidth)
+{
+    ThumbnailQueue *q = get_queue(self);
+    if(!q || columns == 0)
+        return;
+    
+    // Every row is as tall as the tallest page needs
+    float aspect = 0;
+    size_t i = 0;
+    for(Page *p = pages_get(self, index); p && i < n; p = page_next(p), ++i)
+        aspect = fmaxf(aspect, p->height / p->width);
+    
+    float margin = cellWidth * kOverviewMargin;
+    float boxWidth = cellWidth - 2 * margin, boxHeight = boxWidth * aspect;
+    float cellHeight = boxHeight + 2 * margin;
+    
+    double border = 1, _ = 0;
+    cairo_device_to_user_distance(cr, &border, &_);
+    
+    bool missing = false;
+    i = 0;
+    for(Page *p = pages_get(self, index); p && i < n; p = page_next(p), ++i)
+    {
+        float scale = fminf(boxWidth / p->width, boxHeight / p->height);
+        float w = p->width * scale, h = p->height * scale;
+        float x = (i % columns) * cellWidth + (cellWidth - w) / 2;
+        float y = (i / columns) * cellHeight + (cellHeight - h) / 2;
+        
+        // Stale thumbnails are still drawn until they're redone
+        Thumbnail *t = p->thumb;
+        cairo_surface_t *surface = NULL;
+        bool render = false;
+        pthread_mutex_lock(&q->lock);
+        if(t && !t->surface && t->png)
+            t->surface = thumbnail_decode(t->png, t->pngSize);
+        if(t && t->surface)
+            surface = cairo_surface_reference(t->surface);
+        else
+            render = !t || t->pending == 0;
+        pthread_mutex_unlock(&q->lock);
+        
+        cairo_save(cr);
+        cairo_translate(cr, x, y);
+        if(surface)
+        {
+            cairo_scale(cr, w / cairo_image_surface_get_width(surface), h / cairo_image_surface_get_height(surface));
+            cairo_set_source_surface(cr, surface, 0, 0);
+            cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+            cairo_paint(cr);
+            cairo_surface_destroy(surface);
+        }
+        else
+        {
+            // Just the paper until it's rendered. PDF pages are
+            // left white rather than read from their PDF here.
+            NCRect pb = {0, 0, p->width, p->height};
+            cairo_scale(cr, scale, scale);
+            if(p->pattern == kNCPagePDF)
+            {
+                cairo_set_source_rgb(cr, 1, 1, 1);
+                cairo_rectangle(cr, 0, 0, p->width, p->height);
+                cairo_fill(cr);
+            }
+            else
+                draw_page(cr, p, &pb, 1);
+        }
+        cairo_restore(cr);
+        
+        if(render)
+        {
+            get_thumbnail(p)->stale = true;
+            missing = true;
+        }
+        
+        cairo_new_path(cr);
+        cairo_set_source_rgba(cr, 0, 0, 0, 0.3);
+        cairo_set_line_width(cr, border);
+        cairo_rectangle(cr, x, y, w, h);
+        cairo_stroke(cr);
+    }
+    
+    if(missing)
+        thumbnails_update(self);
+}
+
+void thumbnails_mark(NotedCanvas *self, const NCRect *r)
+{
+    for(Page *p = pages_at_y(self, r->y1); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        if(pb.y1 >= r->y2)
+            break;
+        if(pb.y2 > r->y1 && pb.x1 < r->x2 && pb.x2 > r->x1)
+            get_thumbnail(p)->stale = true;
+    }
+}
+
+void thumbnails_update(NotedCanvas *self)
+{
+    ThumbnailQueue *q = NULL;
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        Thumbnail *t = p->thumb;
+        if(!t || !t->stale)
+            continue;
+        if(!q && !(q = get_queue(self)))
+            return;
+        
+        ThumbnailJob job = {t, copy_page(p)};
+        __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+        t->stale = false;
+        
+        pthread_mutex_lock(&q->lock);
+        q->jobs = array_append(q->jobs, &job);
+        ++t->pending;
+        pthread_mutex_unlock(&q->lock);
+    }
+    if(!q)
+        return;
+    
+    // If the thread can't start, the jobs wait for the next try
+    pthread_mutex_lock(&q->lock);
+    if(!q->started)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, kThumbnailStackSize);
+        q->started = pthread_create(&q->thread, &attr, thumbnail_worker, q) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void thumbnails_begin_save(NotedCanvas *self)
+{
+    // Without a queue there's no thread to keep out
+    if(self->thumbQueue)
+        pthread_mutex_lock(&self->thumbQueue->lock);
+}
+
+void thumbnails_end_save(NotedCanvas *self, bool ok)
+{
+    ThumbnailQueue *q = self->thumbQueue;
+    if(!q)
+        return;
+    if(ok)
+        q->unsaved = false;
+    pthread_mutex_unlock(&q->lock);
+}
+
+bool thumbnails_stop(NotedCanvas *self)
+{
+    ThumbnailQueue *q = self->thumbQueue;
+    if(!q)
+        return false;
+    
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    
+    // The thread finishes the jobs it has before stopping. Any
+    // left are from when it couldn't start.
+    if(q->started)
+        pthread_join(q->thread, NULL);
+    
+    size_t njobs = array_size(q->jobs);
+    for(size_t i = 0; i < njobs; ++i)
+    {
+        --q->jobs[i].thumb->pending;
+        q->jobs[i].thumb->stale = true;
+        thumbnail_release(q->jobs[i].thumb);
+        free_page(q->jobs[i].page);
+    }
+    
+    bool unsaved = q->unsaved;
+    array_free(q->jobs);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+    self->thumbQueue = NULL;
+    return unsaved;
+}
+
+const uint8_t * thumbnail_current_png(Page *p, size_t *size)
+{
+    // A changed page keeps its old png until the new one is
+    // rendered, which is closer than none
+    Thumbnail *t = p->thumb;
+    if(!t || !t->png)
+        return NULL;
+    *size = t->pngSize;
+    return t->png;
+}
+
+void thumbnail_set_png(Page *p, const uint8_t *png, size_t size)
+{
+    uint8_t *copy = malloc(size);
+    if(!copy)
+        return;
+    memcpy(copy, png, size);
+    
+    Thumbnail *t = get_thumbnail(p);
+    free(t->png);
+    t->png = copy;
+    t->pngSize = size;
+}
+
+size_t thumbnail_memory(NotedCanvas *self, Page *p)
+{
+    Thumbnail *t = p->thumb;
+    if(!t)
+        return 0;
+    
+    ThumbnailQueue *q = self->thumbQueue;
+    if(q)
+        pthread_mutex_lock(&q->lock);
+    size_t size = sizeof(Thumbnail) + (t->png ? t->pngSize : 0);
+    if(t->surface)
+        size += (size_t)cairo_image_surface_get_stride(t->surface) * cairo_image_surface_get_height(t->surface);
+    if(q)
+        pthread_mutex_unlock(&q->lock);
+    return size;
+}
+
+void thumbnail_release(Thumbnail *t)
+{
+    if(!t || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    free(t->png);
+    if(t->surface)
+        cairo_surface_destroy(t->surface);
+    free(t);
+}
+
+cairo_surface_t * thumbnail_decode(const uint8_t *png, size_t size)
+{
+    PngBuffer b = {(uint8_t *)png, 0, size};
+    cairo_surface_t *surface = cairo_image_surface_create_from_png_stream(read_png, &b);
+    if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+    {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+static ThumbnailQueue * get_queue(NotedCanvas *self)
+{
+    if(self->thumbQueue)
+        return self->thumbQueue;
+    
+    ThumbnailQueue *q = calloc(1, sizeof(ThumbnailQueue));
+    if(!q)
+        return NULL;
+    q->canvas = self;
+    q->jobs = array_new(sizeof(ThumbnailJob), NULL);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    self->thumbQueue = q;
+    return q;
+}
+
+static Thumbnail * get_thumbnail(Page *p)
+{
+    if(!p->thumb)
+    {
+        p->thumb = calloc(1, sizeof(Thumbnail));
+        p->thumb->refs = 1;
+    }
+    return p->thumb;
+}
+
+// Copies the parts of p that show in a thumbnail: strokes at a
+// constant width, without the points that would land on the
+// same pixel.
+static Page * copy_page(Page *p)
+{
+    Page *copy = page_new(p->width, p->height, p->pattern, p->density);
+    if(p->background)
+        copy->background = page_background_retain(p->background);
+    
+    size_t nimages = array_size(p->images);
+    for(size_t j = 0; j < nimages; ++j)
+    {
+        Image img = {image_data_retain(p->images[j].data), p->images[j].bounds};
+        copy->images = array_append(copy->images, &img);
+    }
+    
+    size_t ntexts = array_size(p->texts);
+    for(size_t j = 0; j < ntexts; ++j)
+    {
+        TextBox t = text_box_copy(&p->texts[j]);
+        copy->texts = array_append(copy->texts, &t);
+    }
+    
+    float spacing = kMinPointSpacing * p->width / kThumbnailWidth;
+    float minDistSq = spacing * spacing;
+    
+    size_t nstrokes = array_size(p->strokes);
+    copy->strokes = array_reserve(copy->strokes, nstrokes, false);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        Stroke *s = &p->strokes[j];
+        size_t npoints = array_size(s->x);
+        if(npoints == 0)
+            continue;
+        
+        Stroke c = {
+            .page = copy,
+            .style = s->style,
+            .x = array_new(sizeof(float), NULL),
+            .y = array_new(sizeof(float), NULL)
+        };
+        size_t last = 0;
+        c.x = array_append(c.x, &s->x[0]);
+        c.y = array_append(c.y, &s->y[0]);
+        for(size_t i = 1; i < npoints; ++i)
+        {
+            if(i + 1 < npoints && sq_dist(s->x[i], s->y[i], s->x[last], s->y[last]) < minDistSq)
+                continue;
+            c.x = array_append(c.x, &s->x[i]);
+            c.y = array_append(c.y, &s->y[i]);
+            last = i;
+        }
+        
+        stroke_update_metrics(&c);
+        copy->strokes = array_append(copy->strokes, &c);
+    }
+    return copy;
+}
+
+static void * thumbnail_worker(void *data)
+{
+    ThumbnailQueue *q = data;
+    
+    pthread_mutex_lock(&q->lock);
+    while(true)
+    {
+        while(array_size(q->jobs) == 0 && !q->stop)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if(array_size(q->jobs) == 0)
+            break;
+        
+        ThumbnailJob job = q->jobs[0];
+        array_remove(q->jobs, 0, false);
+        pthread_mutex_unlock(&q->lock);
+        
+        PngBuffer png = {0};
+        cairo_surface_t *surface = render_page(job.page, &png);
+        free_page(job.page);
+        
+        // Jobs are done in order, so a thumbnail's last render
+        // is the one it keeps
+        pthread_mutex_lock(&q->lock);
+        Thumbnail *t = job.thumb;
+        --t->pending;
+        if(surface)
+        {
+            // A page that looks the same as its saved png needn't
+            // be saved again for it
+            if(!t->png || t->pngSize != png.size || memcmp(t->png, png.data, png.size) != 0)
+                q->unsaved = true;
+            free(t->png);
+            t->png = png.data;
+            t->pngSize = png.size;
+            if(t->surface)
+                cairo_surface_destroy(t->surface);
+            t->surface = surface;
+        }
+        NCThumbnailCallback callback = q->callback;
+        void *callbackData = q->callbackData;
+        pthread_mutex_unlock(&q->lock);
+        
+        thumbnail_release(t);
+        if(surface && callback)
+            callback(q->canvas, callbackData);
+        
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// Renders p into a new surface, and encodes that into png.
+// Returns NULL if either fails.
+static cairo_surface_t * render_page(Page *p, PngBuffer *png)
+{
+    int width = kThumbnailWidth;
+    int height = (int)fmaxf(1, roundf(kThumbnailWidth * p->height / p->width));
+    float scale = width / p->width;
+    
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+    cairo_t *cr = cairo_create(surface);
+    cairo_scale(cr, scale, scale);
+    
+    NCRect pb = {0, 0, p->width, p->height};
+    draw_page(cr, p, &pb, 1);
+    draw_images(cr, NULL, p, NULL, 1);
+    draw_texts(cr, p, NULL);
+    
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    size_t nstrokes = array_size(p->strokes);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        Stroke *s = &p->strokes[j];
+        cairo_set_line_width(cr, fmaxf(s->style.thickness, kMinLineWidth / scale));
+        cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+        draw_stroke(cr, s, 1);
+    }
+    cairo_destroy(cr);
+    
+    if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS
+       || cairo_surface_write_to_png_stream(surface, write_png, png) != CAIRO_STATUS_SUCCESS)
+    {
+        cairo_surface_destroy(surface);
+        free(png->data);
+        *png = (PngBuffer){0};
+        return NULL;
+    }
+    return surface;
+}
+
+static cairo_status_t write_png(void *closure, const unsigned char *data, unsigned int length)
+{
+    PngBuffer *b = closure;
+    if(b->size + length > b->capacity)
+    {
+        size_t capacity = (b->capacity > 0) ? b->capacity * 2 : 4096;
+        while(capacity < b->size + length)
+            capacity *= 2;
+        uint8_t *grown = realloc(b->data, capacity);
+        if(!grown)
+            return CAIRO_STATUS_WRITE_ERROR;
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, data, length);
+    b->size += length;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+// Reads from a PngBuffer, where size is how much has been read
+static cairo_status_t read_png(void *closure, unsigned char *data, unsigned int length)
+{
+    PngBuffer *b = closure;
+    if(b->capacity - b->size < length)
+        return CAIRO_STATUS_READ_ERROR;
+    memcpy(data, b->data + b->size, length);
+    b->size += length;
+    return CAIRO_STATUS_SUCCESS;
+}
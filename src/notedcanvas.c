@@ -12,42 +12,75 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 
-static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, float pressure);
+static void handle_input(NotedCanvas *self, NCInputState state, NCInputTool tool, float x, float y, float pressure, double time);
+static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, float pressure, double time);
 static void eraser_input(NotedCanvas *self, NCInputState state, float x, float y, float pressure);
-static void draw_page(cairo_t *cr, Page *p);
-static void draw_stroke(cairo_t *cr, Stroke *s, float magnification);
+static void select_input(NotedCanvas *self, NCInputState state, float x, float y);
+static void draw_selection(NotedCanvas *self, cairo_t *cr);
+static void invalidate_selection(NotedCanvas *self);
+static bool drag_selection(NotedCanvas *self, NCInputState state, float x, float y);
+static void draw_transformed_selection(NotedCanvas *self, cairo_t *cr, NCRect *clipRect, float magnification);
+static void draw_stroke_segments(cairo_t *cr, Stroke *s, size_t first);
 static void append_page(NotedCanvas *self);
-static void calculate_control_points(float *p, int n, float *cp1, float *cp2);
+static void save_changes(NotedCanvas *self);
 static void clear_redos(NotedCanvas *self);
+static void update_wet_ink(NotedCanvas *self, Stroke *s, bool commit);
+static void update_prediction(NotedCanvas *self, Stroke *s, float x, float y, float pressure, double time, NCInputState state);
+static bool predict_at(NotedCanvas *self, double time, float *x, float *y);
+static bool prediction_rect(NotedCanvas *self, Stroke *s, NCRect *r);
+static void draw_prediction_tail(NotedCanvas *self, cairo_t *cr);
+static double current_time(void);
+static void invalidate(NotedCanvas *self, NCRect *r);
+static void redraw(NotedCanvas *self, NCRect *r);
+static void mark_changed(NotedCanvas *self, NCRect *r);
+static void add_damage(NotedCanvas *self, NCRect r);
 
 static inline NCRect * expand_rect(NCRect *a, float amount);
 static inline bool rects_intersect(NCRect *a, NCRect *b);
 static inline bool point_in_rect(NCRect *r, float x, float y);
+static inline NCRect * union_rect(NCRect *a, NCRect *b);
+static inline float rect_area(NCRect *r);
 extern inline void rect_expand_by_point(NCRect *a, float x, float y);
 extern inline float sq_dist(float x1, float y1, float x2, float y2);
 
+// More damage rects than this get merged together, since past
+// a point it's cheaper to redraw a bit extra than to issue
+// another redraw.
+static const size_t kMaxDamageRects = 16;
+
+// Samples further apart than this (seconds) mean the pen paused,
+// so there's no useful velocity to predict from.
+static const double kMaxPredictionGap = 0.05;
+
 
 NotedCanvas * noted_canvas_new(const char *path)
 {
     NotedCanvas *self = calloc(1, sizeof(NotedCanvas));
     self->path = strdup(path);
-    self->pages = array_new(sizeof(Page), (FreeNotify)free_page);
     append_page(self);
-    
-    if(!noted_canvas_save(self, self->path))
-    {
-        printf("error saving to %s\n", self->path);
-    }
-    
+    save_changes(self);
     return self;
 }
 
 void noted_canvas_destroy(NotedCanvas *self)
 {
+    // Thumbnails that finished after the last save are kept
+    if(thumbnails_stop(self) && self->path && !noted_canvas_save(self, self->path))
+        printf("error saving to %s\n", self->path);
+    images_stop(self);
+    noted_canvas_stop_recording(self);
+    
     if(self->path)
         free(self->path);
-    array_free(self->pages);
+    pages_free(self);
+    free(self->saveBuffer);
+    array_free(self->damage);
+    array_free(self->lassoX);
+    array_free(self->lassoY);
     free(self);
 }
 
@@ -66,7 +99,9 @@ void noted_canvas_set_invalidate_callback(NotedCanvas *self, NCInvalidateCallbac
 
 void noted_canvas_draw(NotedCanvas *self, cairo_t *cr, float magnification)
 {
-    NCRect clipRect, relClipRect;
+    NCRect clipRect;
+    uint64_t start = stats_now();
+    DrawCounts counts = {0};
     
     {
         double x1, y1, x2, y2;
@@ -77,66 +112,127 @@ void noted_canvas_draw(NotedCanvas *self, cairo_t *cr, float magnification)
         clipRect.y2 = y2;
     }
     
-    size_t npages = array_size(self->pages);
-    for(size_t i = 0; i < npages; ++i)
+    // Only pages from the one at the top of the clip down to
+    // the bottom of it can be visible.
+    for(Page *p = pages_at_y(self, clipRect.y1); p; p = page_next(p))
     {
-        Page *p = &self->pages[i];
-        
-        if(!rects_intersect(&clipRect, &p->bounds))
-            continue;
-        
-        draw_page(cr, p);
+        NCRect pb = page_rect(p);
+        if(pb.y1 > clipRect.y2)
+            break;
+        if(rects_intersect(&clipRect, &pb))
+            draw_page(cr, p, &pb, magnification);
     }
     
+    // Strokes can hang off the edge of their page, so every page's
+    // strokes are checked against the clip.
     cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
-    for(size_t i = 0; i < npages; ++i)
+    for(Page *p = pages_first(self); p; p = page_next(p))
     {
-        Page *p = &self->pages[i];
-        
-        relClipRect.x1 = clipRect.x1 - p->bounds.x1;
-        relClipRect.y1 = clipRect.y1 - p->bounds.y1;
-        relClipRect.x2 = clipRect.x2 - p->bounds.x1;
-        relClipRect.y2 = clipRect.y2 - p->bounds.y1;
-        
-        cairo_save(cr);
-        cairo_translate(cr, p->bounds.x1, p->bounds.y1);
-        
-        size_t nstrokes = array_size(p->strokes);
-        for(unsigned long j = 0; j < nstrokes; ++j)
-        {
-            Stroke *s = &p->strokes[j];
-            
-            // Expand the rect by width of stroke, so that the intersection
-            // calculation includes the outside edge of the stroke.
-            NCRect r = s->bounds;
-            if(!rects_intersect(&relClipRect, expand_rect(&r, s->style.thickness)))
-                continue;
-            
-            cairo_set_line_width(cr, s->style.thickness);
-            cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
-            draw_stroke(cr, s, magnification);
-        }
-        
-        cairo_restore(cr);
+        NCRect pb = page_rect(p);
+        Stroke *current = (self->currentStroke && self->currentStroke->page == p) ? self->currentStroke : NULL;
+        draw_page_content(cr, self, p, &pb, &clipRect, magnification, current,
+                          self->wetInkCallback != NULL, self->selectDrag != kSelectDragNone, &counts);
+    }
+    
+    if(self->selectDrag != kSelectDragNone)
+        draw_transformed_selection(self, cr, &clipRect, magnification);
+    
+    if(!self->wetInkCallback)
+        draw_prediction_tail(self, cr);
+    
+    draw_selection(self, cr);
+    stats_end_draw(self, start, counts.drawn, counts.culled, counts.points);
+}
+
+void noted_canvas_set_wet_ink_callback(NotedCanvas *self, NCWetInkCallback callback, void *data)
+{
+    if(self->wetInkCallback && self->currentStroke)
+        self->wetInkCallback(self, NULL, self->wetInkData);
+    
+    self->wetInkCallback = callback;
+    self->wetInkData = data;
+    self->wetInkDrawn = 0;
+    
+    // Whatever was in progress moves between the overlay and
+    // the canvas, so it needs a redraw in its new home.
+    if(self->currentStroke)
+    {
+        Stroke *s = self->currentStroke;
+        NCRect pb = page_rect(s->page);
+        NCRect r = s->bounds;
+        r.x1 += pb.x1;
+        r.y1 += pb.y1;
+        r.x2 += pb.x1;
+        r.y2 += pb.y1;
+        redraw(self, expand_rect(&r, s->style.thickness));
+        if(callback)
+            callback(self, &r, data);
     }
 }
 
+void noted_canvas_draw_wet_ink(NotedCanvas *self, cairo_t *cr, bool redrawAll)
+{
+    Stroke *s = self->currentStroke;
+    if(!s || !self->wetInkCallback)
+        return;
+    
+    if(redrawAll)
+        self->wetInkDrawn = 0;
+    
+    size_t npoints = array_size(s->x);
+    if(self->wetInkDrawn >= npoints)
+        return;
+    
+    // Continue from the end of the last segment drawn. Plain
+    // lines are fine here; the stroke gets its curves when it's
+    // redrawn on the canvas after tool up.
+    size_t first = (self->wetInkDrawn > 0) ? self->wetInkDrawn - 1 : 0;
+    
+    NCRect pb = page_rect(s->page);
+    cairo_save(cr);
+    cairo_translate(cr, pb.x1, pb.y1);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+    cairo_set_line_width(cr, s->style.thickness);
+    cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+    
+    draw_stroke_segments(cr, s, first);
+    
+    cairo_restore(cr);
+    self->wetInkDrawn = npoints;
+}
+
+void noted_canvas_draw_prediction(NotedCanvas *self, cairo_t *cr)
+{
+    draw_prediction_tail(self, cr);
+}
+
 void noted_canvas_input(NotedCanvas *self, NCInputState state, NCInputTool tool, float x, float y, float pressure)
 {
+    double time = current_time();
+    if(self->recording)
+        record_input(self, tool, &(NCInputSample){state, x, y, pressure, time}, false, false);
+    handle_input(self, state, tool, x, y, pressure, time);
+}
+
+static void handle_input(NotedCanvas *self, NCInputState state, NCInputTool tool, float x, float y, float pressure, double time)
+{
+    uint64_t start = stats_now();
+    ++self->inputDepth;
+    
     if(state == kNCToolDown)
         self->inGesture = true;
     
     switch(tool)
     {
         case kNCPenTool:
-            pen_input(self, state, x, y, pressure);
+            pen_input(self, state, x, y, pressure, time);
             break;
         case kNCEraserTool:
             eraser_input(self, state, x, y, pressure);
             break;
         case kNCSelectTool:
-            // TODO
-            printf("select tool not implemented\n");
+            select_input(self, state, x, y);
             break;
     }
     
@@ -145,28 +241,132 @@ void noted_canvas_input(NotedCanvas *self, NCInputState state, NCInputTool tool,
     if(self->inGesture && state == kNCToolUp)
     {
         self->inGesture = false;
+        save_changes(self);
+    }
+    
+    if(--self->inputDepth == 0 && !self->deferDamage)
+        noted_canvas_flush_damage(self);
+    stats_end(self, kNCStatInput, start);
+}
+
+void noted_canvas_input_batch(NotedCanvas *self, NCInputTool tool, const NCInputSample *samples, size_t n)
+{
+    ++self->inputDepth;
+    
+    for(size_t i = 0; i < n; ++i)
+    {
+        const NCInputSample *sample = &samples[i];
+        double time = (sample->timestamp > 0) ? sample->timestamp : current_time();
+        if(self->recording)
+            record_input(self, tool, &(NCInputSample){sample->state, sample->x, sample->y, sample->pressure, time}, true, i == 0);
+        handle_input(self, sample->state, tool, sample->x, sample->y, sample->pressure, time);
         
-        if(self->path)
+        // Once a stroke is going, make room for the rest of the
+        // run at once instead of regrowing the point arrays.
+        if(tool == kNCPenTool && self->currentStroke && (i == 0 || sample->state == kNCToolDown))
         {
-            printf("save to %s\n", self->path);
-            if(!noted_canvas_save(self, self->path))
-            {
-                printf("error saving to %s\n", self->path);
-            }
+            Stroke *s = self->currentStroke;
+            s->x = array_reserve(s->x, array_size(s->x) + (n - i - 1), false);
+            s->y = array_reserve(s->y, array_size(s->y) + (n - i - 1), false);
+            s->p = array_reserve(s->p, array_size(s->p) + (n - i - 1), false);
         }
     }
+    
+    if(--self->inputDepth == 0 && !self->deferDamage)
+        noted_canvas_flush_damage(self);
+}
+
+void noted_canvas_set_defer_damage(NotedCanvas *self, bool defer)
+{
+    self->deferDamage = defer;
+    if(!defer)
+        noted_canvas_flush_damage(self);
+}
+
+void noted_canvas_flush_damage(NotedCanvas *self)
+{
+    if(!self->damage)
+        return;
+    
+    size_t n = array_size(self->damage);
+    if(self->invalidateCallback)
+        for(size_t i = 0; i < n; ++i)
+            self->invalidateCallback(self, &self->damage[i], self->callbackData);
+    array_shrink(self->damage, 0, false);
+}
+
+void noted_canvas_set_prediction(NotedCanvas *self, float horizon)
+{
+    self->predictHorizon = (horizon > 0) ? horizon : 0;
+    if(self->recording)
+        record_setting(self, &(NCRecordEvent){.kind = kNCRecordPrediction, .time = current_time(), .value = self->predictHorizon});
+    memset(&self->predictStats, 0, sizeof(NCPredictionStats));
+    self->predictStats.horizon = self->predictHorizon;
+}
+
+void noted_canvas_get_prediction_stats(NotedCanvas *self, NCPredictionStats *stats)
+{
+    *stats = self->predictStats;
+}
+
+void noted_canvas_set_simplify_tolerance(NotedCanvas *self, float tolerance)
+{
+    self->simplifyTolerance = (tolerance > 0) ? tolerance : 0;
+    if(self->recording)
+        record_setting(self, &(NCRecordEvent){.kind = kNCRecordSimplify, .time = current_time(), .value = self->simplifyTolerance});
 }
 
 float noted_canvas_get_height(NotedCanvas *self)
 {
-    if(array_size(self->pages) == 0)
-        return 0;
-    return self->pages[array_size(self->pages) - 1].bounds.y2;
+    return pages_height(self);
+}
+
+void noted_canvas_set_select_mode(NotedCanvas *self, NCSelectMode mode)
+{
+    self->selectMode = mode;
+    if(self->recording)
+        record_setting(self, &(NCRecordEvent){.kind = kNCRecordSelectMode, .time = current_time(), .selectMode = mode});
 }
 
 void noted_canvas_set_stroke_style(NotedCanvas *self, NCStrokeStyle style)
 {
-    self->currentStyle = style;
+    if(self->recording)
+        record_setting(self, &(NCRecordEvent){.kind = kNCRecordStyle, .time = current_time(), .style = style});
+    
+    if(self->nselected == 0)
+    {
+        self->currentStyle = style;
+        return;
+    }
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            Stroke *s = &p->strokes[j];
+            if(!s->selected)
+                continue;
+            
+            // Pressure outlines are built at the old thickness
+            bool rebuild = s->outline && s->style.thickness != style.thickness;
+            
+            // Invalidate at the thicker of the two widths
+            NCRect r = s->bounds;
+            r.x1 += pb.x1;
+            r.y1 += pb.y1;
+            r.x2 += pb.x1;
+            r.y2 += pb.y1;
+            invalidate(self, expand_rect(&r, fmaxf(s->style.thickness, style.thickness)));
+            
+            s->style = style;
+            if(rebuild)
+                stroke_update_outline(s);
+        }
+    }
+    
+    save_changes(self);
 }
 
 NCStrokeStyle noted_canvas_get_stroke_style(NotedCanvas *self)
@@ -176,23 +376,466 @@ NCStrokeStyle noted_canvas_get_stroke_style(NotedCanvas *self)
 
 size_t noted_canvas_get_n_pages(NotedCanvas *self)
 {
-    return array_size(self->pages);
+    return pages_count(self);
 }
 
 void noted_canvas_get_page_rect(NotedCanvas *self, size_t index, NCRect *rect)
 {
-    *rect = self->pages[index].bounds;
+    *rect = page_rect(pages_get(self, index));
 }
 
 void noted_canvas_set_page_pattern(NotedCanvas *self, size_t index, NCPagePattern pattern, unsigned int density)
 {
-    self->pages[index].pattern = pattern;
-    self->pages[index].density = density;
+    Page *p = pages_get(self, index);
+    
+    // Only imported pages have a PDF page to show
+    if(pattern == kNCPagePDF && !p->background)
+        pattern = kNCPageBlank;
+    if(pattern != kNCPagePDF && p->background)
+    {
+        page_background_release(p->background);
+        p->background = NULL;
+    }
+    
+    p->pattern = pattern;
+    p->density = density;
+    
+    NCRect r = page_rect(p);
+    mark_changed(self, &r);
 }
 
 void noted_canvas_move_page(NotedCanvas *self, size_t index, size_t targetIndex)
 {
-//    Page p = self->pages[index];
+    size_t npages = pages_count(self);
+    if(index >= npages)
+        return;
+    if(targetIndex >= npages)
+        targetIndex = npages - 1;
+    if(index == targetIndex)
+        return;
+    
+    // Only the pages from one index to the other change places
+    size_t first = (index < targetIndex) ? index : targetIndex;
+    size_t last = (index < targetIndex) ? targetIndex : index;
+    NCRect r = page_rect(pages_get(self, first));
+    r.y2 = page_rect(pages_get(self, last)).y2;
+    
+    invalidate_selection(self);
+    pages_insert(self, targetIndex, pages_remove(self, index));
+    selection_update_bounds(self);
+    
+    redraw(self, &r);
+    
+    save_changes(self);
+}
+
+void noted_canvas_insert_page(NotedCanvas *self, size_t index)
+{
+    size_t npages = pages_count(self);
+    if(index > npages)
+        index = npages;
+    
+    // Look like the page before it, or the first page if it's
+    // first. After a PDF page, that's a blank page its size.
+    Page *like = pages_get(self, (index > 0) ? index - 1 : 0);
+    NCPagePattern pattern = (like->pattern == kNCPagePDF) ? kNCPageBlank : like->pattern;
+    Page *p = page_new(like->width, like->height, pattern, like->density);
+    
+    invalidate_selection(self);
+    pages_insert(self, index, p);
+    selection_update_bounds(self);
+    
+    if(self->invalidateCallback)
+        self->invalidateCallback(self, NULL, self->callbackData);
+    NCRect r = page_rect(p);
+    invalidate(self, &r);
+    r.y2 = pages_height(self);
+    redraw(self, &r);
+    
+    save_changes(self);
+}
+
+void noted_canvas_delete_page(NotedCanvas *self, size_t index)
+{
+    // There's always at least one page to draw on
+    size_t npages = pages_count(self);
+    if(index >= npages || npages == 1)
+        return;
+    
+    NCRect r = page_rect(pages_get(self, index));
+    r.y2 = pages_height(self);
+    
+    invalidate_selection(self);
+    clear_redos(self);
+    
+    Page *p = pages_remove(self, index);
+    size_t nstrokes = array_size(p->strokes);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        if(p->strokes[j].selected)
+            --self->nselected;
+        if(&p->strokes[j] == self->currentStroke)
+            self->currentStroke = NULL;
+    }
+    free_page(p);
+    selection_update_bounds(self);
+    
+    if(self->invalidateCallback)
+        self->invalidateCallback(self, NULL, self->callbackData);
+    redraw(self, &r);
+    
+    save_changes(self);
+}
+
+size_t noted_canvas_get_selection(NotedCanvas *self, NCRect *rect)
+{
+    if(self->nselected > 0 && rect)
+        *rect = self->selectionBounds;
+    return self->nselected;
+}
+
+void noted_canvas_clear_selection(NotedCanvas *self)
+{
+    if(self->nselected == 0)
+        return;
+    
+    invalidate_selection(self);
+    snapshot_mark(self, &self->selectionBounds);
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        size_t nstrokes = array_size(p->strokes);
+        for(size_t j = 0; j < nstrokes; ++j)
+            p->strokes[j].selected = false;
+    }
+    
+    self->nselected = 0;
+    self->selectionBounds = (NCRect){0};
+}
+
+void noted_canvas_delete_selection(NotedCanvas *self)
+{
+    if(self->nselected == 0)
+        return;
+    
+    invalidate_selection(self);
+    mark_changed(self, &self->selectionBounds);
+    clear_redos(self);
+    
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        // Compact the unselected strokes down in one pass
+        size_t nstrokes = array_size(p->strokes), n = 0;
+        for(size_t j = 0; j < nstrokes; ++j)
+        {
+            if(p->strokes[j].selected)
+                free_stroke(&p->strokes[j]);
+            else
+                p->strokes[n++] = p->strokes[j];
+        }
+        array_shrink(p->strokes, n, false);
+    }
+    
+    self->nselected = 0;
+    self->selectionBounds = (NCRect){0};
+    
+    save_changes(self);
+}
+
+void * noted_canvas_copy(NotedCanvas *self, size_t *size)
+{
+    if(self->nselected == 0)
+        return NULL;
+    
+    // Relative to the top of the selection, but keeping x, so a
+    // paste lands at the same spot across the page.
+    return clip_encode_strokes(self, 0, self->selectionBounds.y1, size);
+}
+
+bool noted_canvas_paste(NotedCanvas *self, const void *content, size_t size, float where)
+{
+    Page **pages;
+    Stroke *strokes;
+    if(!clip_decode(content, size, &pages, &strokes))
+        return false;
+    
+    if(!strokes || array_size(strokes) == 0)
+    {
+        if(pages)
+            for(size_t i = 0; i < array_size(pages); ++i)
+                free_page(pages[i]);
+        array_free(pages);
+        array_free(strokes);
+        return false;
+    }
+    
+    size_t n = array_size(strokes);
+    NCRect b = strokes[0].bounds;
+    for(size_t j = 1; j < n; ++j)
+    {
+        rect_expand_by_point(&b, strokes[j].bounds.x1, strokes[j].bounds.y1);
+        rect_expand_by_point(&b, strokes[j].bounds.x2, strokes[j].bounds.y2);
+    }
+    
+    // Paste onto the page under where, or the one before the gap
+    Page *p = pages_at_y(self, where);
+    NCRect pb = page_rect(p);
+    float dx = -pb.x1;
+    float dy = where - (b.y1 + b.y2) / 2 - pb.y1;
+    
+    // A stroke in progress on the page has to be found again once
+    // its array grows
+    Stroke *current = self->currentStroke;
+    size_t currentIndex = (current && current->page == p) ? (size_t)(current - p->strokes) : SIZE_MAX;
+    Stroke *reserved = array_reserve(p->strokes, array_size(p->strokes) + n, false);
+    if(!reserved)
+    {
+        for(size_t j = 0; j < n; ++j)
+            free_stroke(&strokes[j]);
+        array_free(strokes);
+        return false;
+    }
+    p->strokes = reserved;
+    if(currentIndex != SIZE_MAX)
+        self->currentStroke = &p->strokes[currentIndex];
+    
+    noted_canvas_clear_selection(self);
+    clear_redos(self);
+    
+    // The pasted strokes become the selection, so they can be
+    // moved into place right away. There's room for them all, so
+    // the page's strokes stay put.
+    for(size_t j = 0; j < n; ++j)
+    {
+        Stroke *s = &strokes[j];
+        stroke_translate(s, dx, dy);
+        s->page = p;
+        s->selected = true;
+        p->strokes = array_append(p->strokes, s);
+    }
+    array_free(strokes);
+    
+    self->nselected = n;
+    selection_update_bounds(self);
+    invalidate_selection(self);
+    mark_changed(self, &self->selectionBounds);
+    
+    save_changes(self);
+    return true;
+}
+
+void * noted_canvas_page_copy(NotedCanvas *self, size_t index, size_t *size)
+{
+    return clip_encode_pages(self, index, 1, size);
+}
+
+bool noted_canvas_page_paste(NotedCanvas *self, const void *content, size_t size, size_t index)
+{
+    Page **pages;
+    Stroke *strokes;
+    if(!clip_decode(content, size, &pages, &strokes))
+        return false;
+    
+    if(!pages)
+    {
+        for(size_t j = 0; j < array_size(strokes); ++j)
+            free_stroke(&strokes[j]);
+        array_free(strokes);
+        return false;
+    }
+    
+    size_t npages = pages_count(self);
+    if(index > npages)
+        index = npages;
+    
+    invalidate_selection(self);
+    clear_redos(self);
+    
+    size_t n = array_size(pages);
+    for(size_t i = 0; i < n; ++i)
+        pages_insert(self, index + i, pages[i]);
+    selection_update_bounds(self);
+    
+    if(self->invalidateCallback)
+        self->invalidateCallback(self, NULL, self->callbackData);
+    NCRect r = page_rect(pages[0]);
+    r.y2 = page_rect(pages[n - 1]).y2;
+    invalidate(self, &r);
+    r.y2 = pages_height(self);
+    redraw(self, &r);
+    array_free(pages);
+    
+    save_changes(self);
+    return true;
+}
+
+bool noted_canvas_insert_image(NotedCanvas *self, const void *data, size_t size, float x, float y, float width)
+{
+    int pixelWidth, pixelHeight;
+    ImageData *d = image_data_new(data, size);
+    if(!d || !image_data_info(d, &pixelWidth, &pixelHeight) || width <= 0)
+    {
+        image_data_release(d);
+        return false;
+    }
+    
+    Page *p = pages_at_y(self, y);
+    NCRect pb = page_rect(p);
+    Image img = {
+        .data = d,
+        .bounds = {x - pb.x1, y - pb.y1, x - pb.x1 + width, y - pb.y1 + width * pixelHeight / pixelWidth}
+    };
+    p->images = array_append(p->images, &img);
+    
+    NCRect r = {x, y, x + width, y + (img.bounds.y2 - img.bounds.y1)};
+    invalidate(self, &r);
+    
+    save_changes(self);
+    return true;
+}
+
+// Default size of inserted text, about 12 points on a letter page
+static const float kTextSize = 1 / 48.f;
+
+bool noted_canvas_insert_text(NotedCanvas *self, const char *text, float x, float y, float width, NCTextRef *ref)
+{
+    if(!text || !*text || width <= 0)
+        return false;
+    
+    Page *p = pages_at_y(self, y);
+    NCRect pb = page_rect(p);
+    TextBox t = {
+        .text = strdup(text),
+        .bounds = {x - pb.x1, y - pb.y1, x - pb.x1 + width, y - pb.y1},
+        .size = kTextSize,
+        .r = self->currentStyle.r, .g = self->currentStyle.g,
+        .b = self->currentStyle.b, .a = self->currentStyle.a
+    };
+    if(!t.text)
+        return false;
+    text_box_update(&t);
+    p->texts = array_append(p->texts, &t);
+    if(ref)
+        *ref = (NCTextRef){page_index(p), array_size(p->texts) - 1};
+    
+    NCRect r = {x, y, x + width, y + (t.bounds.y2 - t.bounds.y1)};
+    invalidate(self, &r);
+    
+    save_changes(self);
+    return true;
+}
+
+bool noted_canvas_text_at(NotedCanvas *self, float x, float y, NCTextRef *ref)
+{
+    Page *p = pages_at_y(self, y);
+    if(!p)
+        return false;
+    
+    NCRect pb = page_rect(p);
+    x -= pb.x1;
+    y -= pb.y1;
+    for(size_t i = array_size(p->texts); i > 0; --i)
+    {
+        NCRect *r = &p->texts[i - 1].bounds;
+        if(x >= r->x1 && x <= r->x2 && y >= r->y1 && y <= r->y2)
+        {
+            *ref = (NCTextRef){page_index(p), i - 1};
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * noted_canvas_get_text(NotedCanvas *self, NCTextRef ref, NCRect *rect)
+{
+    Page *p = pages_get(self, ref.page);
+    if(!p || ref.index >= array_size(p->texts))
+        return NULL;
+    
+    TextBox *t = &p->texts[ref.index];
+    if(rect)
+    {
+        NCRect pb = page_rect(p);
+        *rect = (NCRect){t->bounds.x1 + pb.x1, t->bounds.y1 + pb.y1, t->bounds.x2 + pb.x1, t->bounds.y2 + pb.y1};
+    }
+    return t->text;
+}
+
+void noted_canvas_set_text(NotedCanvas *self, NCTextRef ref, const char *text, float width)
+{
+    Page *p = pages_get(self, ref.page);
+    if(!p || ref.index >= array_size(p->texts))
+        return;
+    
+    TextBox *t = &p->texts[ref.index];
+    NCRect pb = page_rect(p);
+    NCRect r = {t->bounds.x1 + pb.x1, t->bounds.y1 + pb.y1, t->bounds.x2 + pb.x1, t->bounds.y2 + pb.y1};
+    invalidate(self, &r);
+    
+    if(!text || !*text)
+    {
+        free_text(t);
+        array_remove(p->texts, ref.index, false);
+    }
+    else
+    {
+        // Unchanged text isn't shaped again
+        bool changed = strcmp(text, t->text) != 0;
+        if(changed)
+        {
+            char *copy = strdup(text);
+            if(!copy)
+                return;
+            free(t->text);
+            t->text = copy;
+        }
+        if(width > 0 && width != t->bounds.x2 - t->bounds.x1)
+        {
+            t->bounds.x2 = t->bounds.x1 + width;
+            changed = true;
+        }
+        if(!changed)
+            return;
+        
+        text_box_update(t);
+        r.x2 = t->bounds.x2 + pb.x1;
+        r.y2 = t->bounds.y2 + pb.y1;
+        invalidate(self, &r);
+    }
+    
+    save_changes(self);
+}
+
+bool noted_canvas_import_pdf(NotedCanvas *self, const char *pdfPath, size_t index)
+{
+    Page **pages = pdf_import_pages(pdfPath);
+    if(!pages)
+        return false;
+    
+    size_t npages = pages_count(self);
+    if(index > npages)
+        index = npages;
+    
+    invalidate_selection(self);
+    clear_redos(self);
+    
+    size_t n = array_size(pages);
+    for(size_t i = 0; i < n; ++i)
+        pages_insert(self, index + i, pages[i]);
+    selection_update_bounds(self);
+    
+    // The new pages aren't marked for thumbnails, which would
+    // render every page of the PDF. Each gets one once it's shown
+    // in the overview.
+    if(self->invalidateCallback)
+        self->invalidateCallback(self, NULL, self->callbackData);
+    NCRect r = page_rect(pages[0]);
+    r.y2 = pages_height(self);
+    redraw(self, &r);
+    array_free(pages);
+    
+    save_changes(self);
+    return true;
 }
 
 // TODO: Undo doesn't work with erasing.
@@ -222,32 +865,29 @@ bool noted_canvas_redo(NotedCanvas *self)
     return true;
 }
 
-static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, float pressure)
+static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, float pressure, double time)
 {
     Stroke *s = self->currentStroke;
+    float rawX, rawY; // Page-relative sample before stabilization
+    float pv = pressure; // Pressure to store
+    NCRect pb; // Rect of the stroke's page
         
     if(state == kNCToolDown)
     {
         // Start new stroke
         
         clear_redos(self);
+        noted_canvas_clear_selection(self);
         
-        Page *p = NULL;
-        size_t i;
-        for(i = 0; i < array_size(self->pages); ++i)
-        {
-            if(point_in_rect(&self->pages[i].bounds, x, y))
-            {
-                p = &self->pages[i];
-                break;
-            }
-        }
-        
-        if(!p)
+        Page *p = pages_at_y(self, y);
+        pb = page_rect(p);
+        if(!point_in_rect(&pb, x, y))
             return;
         
-        x -= p->bounds.x1;
-        y -= p->bounds.y1;
+        x -= pb.x1;
+        y -= pb.y1;
+        rawX = x;
+        rawY = y;
         
         Stroke new = {
             .bounds = {x, y, x, y},
@@ -256,12 +896,13 @@ static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, f
             .style = self->currentStyle,
             .x = array_new(sizeof(float), NULL),
             .y = array_new(sizeof(float), NULL),
+            .p = array_new(sizeof(float), NULL),
         };
         p->strokes = array_append(p->strokes, &new);
         self->currentStroke = s = &p->strokes[array_size(p->strokes) - 1];
         
         // If this is a stroke on the last page, add a new page
-        if(i == array_size(self->pages) - 1)
+        if(!page_next(p))
             append_page(self);
     }
     else
@@ -273,8 +914,11 @@ static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, f
         
         unsigned long i = array_size(s->x) - 1; // Previous point index
         
-        x -= s->page->bounds.x1;
-        y -= s->page->bounds.y1;
+        pb = page_rect(s->page);
+        x -= pb.x1;
+        y -= pb.y1;
+        rawX = x;
+        rawY = y;
         
         // Stabilization
         // Probably could use a fancy algorithm for this,
@@ -283,41 +927,286 @@ static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, f
         x = (s->x[i] + x) / 2;
         y = (s->y[i] + y) / 2;
         
-        // Use beziers when there is a long distance between points.
+        // Pen up reports no pressure, so the stroke would end
+        // in a taper. Keep the last pressure instead.
+        if(state == kNCToolUp && pressure <= 0)
+            pv = s->p[i];
+        pv = (s->p[i] + pv) / 2;
+        
         float dsq = sq_dist(s->x[i], s->y[i], x, y);
+        
+        // Drop samples that land too close to the last point to
+        // matter (the pen moving slowly). The last one is always
+        // kept so the stroke ends where the pen lifted.
+        if(state != kNCToolUp && dsq < self->simplifyTolerance * self->simplifyTolerance)
+        {
+            update_prediction(self, s, rawX, rawY, pressure, time, state);
+            return;
+        }
+        
+        // Use beziers when there is a long distance between points.
         if(dsq > s->maxDistSq)
             s->maxDistSq = dsq;
     }
     
-    s->x = array_append(s->x, &x);
-    s->y = array_append(s->y, &y);
+    s->x = array_append(s->x, &x);
+    s->y = array_append(s->y, &y);
+    s->p = array_append(s->p, &pv);
+    
+    rect_expand_by_point(&s->bounds, x, y);
+    
+    if(state == kNCToolUp)
+    {
+        self->currentStroke = NULL;
+        
+        // Simplify the finished stroke. Its curves get refitted
+        // to the remaining points, so redraw all of it.
+        NCRect old = s->bounds;
+        if(stroke_simplify(s, self->simplifyTolerance) && !self->wetInkCallback)
+        {
+            old.x1 += pb.x1;
+            old.y1 += pb.y1;
+            old.x2 += pb.x1;
+            old.y2 += pb.y1;
+            invalidate(self, expand_rect(&old, s->style.thickness));
+        }
+        
+        stroke_update_outline(s);
+    }
+    
+    update_prediction(self, s, rawX, rawY, pressure, time, state);
+    
+    if(self->wetInkCallback)
+    {
+        update_wet_ink(self, s, state == kNCToolUp);
+        return;
+    }
+    
+    size_t npoints = array_size(s->x);
+    if(npoints > 1)
+    {
+        // Invalidate the rect containing the past few points
+        // Past few points are needed, since beziers shift
+        // slightly as they are fitted to the points. Also
+        // helps regular lines, but I'm not totally sure why.
+        NCRect r = {x, y, x, y}; // x == s->x[s->numPoints - 1]
+        for(int i = 2; i <= 4 && npoints >= i; ++i)
+            rect_expand_by_point(&r, s->x[npoints - i], s->y[npoints - i]);
+        
+        r.x1 += pb.x1;
+        r.y1 += pb.y1;
+        r.x2 += pb.x1;
+        r.y2 += pb.y1;
+        
+        // Plus a little extra for stroke width. Snapshots copy
+        // the stroke in progress on their own until it's done,
+        // so only the thumbnail is out of date before then.
+        expand_rect(&r, s->style.thickness);
+        if(state == kNCToolUp)
+            invalidate(self, &r);
+        else
+        {
+            thumbnails_mark(self, &r);
+            redraw(self, &r);
+        }
+    }
+}
+
+// Tells the frontend which part of the wet ink overlay has new
+// segments, or on commit, hands the stroke over to the canvas.
+static void update_wet_ink(NotedCanvas *self, Stroke *s, bool commit)
+{
+    NCRect pb = page_rect(s->page);
+    float ox = pb.x1, oy = pb.y1;
+    
+    if(commit)
+    {
+        NCRect r = s->bounds;
+        r.x1 += ox;
+        r.y1 += oy;
+        r.x2 += ox;
+        r.y2 += oy;
+        invalidate(self, expand_rect(&r, s->style.thickness));
+        
+        self->wetInkDrawn = 0;
+        self->wetInkCallback(self, NULL, self->wetInkData);
+        return;
+    }
+    
+    size_t npoints = array_size(s->x);
+    size_t first = (self->wetInkDrawn > 0) ? self->wetInkDrawn - 1 : 0;
+    if(first >= npoints)
+        return;
+    
+    NCRect r = {s->x[first], s->y[first], s->x[first], s->y[first]};
+    for(size_t i = first + 1; i < npoints; ++i)
+        rect_expand_by_point(&r, s->x[i], s->y[i]);
+    
+    r.x1 += ox;
+    r.y1 += oy;
+    r.x2 += ox;
+    r.y2 += oy;
+    self->wetInkCallback(self, expand_rect(&r, s->style.thickness), self->wetInkData);
+}
+
+// Replaces the provisional tail of the stroke in progress. The
+// tail is extrapolated from the raw samples rather than from the
+// stabilized points, so it also covers the distance stabilization
+// makes the stroke trail behind the pen.
+static void update_prediction(NotedCanvas *self, Stroke *s, float x, float y, float pressure, double time, NCInputState state)
+{
+    NCRect r;
+    bool dirty = self->hasPredictTail && prediction_rect(self, s, &r);
+    self->hasPredictTail = false;
+    
+    if(state == kNCToolDown)
+        self->predictCount = 0;
+    else if(self->predictHorizon > 0)
+    {
+        // See how far off the previous prediction would have
+        // been, had it been made for this sample's time.
+        float px, py;
+        if(predict_at(self, time, &px, &py))
+        {
+            NCPredictionStats *st = &self->predictStats;
+            float err = sqrtf(sq_dist(px, py, x, y));
+            ++st->samples;
+            st->meanError += (err - st->meanError) / st->samples;
+            if(err > st->maxError)
+                st->maxError = err;
+        }
+    }
+    
+    // Keep the last few raw samples
+    PenSample sample = {x, y, pressure, time};
+    unsigned int n = sizeof(self->predictHistory) / sizeof(PenSample);
+    if(self->predictCount == n)
+        memmove(self->predictHistory, self->predictHistory + 1, (n - 1) * sizeof(PenSample));
+    else
+        ++self->predictCount;
+    self->predictHistory[self->predictCount - 1] = sample;
+    
+    if(state != kNCToolUp && self->predictHorizon > 0
+       && predict_at(self, time + self->predictHorizon, &self->predictX, &self->predictY))
+    {
+        NCPredictionStats *st = &self->predictStats;
+        self->hasPredictTail = true;
+        ++st->tails;
+        st->meanHorizon += ((self->predictTime - time) - st->meanHorizon) / st->tails;
+        
+        NCRect nr;
+        if(prediction_rect(self, s, &nr))
+        {
+            if(dirty)
+                union_rect(&r, &nr);
+            else
+                r = nr;
+            dirty = true;
+        }
+    }
+    
+    if(!dirty)
+        return;
+    if(self->wetInkCallback)
+        self->wetInkCallback(self, &r, self->wetInkData);
+    else
+        redraw(self, &r);
+}
+
+// Extrapolates the pen position at time from the recent raw
+// samples' velocity. Falling pressure shortens the prediction,
+// since the pen is probably about to lift. Sets predictTime
+// to the time actually predicted for.
+static bool predict_at(NotedCanvas *self, double time, float *x, float *y)
+{
+    unsigned int n = self->predictCount;
+    if(n < 2)
+        return false;
+    
+    PenSample *a = &self->predictHistory[n - 2];
+    PenSample *b = &self->predictHistory[n - 1];
+    double dt = b->time - a->time;
+    if(dt <= 0 || dt > kMaxPredictionGap)
+        return false;
     
-    rect_expand_by_point(&s->bounds, x, y);
+    double vx = (b->x - a->x) / dt, vy = (b->y - a->y) / dt;
+    double vp = (b->pressure - a->pressure) / dt;
     
-    if(state == kNCToolUp)
-        self->currentStroke = NULL;
+    // Average in the velocity before that, if there is one,
+    // to smooth out sample jitter.
+    if(n >= 3)
+    {
+        PenSample *c = &self->predictHistory[n - 3];
+        double dt2 = a->time - c->time;
+        if(dt2 > 0 && dt2 <= kMaxPredictionGap)
+        {
+            vx = (vx + (a->x - c->x) / dt2) / 2;
+            vy = (vy + (a->y - c->y) / dt2) / 2;
+        }
+    }
     
-    size_t npoints = array_size(s->x);
-    if(npoints > 1)
+    double ahead = time - b->time;
+    if(ahead > self->predictHorizon)
+        ahead = self->predictHorizon;
+    if(ahead < 0)
+        ahead = 0;
+    
+    if(vp < 0 && b->pressure > 0)
     {
-        // Invalidate the rect containing the past few points
-        // Past few points are needed, since beziers shift
-        // slightly as they are fitted to the points. Also
-        // helps regular lines, but I'm not totally sure why.
-        NCRect r = {x, y, x, y}; // x == s->x[s->numPoints - 1]
-        for(int i = 2; i <= 4 && npoints >= i; ++i)
-            rect_expand_by_point(&r, s->x[npoints - i], s->y[npoints - i]);
-        
-        r.x1 += s->page->bounds.x1;
-        r.y1 += s->page->bounds.y1;
-        r.x2 += s->page->bounds.x1;
-        r.y2 += s->page->bounds.y1;
-        
-        // Plus a little extra for stroke width
-        expand_rect(&r, s->style.thickness);
-        if(self->invalidateCallback)
-            self->invalidateCallback(self, &r, self->callbackData);
+        double scale = (b->pressure + vp * ahead) / b->pressure;
+        ahead *= (scale < 0) ? 0 : scale;
     }
+    
+    *x = b->x + vx * ahead;
+    *y = b->y + vy * ahead;
+    self->predictTime = b->time + ahead;
+    return true;
+}
+
+// Canvas rect covering the provisional tail, if there is one
+static bool prediction_rect(NotedCanvas *self, Stroke *s, NCRect *r)
+{
+    size_t npoints = array_size(s->x);
+    if(npoints == 0)
+        return false;
+    
+    NCRect pb = page_rect(s->page);
+    *r = (NCRect){s->x[npoints - 1], s->y[npoints - 1], s->x[npoints - 1], s->y[npoints - 1]};
+    rect_expand_by_point(r, self->predictX, self->predictY);
+    r->x1 += pb.x1;
+    r->y1 += pb.y1;
+    r->x2 += pb.x1;
+    r->y2 += pb.y1;
+    expand_rect(r, s->style.thickness);
+    return true;
+}
+
+static void draw_prediction_tail(NotedCanvas *self, cairo_t *cr)
+{
+    Stroke *s = self->currentStroke;
+    if(!s || !self->hasPredictTail)
+        return;
+    
+    NCRect pb = page_rect(s->page);
+    draw_tail(cr, &pb, s, self->predictX, self->predictY);
+}
+
+void draw_tail(cairo_t *cr, const NCRect *pb, Stroke *s, float x, float y)
+{
+    size_t npoints = array_size(s->x);
+    if(npoints == 0)
+        return;
+    
+    cairo_save(cr);
+    cairo_translate(cr, pb->x1, pb->y1);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_width(cr, s->style.thickness);
+    cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+    cairo_new_path(cr);
+    cairo_move_to(cr, s->x[npoints - 1], s->y[npoints - 1]);
+    cairo_line_to(cr, x, y);
+    cairo_stroke(cr);
+    cairo_restore(cr);
 }
 
 // Erasing uses alpha overlap to detect when the user has
@@ -327,6 +1216,9 @@ static void pen_input(NotedCanvas *self, NCInputState state, float x, float y, f
 // input to draw an erase line between the two.
 static void eraser_input(NotedCanvas *self, NCInputState state, float x, float y, float pressure)
 {
+    uint64_t start = stats_now();
+    unsigned long candidates = 0, rasterized = 0, erased = 0;
+    
     if(state == kNCToolDown)
     {
         self->eraserPrevX = NAN;
@@ -365,25 +1257,26 @@ static void eraser_input(NotedCanvas *self, NCInputState state, float x, float y
     unsigned char *data = NULL;
     unsigned long datalen = 0;
     
-    size_t npages = array_size(self->pages);
-    for(size_t i = 0; i < npages; ++i)
+    for(Page *p = pages_first(self); p; p = page_next(p))
     {
-        Page *p = &self->pages[i];
+        NCRect pb = page_rect(p);
 
         size_t nstrokes = array_size(p->strokes);
         for(unsigned long j = 0; j < nstrokes; ++j)
         {
             Stroke *s = &p->strokes[j];
+            ++candidates;
             
             NCRect r = s->bounds;
-            r.x1 += p->bounds.x1;
-            r.y1 += p->bounds.y1;
-            r.x2 += p->bounds.x1;
-            r.y2 += p->bounds.y1;
+            r.x1 += pb.x1;
+            r.y1 += pb.y1;
+            r.x2 += pb.x1;
+            r.y2 += pb.y1;
             
             // Ignore stroke if it isn't in the eraser rect
             if(!rects_intersect(&eraserRect, expand_rect(&r, s->style.thickness)))
                 continue;
+            ++rasterized;
             
             if(!sr)
             {
@@ -420,7 +1313,7 @@ static void eraser_input(NotedCanvas *self, NCInputState state, float x, float y
             
             // Draw the stroke, offset by the position of the eraser
             // Half alpha
-            cairo_translate(cr, p->bounds.x1, p->bounds.y1);
+            cairo_translate(cr, pb.x1, pb.y1);
             cairo_set_line_width(cr, s->style.thickness);
             draw_stroke(cr, s, 1);
             
@@ -441,10 +1334,17 @@ static void eraser_input(NotedCanvas *self, NCInputState state, float x, float y
             {
                 if(data[k] == 0xFF)
                 {
+                    ++erased;
                     clear_redos(self);
+                    bool wasSelected = s->selected;
                     array_remove(p->strokes, j, true);
-                    if(self->invalidateCallback)
-                        self->invalidateCallback(self, &r, self->callbackData);
+                    invalidate(self, &r);
+                    if(wasSelected)
+                    {
+                        invalidate_selection(self);
+                        --self->nselected;
+                        selection_update_bounds(self);
+                    }
                     --j;
                     --nstrokes;
                     break;
@@ -467,17 +1367,337 @@ static void eraser_input(NotedCanvas *self, NCInputState state, float x, float y
         cairo_destroy(cr);
     if(sr)
         cairo_surface_destroy(sr);
+    stats_end_erase(self, start, candidates, rasterized, erased);
+}
+
+// The select tool draws a lasso (or box), and selects what's
+// inside it on tool up.
+static void select_input(NotedCanvas *self, NCInputState state, float x, float y)
+{
+    if(drag_selection(self, state, x, y))
+        return;
+    
+    if(state == kNCToolDown)
+    {
+        noted_canvas_clear_selection(self);
+        
+        array_free(self->lassoX);
+        array_free(self->lassoY);
+        self->lassoX = array_new(sizeof(float), NULL);
+        self->lassoY = array_new(sizeof(float), NULL);
+    }
+    
+    if(!self->lassoX)
+        return;
+    
+    // Boxes only need their corners
+    if(self->selectMode == kNCSelectBox && array_size(self->lassoX) == 2)
+    {
+        invalidate_selection(self);
+        array_shrink(self->lassoX, 1, false);
+        array_shrink(self->lassoY, 1, false);
+    }
+    
+    self->lassoX = array_append(self->lassoX, &x);
+    self->lassoY = array_append(self->lassoY, &y);
+    
+    if(state != kNCToolUp)
+    {
+        invalidate_selection(self);
+        return;
+    }
+    
+    invalidate_selection(self);
+    
+    if(self->selectMode == kNCSelectBox)
+    {
+        float x0 = self->lassoX[0], y0 = self->lassoY[0];
+        float bx[4] = {x0, x, x, x0};
+        float by[4] = {y0, y0, y, y};
+        select_in_polygon(self, bx, by, 4, true);
+    }
+    else
+        select_in_polygon(self, self->lassoX, self->lassoY, array_size(self->lassoX), false);
+    
+    array_free(self->lassoX);
+    array_free(self->lassoY);
+    self->lassoX = self->lassoY = NULL;
+    
+    invalidate_selection(self);
+}
+
+// Going down on the selection moves it, or scales it from the
+// handle at its bottom right corner. While dragging, the move is
+// only a pending transform applied when drawing; the points are
+// rewritten once, on tool up. Returns false if the input isn't
+// part of a drag.
+static bool drag_selection(NotedCanvas *self, NCInputState state, float x, float y)
+{
+    static const float kHandleSize = 0.012;
+    static const float kMinScale = 0.05;
+    
+    if(state == kNCToolDown)
+    {
+        if(self->nselected == 0)
+            return false;
+        
+        NCRect r = self->selectionBounds;
+        NCRect handle = {r.x2 - kHandleSize, r.y2 - kHandleSize, r.x2 + kHandleSize, r.y2 + kHandleSize};
+        if(point_in_rect(&handle, x, y))
+            self->selectDrag = kSelectDragScale;
+        else if(point_in_rect(&r, x, y))
+            self->selectDrag = kSelectDragMove;
+        else
+            return false;
+        
+        self->dragX = x;
+        self->dragY = y;
+        cairo_matrix_init_identity(&self->selectTransform);
+        return true;
+    }
+    
+    if(self->selectDrag == kSelectDragNone)
+        return false;
+    
+    // Only the old and new spots of the selection need redrawing
+    invalidate_selection(self);
+    
+    if(self->selectDrag == kSelectDragMove)
+        cairo_matrix_init_translate(&self->selectTransform, x - self->dragX, y - self->dragY);
+    else
+    {
+        // Scale uniformly about the top left corner
+        NCRect r = self->selectionBounds;
+        float sx = (self->dragX - r.x1 > 0) ? (x - r.x1) / (self->dragX - r.x1) : 1;
+        float sy = (self->dragY - r.y1 > 0) ? (y - r.y1) / (self->dragY - r.y1) : 1;
+        float scale = fmaxf(fmaxf(sx, sy), kMinScale);
+        cairo_matrix_init(&self->selectTransform, scale, 0, 0, scale, r.x1 * (1 - scale), r.y1 * (1 - scale));
+    }
+    
+    invalidate_selection(self);
+    
+    if(state == kNCToolUp)
+    {
+        mark_changed(self, &self->selectionBounds);
+        selection_apply_transform(self, &self->selectTransform);
+        mark_changed(self, &self->selectionBounds);
+        self->selectDrag = kSelectDragNone;
+        invalidate_selection(self);
+        
+        save_changes(self);
+    }
+    
+    return true;
+}
+
+// Selection bounds, with the pending transform if dragging
+NCRect selection_rect(NotedCanvas *self)
+{
+    NCRect r = self->selectionBounds;
+    if(self->selectDrag == kSelectDragNone)
+        return r;
+    
+    double x[4] = {r.x1, r.x2, r.x2, r.x1}, y[4] = {r.y1, r.y1, r.y2, r.y2};
+    for(int i = 0; i < 4; ++i)
+        cairo_matrix_transform_point(&self->selectTransform, &x[i], &y[i]);
+    
+    NCRect t = {x[0], y[0], x[0], y[0]};
+    for(int i = 1; i < 4; ++i)
+        rect_expand_by_point(&t, x[i], y[i]);
+    return t;
+}
+
+static void draw_transformed_selection(NotedCanvas *self, cairo_t *cr, NCRect *clipRect, float magnification)
+{
+    NCRect sel = selection_rect(self);
+    if(!rects_intersect(clipRect, &sel))
+        return;
+    
+    cairo_save(cr);
+    cairo_transform(cr, &self->selectTransform);
+    for(Page *p = pages_first(self); p; p = page_next(p))
+    {
+        NCRect pb = page_rect(p);
+        draw_selected_strokes(cr, p, &pb, magnification);
+    }
+    cairo_restore(cr);
+}
+
+void draw_selected_strokes(cairo_t *cr, Page *p, const NCRect *pb, float magnification)
+{
+    cairo_save(cr);
+    cairo_translate(cr, pb->x1, pb->y1);
+    
+    size_t nstrokes = array_size(p->strokes);
+    for(size_t j = 0; j < nstrokes; ++j)
+    {
+        Stroke *s = &p->strokes[j];
+        if(!s->selected)
+            continue;
+        
+        cairo_set_line_width(cr, s->style.thickness);
+        cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+        draw_stroke(cr, s, magnification);
+    }
+    
+    cairo_restore(cr);
+}
+
+// Redraws the selection's bounds, and the lasso if one is being
+// drawn. Selecting doesn't change the pages, so it's up to
+// whatever changes the selected strokes to mark them.
+static void invalidate_selection(NotedCanvas *self)
+{
+    // Selection outlines are drawn about this far out
+    static const float kPad = 0.004;
+    
+    if(self->lassoX && array_size(self->lassoX) > 0)
+    {
+        NCRect r = {self->lassoX[0], self->lassoY[0], self->lassoX[0], self->lassoY[0]};
+        size_t n = array_size(self->lassoX);
+        for(size_t i = 1; i < n; ++i)
+            rect_expand_by_point(&r, self->lassoX[i], self->lassoY[i]);
+        redraw(self, expand_rect(&r, kPad));
+    }
+    
+    if(self->nselected > 0)
+    {
+        NCRect r = selection_rect(self);
+        redraw(self, expand_rect(&r, kPad));
+    }
+}
+
+static void draw_selection(NotedCanvas *self, cairo_t *cr)
+{
+    size_t nlasso = self->lassoX ? array_size(self->lassoX) : 0;
+    NCRect r = selection_rect(self);
+    draw_selection_outline(cr, self->lassoX, self->lassoY, nlasso, self->selectMode, (self->nselected > 0) ? &r : NULL);
+}
+
+void draw_selection_outline(cairo_t *cr, const float *lassoX, const float *lassoY, size_t nlasso, NCSelectMode mode, const NCRect *selection)
+{
+    static const double kDash[] = {0.004, 0.004};
+    static const float kPad = 0.002;
+    static const float kHandle = 0.008;
+    
+    if(nlasso == 0 && !selection)
+        return;
+    
+    cairo_save(cr);
+    cairo_set_source_rgba(cr, 0.2, 0.4, 0.9, 0.8);
+    cairo_set_line_width(cr, 1.f/600.f);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_BUTT);
+    cairo_set_dash(cr, kDash, 2, 0);
+    cairo_new_path(cr);
+    
+    if(nlasso > 0)
+    {
+        if(mode == kNCSelectBox)
+        {
+            float x0 = lassoX[0], y0 = lassoY[0];
+            cairo_rectangle(cr, x0, y0, lassoX[nlasso - 1] - x0, lassoY[nlasso - 1] - y0);
+        }
+        else
+        {
+            cairo_move_to(cr, lassoX[0], lassoY[0]);
+            for(size_t i = 1; i < nlasso; ++i)
+                cairo_line_to(cr, lassoX[i], lassoY[i]);
+            cairo_close_path(cr);
+        }
+    }
+    
+    if(selection)
+    {
+        NCRect r = *selection;
+        expand_rect(&r, kPad);
+        cairo_rectangle(cr, r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1);
+    }
+    
+    cairo_stroke(cr);
+    
+    // Scale handle
+    if(selection)
+    {
+        const NCRect *r = selection;
+        cairo_set_dash(cr, NULL, 0, 0);
+        cairo_rectangle(cr, r->x2 - kHandle / 2, r->y2 - kHandle / 2, kHandle, kHandle);
+        cairo_fill(cr);
+    }
+    cairo_restore(cr);
+}
+
+void draw_page_content(cairo_t *cr, NotedCanvas *canvas, Page *p, const NCRect *pb, const NCRect *clip,
+                       float magnification, Stroke *current, bool wetInk, bool dragging, DrawCounts *counts)
+{
+    NCRect relClip = {clip->x1 - pb->x1, clip->y1 - pb->y1, clip->x2 - pb->x1, clip->y2 - pb->y1};
+    
+    cairo_save(cr);
+    cairo_translate(cr, pb->x1, pb->y1);
+    
+    draw_images(cr, canvas, p, &relClip, magnification);
+    draw_texts(cr, p, &relClip);
+    
+    size_t nstrokes = array_size(p->strokes);
+    for(unsigned long j = 0; j < nstrokes; ++j)
+    {
+        Stroke *s = &p->strokes[j];
+        
+        // The stroke in progress is on the wet ink overlay instead
+        if(s == current && wetInk)
+            continue;
+        
+        // Selected strokes being dragged are drawn afterwards
+        if(s->selected && dragging)
+            continue;
+        
+        // Expand the rect by width of stroke, so that the intersection
+        // calculation includes the outside edge of the stroke.
+        NCRect r = s->bounds;
+        if(!rects_intersect(&relClip, expand_rect(&r, s->style.thickness)))
+        {
+            ++counts->culled;
+            continue;
+        }
+        ++counts->drawn;
+        counts->points += array_size(s->x);
+        
+        if(s == current)
+        {
+            draw_current_stroke(cr, s, magnification);
+            continue;
+        }
+        cairo_set_line_width(cr, s->style.thickness);
+        cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+        draw_stroke(cr, s, magnification);
+    }
+    
+    cairo_restore(cr);
 }
 
-static void draw_page(cairo_t *cr, Page *p)
+void draw_current_stroke(cairo_t *cr, Stroke *s, float magnification)
+{
+    cairo_set_line_width(cr, s->style.thickness);
+    cairo_set_source_rgba(cr, s->style.r / 255.f, s->style.g / 255.f, s->style.b / 255.f, s->style.a / 255.f);
+    if(s->p)
+        draw_stroke_segments(cr, s, 0);
+    else
+        draw_stroke(cr, s, magnification);
+}
+
+void draw_page(cairo_t *cr, Page *p, NCRect *pb, float magnification)
 {
     // Clear background
     cairo_new_path(cr);
     cairo_set_source_rgba(cr, 1, 1, 1, 1);
-    cairo_rectangle(cr, p->bounds.x1, p->bounds.y1, p->bounds.x2 - p->bounds.x1, p->bounds.y2 - p->bounds.y1);
+    cairo_rectangle(cr, pb->x1, pb->y1, pb->x2 - pb->x1, pb->y2 - pb->y1);
     cairo_fill(cr);
     
     // Background pattern
+    if(p->pattern == kNCPagePDF)
+    {
+        draw_background(cr, p, pb, magnification);
+        return;
+    }
     if(p->pattern == kNCPageBlank)
         return;
     
@@ -487,8 +1707,8 @@ static void draw_page(cairo_t *cr, Page *p)
     cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.1);
     cairo_set_line_width(cr, 1.f/600.f);
     
-    float w = p->bounds.x2 - p->bounds.x1 - kHBorderPad - kHBorderPad;
-    float h = p->bounds.y2 - p->bounds.y1 - kVBorderPad - kVBorderPad;
+    float w = pb->x2 - pb->x1 - kHBorderPad - kHBorderPad;
+    float h = pb->y2 - pb->y1 - kVBorderPad - kVBorderPad;
     
     switch(p->pattern)
     {
@@ -497,14 +1717,14 @@ static void draw_page(cairo_t *cr, Page *p)
             float size = (1.f / p->density) * w;
             unsigned int vdensity = floor((h / w) * p->density);
             h = size * vdensity;
-            float vpad = ((p->bounds.y2 - p->bounds.y1) - h) / 2;
+            float vpad = ((pb->y2 - pb->y1) - h) / 2;
             
             // Draw vertical lines at user's density
             for(int i = 0; i <= p->density; ++i)
             {
                 float f = size * i;
-                cairo_move_to(cr, p->bounds.x1 + kHBorderPad + f, p->bounds.y1 + vpad);
-                cairo_line_to(cr, p->bounds.x1 + kHBorderPad + f, p->bounds.y2 - vpad);
+                cairo_move_to(cr, pb->x1 + kHBorderPad + f, pb->y1 + vpad);
+                cairo_line_to(cr, pb->x1 + kHBorderPad + f, pb->y2 - vpad);
             }
             
             // Draw horizontal lines such that they're exactly the same
@@ -512,8 +1732,8 @@ static void draw_page(cairo_t *cr, Page *p)
             for(int i = 0; i <= vdensity; ++i)
             {
                 float f = size * i;
-                cairo_move_to(cr, p->bounds.x1 + kHBorderPad, p->bounds.y1 + vpad + f);
-                cairo_line_to(cr, p->bounds.x2 - kHBorderPad, p->bounds.y1 + vpad + f);
+                cairo_move_to(cr, pb->x1 + kHBorderPad, pb->y1 + vpad + f);
+                cairo_line_to(cr, pb->x2 - kHBorderPad, pb->y1 + vpad + f);
             }
             
             cairo_stroke(cr);
@@ -526,8 +1746,8 @@ static void draw_page(cairo_t *cr, Page *p)
             for(int i = 0; i <= p->density; ++i)
             {
                 float f = size * i;
-                cairo_move_to(cr, p->bounds.x1 + kHBorderPad, p->bounds.y1 + kVBorderPad + f);
-                cairo_line_to(cr, p->bounds.x2 - kHBorderPad, p->bounds.y1 + kVBorderPad + f);
+                cairo_move_to(cr, pb->x1 + kHBorderPad, pb->y1 + kVBorderPad + f);
+                cairo_line_to(cr, pb->x2 - kHBorderPad, pb->y1 + kVBorderPad + f);
             }
             
             cairo_stroke(cr);
@@ -535,16 +1755,71 @@ static void draw_page(cairo_t *cr, Page *p)
         }
             
         case kNCPageBlank:
+        case kNCPagePDF:
             break;
     }
 }
 
+// Draws the stroke from point first on as plain line segments,
+// following pressure if it varies enough to once the stroke is
+// done. Used for the stroke in progress, which doesn't have its
+// curves or outline yet.
+static void draw_stroke_segments(cairo_t *cr, Stroke *s, size_t first)
+{
+    size_t npoints = array_size(s->x);
+    bool pressure = stroke_varies_pressure(s);
+    
+    if(first + 1 == npoints)
+    {
+        // Single dot
+        cairo_set_line_width(cr, pressure ? stroke_width_at(s, first) : s->style.thickness);
+        cairo_new_path(cr);
+        cairo_move_to(cr, s->x[first], s->y[first]);
+        cairo_line_to(cr, s->x[first], s->y[first]);
+        cairo_stroke(cr);
+    }
+    else if(!pressure)
+    {
+        cairo_set_line_width(cr, s->style.thickness);
+        cairo_new_path(cr);
+        cairo_move_to(cr, s->x[first], s->y[first]);
+        for(size_t i = first + 1; i < npoints; ++i)
+            cairo_line_to(cr, s->x[i], s->y[i]);
+        cairo_stroke(cr);
+    }
+    else
+    {
+        // Pressure changes the width per segment
+        for(size_t i = first + 1; i < npoints; ++i)
+        {
+            cairo_set_line_width(cr, (stroke_width_at(s, i - 1) + stroke_width_at(s, i)) / 2);
+            cairo_new_path(cr);
+            cairo_move_to(cr, s->x[i - 1], s->y[i - 1]);
+            cairo_line_to(cr, s->x[i], s->y[i]);
+            cairo_stroke(cr);
+        }
+    }
+}
+
 // Draws in page-relative coordinates, so a call to
 // cairo_translate before this might be useful.
-static void draw_stroke(cairo_t *cr, Stroke *s, float magnification)
+void draw_stroke(cairo_t *cr, Stroke *s, float magnification)
 {
     static const double kMinBezierDist = 2.0; // "device coordinates" (pixels)
 
+    // Variable width strokes are filled from their cached outline
+    if(s->outline)
+    {
+        size_t n = array_size(s->outline);
+        cairo_new_path(cr);
+        cairo_move_to(cr, s->outline[0], s->outline[1]);
+        for(size_t j = 2; j < n; j += 2)
+            cairo_line_to(cr, s->outline[j], s->outline[j + 1]);
+        cairo_close_path(cr);
+        cairo_fill(cr);
+        return;
+    }
+    
     cairo_new_path(cr);
     cairo_move_to(cr, s->x[0], s->y[0]);
     
@@ -580,104 +1855,156 @@ static void append_page(NotedCanvas *self)
     NCPagePattern pattern = kNCPageGrided;
     unsigned int density = 24;
     
-    NCRect b = {0};
-    if(array_size(self->pages) > 0)
+    size_t npages = pages_count(self);
+    if(npages > 0)
     {
-        Page *prev = &self->pages[array_size(self->pages) - 1];
-        b = prev->bounds;
-        b.y2 += 0.01;
+        Page *prev = pages_get(self, npages - 1);
         
         // Copy pattern from last page
         pattern = prev->pattern;
         density = prev->density;
     }
     
-    Page p = {
-        .bounds = {0, b.y2, 1, b.y2 + 11/8.5f},
-        .density = density,
-        .pattern = pattern,
-        .strokes = array_new(sizeof(Stroke), (FreeNotify)free_stroke)
-    };
-    self->pages = array_append(self->pages, &p);
+    Page *p = page_new(1, 11/8.5f, pattern, density);
+    pages_insert(self, npages, p);
     
     if(self->invalidateCallback)
-    {
         self->invalidateCallback(self, NULL, self->callbackData);
-        self->invalidateCallback(self, &p.bounds, self->callbackData);
-    }
+    NCRect r = page_rect(p);
+    invalidate(self, &r);
 }
 
 
-// Matches bezier curves to the given points. This function takes
-// only one dimension of the points at a time, so this function
-// should be called twice: once to calculate x control points,
-// again to calculate y. cp1 and cp2 are outputs, and should each
-// be allocated with at least n-1 elements.
-// Code converted from the SVG + JavaScript demo found here:
-// https://www.particleincell.com/2012/bezier-splines/
-static void calculate_control_points(float *p, int n, float *cp1, float *cp2)
+// Seconds from a monotonic clock. On macOS, this is the same
+// clock as NSEvent timestamps.
+static double current_time(void)
 {
-    --n;
-    
-    // rhs vector
-    float a[n], b[n], c[n], r[n];
-    
-    // left most segment
-    a[0] = 0;
-    b[0] = 2;
-    c[0] = 1;
-    r[0] = p[0] + (2 * p[1]);
-    
-    // internal segments
-    for (int i = 1; i < n - 1; ++i)
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if(timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1e9;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+// Has the pages that changed rendered again, then saves. Canvases
+// are saved after every change.
+static void save_changes(NotedCanvas *self)
+{
+    thumbnails_update(self);
+    if(self->path && !noted_canvas_save(self, self->path))
+        printf("error saving to %s\n", self->path);
+}
+
+static void clear_redos(NotedCanvas *self)
+{
+//    for(unsigned long i = self->lastStroke; i < self->numStrokes; ++i)
+//        free_stroke(&self->strokes[i]);
+//    self->numStrokes = self->lastStroke;
+}
+
+// Requests a redraw of r, where the pages changed
+static void invalidate(NotedCanvas *self, NCRect *r)
+{
+    mark_changed(self, r);
+    redraw(self, r);
+}
+
+// Marks the pages under r as changed, for their thumbnails and
+// snapshots, without a redraw
+static void mark_changed(NotedCanvas *self, NCRect *r)
+{
+    thumbnails_mark(self, r);
+    snapshot_mark(self, r);
+}
+
+// Requests a redraw of r, where pages only moved or an overlay
+// changed, so their thumbnails still hold. While handling input
+// (or with deferred damage), r is merged into the damage region
+// and sent later.
+static void redraw(NotedCanvas *self, NCRect *r)
+{
+    if(self->inputDepth > 0 || self->deferDamage)
     {
-        a[i] = 1;
-        b[i] = 4;
-        c[i] = 1;
-        r[i] = 4 * p[i] + 2 * p[i+1];
+        add_damage(self, *r);
+        return;
     }
     
-    // right segment
-    a[n-1] = 2;
-    b[n-1] = 7;
-    c[n-1] = 0;
-    r[n-1] = 8 * p[n-1] + p[n];
+    if(self->invalidateCallback)
+        self->invalidateCallback(self, r, self->callbackData);
+}
+
+// Adds r to the damage region, keeping the region's rects from
+// overlapping by merging any that r touches into it.
+static void add_damage(NotedCanvas *self, NCRect r)
+{
+    if(!self->damage)
+        self->damage = array_new(sizeof(NCRect), NULL);
     
-    // solves Ax=b with the Thomas algorithm (from Wikipedia)
-    for (int i = 1; i < n; ++i)
+    size_t n = array_size(self->damage);
+    for(size_t i = 0; i < n;)
     {
-        float m = a[i] / b[i-1];
-        b[i] = b[i] - m * c[i - 1];
-        r[i] = r[i] - m * r[i-1];
+        if(rects_intersect(&r, &self->damage[i]))
+        {
+            // The merged rect may now overlap rects that were
+            // already checked, so start over.
+            union_rect(&r, &self->damage[i]);
+            array_remove(self->damage, i, false);
+            --n;
+            i = 0;
+        }
+        else
+            ++i;
     }
     
-    cp1[n-1] = r[n-1] / b[n-1];
-    for (int i = n - 2; i >= 0; --i)
-        cp1[i] = (r[i] - c[i] * cp1[i+1]) / b[i];
-    
-    // we have cp1, now compute cp2
-    for (int i = 0; i < n-1; i++)
-        cp2[i] = (2 * p[i+1]) - cp1[i+1];
+    if(n >= kMaxDamageRects)
+    {
+        // Too many rects. Merge r into the one it grows the least.
+        size_t best = 0;
+        float bestGrowth = INFINITY;
+        for(size_t i = 0; i < n; ++i)
+        {
+            NCRect u = r;
+            union_rect(&u, &self->damage[i]);
+            float growth = rect_area(&u) - rect_area(&self->damage[i]);
+            if(growth < bestGrowth)
+            {
+                bestGrowth = growth;
+                best = i;
+            }
+        }
+        
+        union_rect(&r, &self->damage[best]);
+        array_remove(self->damage, best, false);
+        add_damage(self, r);
+        return;
+    }
     
-    cp2[n-1] = 0.5 * (p[n] + cp1[n-1]);
-}
-
-static void clear_redos(NotedCanvas *self)
-{
-//    for(unsigned long i = self->lastStroke; i < self->numStrokes; ++i)
-//        free_stroke(&self->strokes[i]);
-//    self->numStrokes = self->lastStroke;
+    self->damage = array_append(self->damage, &r);
 }
 
 void free_stroke(Stroke *s)
 {
+    stroke_unshare(s);
     array_free(s->x);
     array_free(s->y);
+    array_free(s->p);
+    array_free(s->outline);
 }
 
 void free_page(Page *p)
 {
     array_free(p->strokes);
+    array_free(p->images);
+    array_free(p->texts);
+    thumbnail_release(p->thumb);
+    page_background_release(p->background);
+    page_view_release(p->view);
+    free(p);
 }
 
 static inline NCRect * expand_rect(NCRect *a, float amount)
@@ -699,8 +2026,14 @@ static inline bool point_in_rect(NCRect *r, float x, float y)
     return x > r->x1 && x < r->x2 && y > r->y1 && y < r->y2;
 }
 
+static inline NCRect * union_rect(NCRect *a, NCRect *b)
+{
+    rect_expand_by_point(a, b->x1, b->y1);
+    rect_expand_by_point(a, b->x2, b->y2);
+    return a;
+}
 
-//    clock_t begin = clock();
-//    clock_t end = clock();
-//    double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-//    printf("time: %li, %fs\n", end-begin, time_spent);
+static inline float rect_area(NCRect *r)
+{
+    return (r->x2 - r->x1) * (r->y2 - r->y1);
+}
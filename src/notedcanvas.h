@@ -11,6 +11,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <cairo/cairo.h>
 
 
@@ -41,13 +42,169 @@ typedef enum
     kNCSelectTool,
 } NCInputTool;
 
+typedef enum
+{
+    kNCSelectLasso,
+    kNCSelectBox,
+} NCSelectMode;
+
+typedef struct
+{
+    NCInputState state;
+    float x, y;
+    float pressure;
+    double timestamp; // Seconds, monotonic (NSEvent's clock on macOS), or 0 for now
+} NCInputSample;
+
+typedef struct
+{
+    float horizon; // Configured horizon, in seconds
+    float meanHorizon; // Average time actually predicted ahead
+    unsigned long tails; // Number of tails predicted
+    unsigned long samples; // Predictions checked against a real sample
+    float meanError, maxError; // Distance from those samples, canvas units
+} NCPredictionStats;
+
+/*
+ * Operations timed by the canvas's counters (see
+ * noted_canvas_get_stats)
+ */
+typedef enum
+{
+    kNCStatDraw, // noted_canvas_draw
+    kNCStatInput, // Each input sample, batched or not
+    kNCStatErase, // Each eraser sample, part of its input
+    kNCStatOpen,
+    kNCStatSave,
+    kNCStatCount,
+} NCStatOp;
+
+// Bucket i of a latency histogram counts calls that took from
+// 2^i to 2^(i+1) microseconds; the first also counts faster
+// calls and the last slower ones
+enum { kNCStatBuckets = 20 };
+
+typedef struct
+{
+    unsigned long count;
+    double totalTime, maxTime; // Seconds
+    unsigned long histogram[kNCStatBuckets];
+} NCOpStats;
+
+typedef struct
+{
+    NCOpStats ops[kNCStatCount];
+    unsigned long strokesDrawn, strokesCulled; // By the draw clip
+    unsigned long pointsDrawn; // Of the strokes drawn
+    unsigned long eraseCandidates; // Strokes checked against the eraser
+    unsigned long eraseRasterizations; // Of those, the ones drawn to test for a hit
+    unsigned long strokesErased;
+} NCStats;
+
+/*
+ * Kinds of memory a canvas uses (see noted_canvas_get_memory)
+ */
+typedef enum
+{
+    kNCMemoryPoints, // Stroke points, pressures and outlines
+    kNCMemoryStrokes, // Stroke headers, in their pages' stroke arrays
+    kNCMemoryPages, // Pages, their images and text as saved, and the canvas itself
+    kNCMemoryCaches, // Decoded images, PDF rasters, thumbnails, shaped text and the save buffer
+    kNCMemoryCount,
+} NCMemoryKind;
+
+typedef struct
+{
+    size_t live[kNCMemoryCount]; // Bytes allocated
+    size_t slack[kNCMemoryCount]; // Of those, bytes unused that noted_canvas_trim gives back
+    size_t stack; // Most stack that drawing one of the strokes takes
+} NCMemoryStats;
+
+/*
+ * What an event in an input recording is (see
+ * noted_canvas_record_input)
+ */
+typedef enum
+{
+    kNCRecordInput, // A noted_canvas_input or noted_canvas_input_batch call
+    kNCRecordStyle, // noted_canvas_set_stroke_style
+    kNCRecordSelectMode, // noted_canvas_set_select_mode
+    kNCRecordSimplify, // noted_canvas_set_simplify_tolerance
+    kNCRecordPrediction, // noted_canvas_set_prediction
+} NCRecordKind;
+
+typedef struct
+{
+    NCRecordKind kind;
+    double time; // Seconds since the recording's first input
+    NCInputTool tool; // Input
+    const NCInputSample *samples; // Input, valid until the next read, with timestamps like time
+    size_t nsamples;
+    bool batch; // Input was a noted_canvas_input_batch call
+    NCStrokeStyle style; // Style
+    NCSelectMode selectMode; // Select mode
+    float value; // Simplify tolerance or prediction horizon
+} NCRecordEvent;
+
+/*
+ * An input recording open for reading. See noted_recording_open.
+ */
+typedef struct NCRecording_ NCRecording;
+
 typedef enum
 {
     kNCPageBlank,
     kNCPageRuled,
     kNCPageGrided,
+    kNCPagePDF, // A page of a PDF (see noted_canvas_import_pdf)
 } NCPagePattern;
 
+/*
+ * A text box, by the page it's on and its place among that
+ * page's text boxes
+ */
+typedef struct
+{
+    size_t page;
+    size_t index;
+} NCTextRef;
+
+/*
+ * A page as described by noted_canvas_peek
+ */
+typedef struct
+{
+    float width, height;
+    NCPagePattern pattern;
+    unsigned int density;
+    unsigned long nstrokes;
+    bool hasThumbnail; // See noted_file_get_thumbnail
+} NCPageInfo;
+
+/*
+ * A notebook file as described by noted_canvas_peek
+ */
+typedef struct
+{
+    size_t npages;
+    NCPageInfo *pages;
+    unsigned long nstrokes; // On all pages
+    int64_t modified; // Nanoseconds since the epoch
+    int64_t size; // Of the file, in bytes
+} NCFileInfo;
+
+/*
+ * A cache of noted_canvas_peek results for the notebooks in a
+ * directory. See noted_dir_cache_open.
+ */
+typedef struct NCDirCache NCDirCache;
+
+/*
+ * The canvas as it was at one moment, for drawing on another
+ * thread. See noted_canvas_snapshot.
+ */
+typedef struct NCSnapshot_ NCSnapshot;
+
 /*
  * Called when a region of the canvas has been invalidated
  * or other properties changed. If rect is non-null, the
@@ -57,6 +214,36 @@ typedef enum
  */
 typedef void (*NCInvalidateCallback)(NotedCanvas *canvas, NCRect *rect, void *data);
 
+/*
+ * Called when the wet ink overlay should be updated. If rect
+ * is non-null, new segments of the stroke in progress are
+ * ready to be drawn with noted_canvas_draw_wet_ink within rect.
+ * If rect is null, the stroke was committed to the canvas and
+ * the overlay should be cleared.
+ */
+typedef void (*NCWetInkCallback)(NotedCanvas *canvas, NCRect *rect, void *data);
+
+/*
+ * Called when page thumbnails have been rendered, so the
+ * overview (see noted_canvas_draw_overview) should be redrawn.
+ * Called on the thumbnail thread, not the canvas's.
+ */
+typedef void (*NCThumbnailCallback)(NotedCanvas *canvas, void *data);
+
+/*
+ * Called when images drawn from a stand-in size have been
+ * decoded at the size they're shown at, so the canvas should be
+ * redrawn. Called on the image thread, not the canvas's.
+ */
+typedef void (*NCImageCallback)(NotedCanvas *canvas, void *data);
+
+/*
+ * Called by PDF export after each page is written, with the
+ * number of pages done so far out of npages. Return false to
+ * cancel the export.
+ */
+typedef bool (*NCExportCallback)(size_t done, size_t npages, void *data);
+
 
 /*
  * Create a new blank canvas at the given path.
@@ -68,6 +255,53 @@ NotedCanvas * noted_canvas_new(const char *path);
  */
 NotedCanvas * noted_canvas_open(const char *path);
 
+/*
+ * Open a canvas from a file, decoding its pages on up to
+ * nthreads threads at once, or one per core if nthreads is 0
+ * (which is what noted_canvas_open does). Only files in the
+ * current format are decoded in parallel; older ones are read
+ * as before. Returns NULL on failure.
+ */
+NotedCanvas * noted_canvas_open_with_threads(const char *path, unsigned int nthreads);
+
+/*
+ * Describe a notebook file without opening it: its pages'
+ * sizes, patterns and stroke counts come from the header and
+ * page table, and no strokes are read. Returns NULL on failure;
+ * the result is a single allocation to free with free().
+ */
+NCFileInfo * noted_canvas_peek(const char *path);
+
+/*
+ * Open the peek cache for a directory. Results are kept in a
+ * hidden file in the directory between runs, and each one is
+ * checked against its notebook's modified time and size, so
+ * only notebooks that changed get peeked again. Never fails;
+ * a missing or unreadable cache file starts an empty cache.
+ */
+NCDirCache * noted_dir_cache_open(const char *dir);
+
+/*
+ * Describe the notebook called name in the cache's directory,
+ * like noted_canvas_peek. The result belongs to the cache and
+ * is valid until name is peeked again or the cache is closed.
+ * Returns NULL if name isn't a readable notebook.
+ */
+const NCFileInfo * noted_dir_cache_peek(NCDirCache *cache, const char *name);
+
+/*
+ * Write the cache back to its directory if anything changed,
+ * and free it. Returns false if writing failed.
+ */
+bool noted_dir_cache_close(NCDirCache *cache);
+
+/*
+ * Reads the thumbnail saved for the page at index of the
+ * notebook at path, without opening the notebook. Returns NULL
+ * if the page has none. Free with cairo_surface_destroy.
+ */
+cairo_surface_t * noted_file_get_thumbnail(const char *path, size_t index);
+
 /*
  * Destroy canvas.
  */
@@ -91,6 +325,170 @@ void noted_canvas_set_invalidate_callback(NotedCanvas *canvas, NCInvalidateCallb
  */
 void noted_canvas_draw(NotedCanvas *canvas, cairo_t *cr, float magnification);
 
+/*
+ * Takes a snapshot of the canvas, to draw on another thread
+ * while input goes on changing the canvas. Pages are copied
+ * once and shared by every snapshot until they change, so a
+ * snapshot only copies the pages that changed since the last
+ * one. Call on the thread that handles input. The snapshot
+ * doesn't change or need the canvas after, so it can be drawn,
+ * retained and released on any thread, even once the canvas is
+ * destroyed, and never waits on input. Old copies are freed with
+ * the last snapshot that has them.
+ */
+NCSnapshot * noted_canvas_snapshot(NotedCanvas *canvas);
+NCSnapshot * noted_snapshot_retain(NCSnapshot *snapshot);
+void noted_snapshot_release(NCSnapshot *snapshot);
+
+/*
+ * Draws the snapshot like noted_canvas_draw draws the canvas,
+ * except that images not yet decoded at the size needed are
+ * decoded here, instead of on the canvas's image thread.
+ */
+void noted_snapshot_draw(NCSnapshot *snapshot, cairo_t *cr, float magnification);
+
+/*
+ * Same as noted_canvas_get_height, when the snapshot was taken.
+ */
+float noted_snapshot_get_height(NCSnapshot *snapshot);
+
+/*
+ * Turns on the wet ink layer, or off if callback is NULL.
+ * While on, the stroke being drawn is left out of
+ * noted_canvas_draw and the damage region. Instead, only
+ * its newest segments are drawn onto a separate overlay
+ * (see noted_canvas_draw_wet_ink), so each pen sample
+ * doesn't redraw the page and strokes underneath it. On
+ * tool up, the stroke is invalidated as a whole and drawn
+ * normally from then on.
+ */
+void noted_canvas_set_wet_ink_callback(NotedCanvas *canvas, NCWetInkCallback callback, void *data);
+
+/*
+ * Draws the n pages from index as a grid of thumbnails, columns
+ * wide, in cells cellWidth wide and as tall as the tallest of
+ * the pages needs. The grid's top left is at 0, 0.
+ *
+ * Thumbnails are rendered in the background after pages change
+ * (and are saved with them), so this never draws a page itself.
+ * Pages are drawn blank until their thumbnail is ready, and
+ * changed pages show their old thumbnail until the new one is.
+ */
+void noted_canvas_draw_overview(NotedCanvas *canvas, cairo_t *cr, size_t index, size_t n, unsigned int columns, float cellWidth);
+
+/*
+ * Sets the callback for when thumbnails are ready. See
+ * NCThumbnailCallback.
+ */
+void noted_canvas_set_thumbnail_callback(NotedCanvas *canvas, NCThumbnailCallback callback, void *data);
+
+/*
+ * Sets the callback for images decoded in the background (see
+ * NCImageCallback). With one set, noted_canvas_draw never waits
+ * on an image: images not yet decoded at the size they're drawn
+ * at are drawn from the nearest size that is, and decoded on a
+ * thread of their own. Without one, they're decoded as they're
+ * drawn, which is what offline rendering wants.
+ */
+void noted_canvas_set_image_callback(NotedCanvas *canvas, NCImageCallback callback, void *data);
+
+/*
+ * Draws the segments of the stroke in progress that haven't
+ * been drawn yet onto an overlay with the same transformation
+ * as noted_canvas_draw. The overlay should keep its contents
+ * between calls. If it lost them, set redrawAll = true to
+ * draw the whole stroke in progress again.
+ */
+void noted_canvas_draw_wet_ink(NotedCanvas *canvas, cairo_t *cr, bool redrawAll);
+
+/*
+ * Turns on pen prediction, or off for horizon = 0. While
+ * drawing, a provisional tail is extrapolated up to horizon
+ * seconds ahead from the pen's recent velocity and pressure,
+ * and replaced on the next sample. This hides some of the
+ * time between the pen moving and the frame presenting,
+ * including the lag from the canvas's stroke stabilization.
+ * Resets the prediction stats.
+ */
+void noted_canvas_set_prediction(NotedCanvas *canvas, float horizon);
+
+/*
+ * Gets how far ahead, and how accurately, the tails predicted
+ * since the last noted_canvas_set_prediction have been.
+ */
+void noted_canvas_get_prediction_stats(NotedCanvas *canvas, NCPredictionStats *stats);
+
+/*
+ * Gets the canvas's performance counters: how many times, and
+ * how long, it drew, took input, erased, opened and saved, and
+ * what drawing and erasing went through. Set reset to count
+ * from zero again. Counters are only kept when built with
+ * NC_STATS; otherwise stats is zeroed and this returns false.
+ */
+bool noted_canvas_get_stats(NotedCanvas *canvas, NCStats *stats, bool reset);
+
+/*
+ * Writes every canvas's timed operations (see
+ * noted_canvas_get_stats) to path as they happen, in Chrome's
+ * trace event format, for chrome://tracing or Perfetto, until
+ * noted_trace_stop. Returns false if path can't be written, or
+ * when built without NC_STATS.
+ */
+bool noted_trace_start(const char *path);
+void noted_trace_stop(void);
+
+/*
+ * Records every input call made to the canvas, and every
+ * change to the settings that affect input, to path until
+ * noted_canvas_stop_recording or the canvas is destroyed. The
+ * recording starts with the settings as they are now. Returns
+ * false if path can't be written.
+ */
+bool noted_canvas_record_input(NotedCanvas *canvas, const char *path);
+void noted_canvas_stop_recording(NotedCanvas *canvas);
+
+/*
+ * Opens an input recording, or returns NULL if path isn't one.
+ * noted_recording_read gets its events in order, returning
+ * false at the end. Playing them back means making the same
+ * calls on a canvas, adding a start time to the sample
+ * timestamps, since a timestamp of 0 means now.
+ */
+NCRecording * noted_recording_open(const char *path);
+bool noted_recording_read(NCRecording *recording, NCRecordEvent *event);
+void noted_recording_close(NCRecording *recording);
+
+/*
+ * Gets the memory the canvas uses, by kind, and how much of it
+ * is slack: room in arrays beyond what they hold. Images, PDF
+ * pages and shaped text that pages share with copies of them
+ * are counted for each page, and of the caches shared by every
+ * canvas, only what's cached for this canvas's pages is counted.
+ * Allocator overhead isn't counted.
+ */
+void noted_canvas_get_memory(NotedCanvas *canvas, NCMemoryStats *stats);
+
+/*
+ * Same, for the page at index alone. Returns false if there's
+ * no such page.
+ */
+bool noted_canvas_get_page_memory(NotedCanvas *canvas, size_t index, NCMemoryStats *stats);
+
+/*
+ * Gives back slack: shrinks every array to what it holds, and
+ * frees the save buffer until the next save. Caches are left
+ * alone, since they're kept to their own budgets.
+ */
+void noted_canvas_trim(NotedCanvas *canvas);
+
+/*
+ * Draws the predicted tail. noted_canvas_draw already does
+ * this, except when the wet ink layer is on. Then the tail
+ * should be drawn above the overlay, on a layer that is
+ * cleared every frame, since it's thrown away each sample.
+ */
+void noted_canvas_draw_prediction(NotedCanvas *canvas, cairo_t *cr);
+
 /*
  * Call on a mouse/pen/eraser event.
  * x should be in the [0, 1] range,
@@ -98,6 +496,45 @@ void noted_canvas_draw(NotedCanvas *canvas, cairo_t *cr, float magnification);
  */
 void noted_canvas_input(NotedCanvas *canvas, NCInputState state, NCInputTool tool, float x, float y, float pressure);
 
+/*
+ * Call with a run of input samples, such as the coalesced
+ * events a tablet reports between two frames. Behaves like
+ * calling noted_canvas_input on each sample in order, except
+ * that space for the run is reserved up front and damage is
+ * only flushed once the whole run is processed.
+ */
+void noted_canvas_input_batch(NotedCanvas *canvas, NCInputTool tool, const NCInputSample *samples, size_t n);
+
+/*
+ * Rects invalidated while handling input are collected into a
+ * small set of merged, non-overlapping rects, and normally sent
+ * to the invalidate callback once each input call is done.
+ * With defer = true, they are instead held until the next
+ * noted_canvas_flush_damage, so that a frontend can flush once
+ * per frame (e.g. from its display link / frame clock).
+ */
+void noted_canvas_set_defer_damage(NotedCanvas *canvas, bool defer);
+
+/*
+ * Sends every pending damage rect to the invalidate callback.
+ */
+void noted_canvas_flush_damage(NotedCanvas *canvas);
+
+/*
+ * Sets how closely new strokes follow the pen, in canvas
+ * units. Samples closer than tolerance to the previous point
+ * are dropped as they arrive, and on tool up, points within
+ * tolerance of the line through their neighbors are removed.
+ * 0 (the default) keeps every sample.
+ */
+void noted_canvas_set_simplify_tolerance(NotedCanvas *canvas, float tolerance);
+
+/*
+ * Sets whether the select tool draws a freeform lasso (the
+ * default) or a box from where it went down.
+ */
+void noted_canvas_set_select_mode(NotedCanvas *canvas, NCSelectMode mode);
+
 /*
  * Gets the height of the canvas in units relative
  * to the width (which is always 1).
@@ -129,9 +566,9 @@ void noted_canvas_get_page_rect(NotedCanvas *canvas, size_t index, NCRect *rect)
 
 /*
  * Sets the background pattern of a page. Density is how many
- * lines / grid cells per page.
- * TODO: Will probably be replaced by a more generic method
- * when PDF background support comes.
+ * lines / grid cells per page. Setting another pattern on a PDF
+ * page drops its PDF page; kNCPagePDF can only come from
+ * noted_canvas_import_pdf, and is treated as blank here.
  */
 void noted_canvas_set_page_pattern(NotedCanvas *canvas, size_t index, NCPagePattern pattern, unsigned int density);
 
@@ -143,35 +580,169 @@ void noted_canvas_set_page_pattern(NotedCanvas *canvas, size_t index, NCPagePatt
  */
 void noted_canvas_move_page(NotedCanvas *canvas, size_t index, size_t targetIndex);
 
-//void * noted_canvas_page_copy(NotedCanvas *canvas, size_t index);
-//
-//void * noted_canvas_page_cut(NotedCanvas *canvas, size_t index);
-//
-//void noted_canvas_page_paste(NotedCanvas *canvas, size_t index);
+/*
+ * Inserts a blank page before index, like the page before it.
+ * An index past the end appends.
+ */
+void noted_canvas_insert_page(NotedCanvas *canvas, size_t index);
+
+/*
+ * Deletes the page at index and everything on it. The last
+ * remaining page can't be deleted.
+ */
+void noted_canvas_delete_page(NotedCanvas *canvas, size_t index);
+
+/*
+ * Copies the page at index, with all its content. Returns a
+ * self-contained clip of size bytes to free with free(), or
+ * NULL on failure.
+ */
+void * noted_canvas_page_copy(NotedCanvas *canvas, size_t index, size_t *size);
+
+/*
+ * Inserts the pages from a noted_canvas_page_copy clip (possibly
+ * from another canvas) before index. Returns false if content
+ * isn't a valid page clip.
+ */
+bool noted_canvas_page_paste(NotedCanvas *canvas, const void *content, size_t size, size_t index);
+
+/*
+ * Puts an image on the page at y, under the page's strokes,
+ * with its top left at x, y and width wide; its height follows
+ * from its shape. data is a PNG, or a JPEG when built with
+ * NC_HAVE_JPEG (and libjpeg), and is copied and saved as it is.
+ * Returns false if data isn't an image that can be decoded.
+ */
+bool noted_canvas_insert_image(NotedCanvas *canvas, const void *data, size_t size, float x, float y, float width);
+
+/*
+ * Puts a box of text (UTF-8) on the page at y, over the page's
+ * images and under its strokes, in the current stroke color.
+ * Its top left is at x, y and its lines wrap at width; its
+ * height follows from the text. Text is shaped once here and
+ * again only when it or the width is changed, not when it's
+ * drawn. Sets ref to the new box, if not NULL. Returns false if
+ * text is empty.
+ */
+bool noted_canvas_insert_text(NotedCanvas *canvas, const char *text, float x, float y, float width, NCTextRef *ref);
+
+/*
+ * Finds the topmost text box at x, y. Returns false if there
+ * isn't one.
+ */
+bool noted_canvas_text_at(NotedCanvas *canvas, float x, float y, NCTextRef *ref);
+
+/*
+ * Returns the text of a text box, valid until it's changed, and
+ * sets rect to its rect on the canvas if not NULL. Returns NULL
+ * if ref isn't a text box.
+ */
+const char * noted_canvas_get_text(NotedCanvas *canvas, NCTextRef ref, NCRect *rect);
+
+/*
+ * Changes a text box's text and the width its lines wrap at.
+ * Empty text deletes the box, which moves the boxes after it on
+ * its page down a place.
+ */
+void noted_canvas_set_text(NotedCanvas *canvas, NCTextRef ref, const char *text, float width);
+
+/*
+ * Inserts a page before index for each page of the PDF at
+ * pdfPath, shaped like it and with it as the background. The
+ * notebook refers to the PDF by its path instead of keeping a
+ * copy. PDF pages are only read when they're drawn, and are
+ * cached at the zoom levels they were drawn at under a fixed
+ * memory budget, so opening a notebook of a long PDF costs
+ * about what opening a blank one does. Returns false if the PDF
+ * can't be read, or without PDF support (built without
+ * NC_HAVE_POPPLER and poppler-glib).
+ */
+bool noted_canvas_import_pdf(NotedCanvas *canvas, const char *pdfPath, size_t index);
+
+/*
+ * Returns the number of selected strokes, and if there are
+ * any and rect is non-null, sets rect to their bounds.
+ */
+size_t noted_canvas_get_selection(NotedCanvas *canvas, NCRect *rect);
 
 /*
  * Clears selection
  */
-//void noted_canvas_clear_selection(NotedCanvas *canvas);
+void noted_canvas_clear_selection(NotedCanvas *canvas);
 
 /*
  * Deletes content within current selection.
  */
-//void noted_canvas_delete_selection(NotedCanvas *canvas);
+void noted_canvas_delete_selection(NotedCanvas *canvas);
 
 /*
  * Copies content in current selection.
  * Cut by doing noted_canvas_copy followed
  * by noted_canvas_delete_selection.
+ * Returns a self-contained clip of size bytes to free with
+ * free(), or NULL if nothing is selected.
  */
-//void * noted_canvas_copy(NotedCanvas *canvas);
+void * noted_canvas_copy(NotedCanvas *canvas, size_t *size);
 
 /*
  * Pastes a content cut/copy (possibly from another canvas).
  * 'where' specifies the vertical center of the location of pasting.
  * This should be the center of the current scroll location.
+ * The pasted content becomes the selection. Returns false if
+ * content isn't a valid clip of strokes.
+ */
+bool noted_canvas_paste(NotedCanvas *canvas, const void *content, size_t size, float where);
+
+/*
+ * File-level page operations. These work on notebook files
+ * without opening them as canvases: pages are copied as raw
+ * blocks, and only the file's header and page table are
+ * rewritten. Files are replaced atomically. Old format files
+ * are upgraded in place first. Page indices start at 0.
+ */
+
+/*
+ * Returns the number of pages in the notebook at path, or -1
+ * if it can't be read.
+ */
+long noted_file_get_n_pages(const char *path);
+
+/*
+ * Copies n pages starting at index in the notebook src into the
+ * notebook dst, before dstIndex. src and dst may be the same.
+ */
+bool noted_file_copy_pages(const char *src, size_t index, size_t n, const char *dst, size_t dstIndex);
+
+/*
+ * Like noted_file_copy_pages, but removes the pages from src.
+ * When src and dst are the same file, dstIndex is where the
+ * first moved page ends up. Otherwise, src has to keep at
+ * least one page, so moving all of them fails without
+ * changing either file.
+ */
+bool noted_file_move_pages(const char *src, size_t index, size_t n, const char *dst, size_t dstIndex);
+
+/*
+ * Removes n pages starting at index from the notebook at path.
+ * At least one page always remains.
+ */
+bool noted_file_delete_pages(const char *path, size_t index, size_t n);
+
+/*
+ * Writes the canvas to pdfPath as a PDF, one PDF page per page.
+ * callback may be NULL. If the export fails or is cancelled,
+ * pdfPath is removed. Returns true on success.
+ */
+bool noted_canvas_export_pdf(NotedCanvas *canvas, const char *pdfPath, NCExportCallback callback, void *data);
+
+/*
+ * Like noted_canvas_export_pdf, but reads the notebook at path
+ * one page at a time as it goes, so memory use doesn't grow
+ * with the notebook. It doesn't touch any canvas, so it can run
+ * on a background thread, even while the notebook is open and
+ * being saved to.
  */
-//void noted_canvas_paste(NotedCanvas *canvas, void *content, float where);
+bool noted_file_export_pdf(const char *path, const char *pdfPath, NCExportCallback callback, void *data);
 
 /*
  * Undo. Returns true on success.
@@ -0,0 +1,99 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * noted-pages.c: Command line tool to copy, move and delete
+ *   pages between notebook files without opening them.
+ *   Not part of the app. Build with something like:
+ *   cc -std=gnu99 -pthread -I.. noted-pages.c ../array.c ../notedcanvas.c ../nc-*.c
+ *     $(pkg-config --cflags --libs cairo) -lm
+ */
+
+#include "notedcanvas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(void);
+static bool parse_page(const char *arg, size_t *page);
+
+// Page numbers on the command line start at 1, like in the app
+int main(int argc, char **argv)
+{
+    if(argc < 3)
+    {
+        usage();
+        return 2;
+    }
+    
+    const char *cmd = argv[1];
+    size_t first, count, index;
+    bool ok;
+    
+    if(strcmp(cmd, "count") == 0 && argc == 3)
+    {
+        long npages = noted_file_get_n_pages(argv[2]);
+        if(npages < 0)
+        {
+            fprintf(stderr, "noted-pages: can't read %s\n", argv[2]);
+            return 1;
+        }
+        printf("%ld\n", npages);
+        return 0;
+    }
+    else if((strcmp(cmd, "copy") == 0 || strcmp(cmd, "move") == 0) && argc == 7)
+    {
+        if(!parse_page(argv[3], &first) || !parse_page(argv[4], &count) || !parse_page(argv[6], &index))
+        {
+            usage();
+            return 2;
+        }
+        
+        if(cmd[0] == 'c')
+            ok = noted_file_copy_pages(argv[2], first - 1, count, argv[5], index - 1);
+        else
+            ok = noted_file_move_pages(argv[2], first - 1, count, argv[5], index - 1);
+    }
+    else if(strcmp(cmd, "delete") == 0 && argc == 5)
+    {
+        if(!parse_page(argv[3], &first) || !parse_page(argv[4], &count))
+        {
+            usage();
+            return 2;
+        }
+        ok = noted_file_delete_pages(argv[2], first - 1, count);
+    }
+    else
+    {
+        usage();
+        return 2;
+    }
+    
+    if(!ok)
+    {
+        fprintf(stderr, "noted-pages: %s failed\n", cmd);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: noted-pages count FILE\n"
+            "       noted-pages copy SRC FIRST COUNT DST BEFORE\n"
+            "       noted-pages move SRC FIRST COUNT DST BEFORE\n"
+            "       noted-pages delete FILE FIRST COUNT\n"
+            "Pages are numbered from 1. BEFORE is the page in DST to\n"
+            "insert in front of; past the last page appends.\n");
+}
+
+static bool parse_page(const char *arg, size_t *page)
+{
+    char *end;
+    unsigned long v = strtoul(arg, &end, 10);
+    if(*arg == '\0' || *end != '\0' || v == 0)
+        return false;
+    *page = v;
+    return true;
+}
@@ -0,0 +1,528 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * noted-render.c: Command line tool to render the pages of
+ *   notebooks, or of every notebook in a directory, to PNGs.
+ *   Pages are rendered on all cores at once, and each page is
+ *   drawn and written in strips, so memory stays bounded at
+ *   any DPI. Not part of the app. Build with something like:
+ *   cc -std=gnu99 -O2 -pthread -I.. noted-render.c ../array.c ../notedcanvas.c ../nc-*.c
+ *     $(pkg-config --cflags --libs cairo zlib) -lm
+ */
+
+#include "notedcanvas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+// Pages are a unit wide, which is 8.5in on a default page
+static const double kInchesPerUnit = 8.5;
+
+// Pixels drawn at once per thread. Pages bigger than this are
+// drawn in strips, each written out before the next is drawn.
+static const size_t kMaxStripPixels = 4 << 20;
+
+// Drawing keeps per point arrays on the stack
+static const size_t kThreadStackSize = 8 << 20;
+
+// A notebook to render. It's opened by the first thread to get
+// one of its pages, and closed by the last to finish one.
+typedef struct
+{
+    char *path;
+    char *name; // Of the file, without .noted
+    pthread_mutex_t lock;
+    NotedCanvas *canvas;
+    bool failed;
+    size_t remaining; // Pages not yet rendered
+} RenderFile;
+
+typedef struct
+{
+    RenderFile *file;
+    size_t page;
+} RenderItem;
+
+typedef struct
+{
+    RenderItem *items;
+    size_t nitems;
+    size_t next; // Next item to take, atomically
+    const char *outDir;
+    double dpi;
+    unsigned long rendered, failed; // Changed atomically
+} RenderJob;
+
+// A PNG written a few rows at a time
+typedef struct
+{
+    FILE *f;
+    z_stream z;
+    uint8_t *row; // One row, with its filter byte
+    uint8_t out[1 << 16];
+    uint32_t width;
+    bool failed;
+} PngWriter;
+
+static void usage(void);
+static bool add_path(const char *path, RenderFile **files, size_t *nfiles);
+static bool add_file(const char *path, RenderFile **files, size_t *nfiles);
+static int compare_names(const void *a, const void *b);
+static void * render_worker(void *data);
+static bool render_page(NotedCanvas *canvas, size_t index, double dpi, const char *outPath);
+static bool png_begin(PngWriter *w, const char *path, uint32_t width, uint32_t height);
+static void png_write_rows(PngWriter *w, cairo_surface_t *surface, int nrows);
+static bool png_end(PngWriter *w);
+static void png_chunk(PngWriter *w, const char *type, const uint8_t *data, uint32_t size);
+static void png_flush(PngWriter *w, int flush);
+static double now(void);
+
+// Page numbers on the command line start at 1, like in the app
+int main(int argc, char **argv)
+{
+    double dpi = 150;
+    unsigned int nthreads = 0;
+    unsigned long first = 1, last = 0;
+    const char *outDir = ".";
+    const char *tracePath = NULL;
+    
+    int opt;
+    while((opt = getopt(argc, argv, "d:j:p:o:t:")) != -1)
+    {
+        char *end;
+        switch(opt)
+        {
+            case 'd':
+                dpi = strtod(optarg, &end);
+                if(*end != '\0' || !(dpi > 0))
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'j':
+                nthreads = (unsigned int)strtoul(optarg, &end, 10);
+                if(*end != '\0' || nthreads == 0)
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'p':
+                first = last = strtoul(optarg, &end, 10);
+                if(*end == '-')
+                    last = strtoul(end + 1, &end, 10);
+                if(*end != '\0' || first == 0 || last < first)
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'o':
+                outDir = optarg;
+                break;
+            case 't':
+                tracePath = optarg;
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if(optind >= argc)
+    {
+        usage();
+        return 2;
+    }
+    
+    RenderFile *files = NULL;
+    size_t nfiles = 0;
+    for(int i = optind; i < argc; ++i)
+    {
+        if(!add_path(argv[i], &files, &nfiles))
+            fprintf(stderr, "noted-render: can't read %s\n", argv[i]);
+    }
+    
+    // Every page to render, in order, so threads tend to work on
+    // the same few notebooks at a time
+    RenderJob job = {.outDir = outDir, .dpi = dpi};
+    for(size_t i = 0; i < nfiles; ++i)
+    {
+        pthread_mutex_init(&files[i].lock, NULL);
+        NCFileInfo *info = noted_canvas_peek(files[i].path);
+        if(!info)
+        {
+            fprintf(stderr, "noted-render: can't read %s\n", files[i].path);
+            continue;
+        }
+        
+        size_t from = first - 1;
+        size_t to = (last > 0 && last < info->npages) ? last : info->npages;
+        for(size_t p = from; p < to; ++p)
+        {
+            RenderItem *items = realloc(job.items, sizeof(RenderItem) * (job.nitems + 1));
+            if(!items)
+                break;
+            job.items = items;
+            job.items[job.nitems++] = (RenderItem){&files[i], p};
+            ++files[i].remaining;
+        }
+        free(info);
+    }
+    
+    if(nthreads == 0)
+    {
+        long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncores > 0) ? (unsigned int)ncores : 1;
+    }
+    if(nthreads > job.nitems)
+        nthreads = job.nitems ? (unsigned int)job.nitems : 1;
+    
+    if(tracePath && !noted_trace_start(tracePath))
+    {
+        fprintf(stderr, "noted-render: can't trace to %s (tracing needs NC_STATS)\n", tracePath);
+        return 1;
+    }
+    
+    double start = now();
+    
+    // This thread renders too. If a thread can't be started, the
+    // others take its share.
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    unsigned int nstarted = 0;
+    if(threads)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, kThreadStackSize);
+        for(unsigned int t = 1; t < nthreads; ++t)
+        {
+            if(pthread_create(&threads[nstarted], &attr, render_worker, &job) == 0)
+                ++nstarted;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    render_worker(&job);
+    for(unsigned int t = 0; t < nstarted; ++t)
+        pthread_join(threads[t], NULL);
+    
+    double elapsed = now() - start;
+    printf("%lu pages from %zu notebooks in %.2fs on %u threads: %.1f pages/s\n",
+           job.rendered, nfiles, elapsed, nstarted + 1, (elapsed > 0) ? job.rendered / elapsed : 0);
+    noted_trace_stop();
+    
+    for(size_t i = 0; i < nfiles; ++i)
+    {
+        free(files[i].path);
+        free(files[i].name);
+        pthread_mutex_destroy(&files[i].lock);
+    }
+    free(files);
+    free(job.items);
+    free(threads);
+    return (job.failed > 0 || job.nitems == 0) ? 1 : 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: noted-render [-d DPI] [-p FIRST[-LAST]] [-j THREADS] [-o DIR] [-t TRACE] NOTEBOOK|DIR...\n"
+            "Renders each page to DIR/NAME-PAGE.png, where NAME is the\n"
+            "notebook's name. Directories render every notebook in them.\n"
+            "Pages are numbered from 1. The default is every page at\n"
+            "150 DPI, on one thread per core, into the current directory.\n"
+            "-t writes a Chrome trace of the opens and draws to TRACE\n"
+            "(built with -DNC_STATS).\n");
+}
+
+// Adds a notebook, or every notebook in a directory
+static bool add_path(const char *path, RenderFile **files, size_t *nfiles)
+{
+    struct stat st;
+    if(stat(path, &st) != 0)
+        return false;
+    if(!S_ISDIR(st.st_mode))
+        return add_file(path, files, nfiles);
+    
+    DIR *dir = opendir(path);
+    if(!dir)
+        return false;
+    
+    // Sorted, so the order doesn't depend on the file system
+    size_t firstNew = *nfiles;
+    struct dirent *e;
+    while((e = readdir(dir)))
+    {
+        size_t len = strlen(e->d_name);
+        if(e->d_name[0] == '.' || len <= 6 || strcmp(e->d_name + len - 6, ".noted") != 0)
+            continue;
+        
+        size_t size = strlen(path) + len + 2;
+        char *child = malloc(size);
+        if(!child)
+            continue;
+        snprintf(child, size, "%s/%s", path, e->d_name);
+        add_file(child, files, nfiles);
+        free(child);
+    }
+    closedir(dir);
+    
+    qsort(*files + firstNew, *nfiles - firstNew, sizeof(RenderFile), compare_names);
+    return true;
+}
+
+static bool add_file(const char *path, RenderFile **files, size_t *nfiles)
+{
+    RenderFile *grown = realloc(*files, sizeof(RenderFile) * (*nfiles + 1));
+    if(!grown)
+        return false;
+    *files = grown;
+    
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t len = strlen(base);
+    if(len > 6 && strcmp(base + len - 6, ".noted") == 0)
+        len -= 6;
+    
+    grown[(*nfiles)++] = (RenderFile){.path = strdup(path), .name = strndup(base, len)};
+    return true;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const RenderFile *)a)->path, ((const RenderFile *)b)->path);
+}
+
+// Renders items of job until they're all taken. Canvases are
+// only read while drawing, so threads share them.
+static void * render_worker(void *data)
+{
+    RenderJob *job = data;
+    
+    while(true)
+    {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(i >= job->nitems)
+            break;
+        
+        RenderFile *f = job->items[i].file;
+        size_t page = job->items[i].page;
+        
+        // Pages are already spread over threads
+        pthread_mutex_lock(&f->lock);
+        if(!f->canvas && !f->failed)
+        {
+            f->canvas = noted_canvas_open_with_threads(f->path, 1);
+            f->failed = !f->canvas;
+            if(f->failed)
+                fprintf(stderr, "noted-render: can't open %s\n", f->path);
+        }
+        NotedCanvas *canvas = f->canvas;
+        pthread_mutex_unlock(&f->lock);
+        
+        bool ok = false;
+        if(canvas && page < noted_canvas_get_n_pages(canvas))
+        {
+            size_t size = strlen(job->outDir) + strlen(f->name) + 32;
+            char *outPath = malloc(size);
+            if(outPath)
+            {
+                snprintf(outPath, size, "%s/%s-%zu.png", job->outDir, f->name, page + 1);
+                ok = render_page(canvas, page, job->dpi, outPath);
+                if(!ok)
+                    fprintf(stderr, "noted-render: can't write %s\n", outPath);
+                free(outPath);
+            }
+        }
+        __atomic_add_fetch(ok ? &job->rendered : &job->failed, 1, __ATOMIC_RELAXED);
+        
+        pthread_mutex_lock(&f->lock);
+        if(--f->remaining == 0 && f->canvas)
+        {
+            noted_canvas_destroy(f->canvas);
+            f->canvas = NULL;
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    return NULL;
+}
+
+// Draws the page in strips of at most kMaxStripPixels, writing
+// each strip's rows to the PNG before drawing the next
+static bool render_page(NotedCanvas *canvas, size_t index, double dpi, const char *outPath)
+{
+    NCRect r;
+    noted_canvas_get_page_rect(canvas, index, &r);
+    
+    double scale = dpi * kInchesPerUnit;
+    uint32_t width = (uint32_t)ceil((r.x2 - r.x1) * scale);
+    uint32_t height = (uint32_t)ceil((r.y2 - r.y1) * scale);
+    if(width == 0 || height == 0 || width > INT32_MAX / 4)
+        return false;
+    
+    size_t stripRows = kMaxStripPixels / width;
+    if(stripRows < 1)
+        stripRows = 1;
+    if(stripRows > height)
+        stripRows = height;
+    
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, (int)stripRows);
+    if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+    {
+        cairo_surface_destroy(surface);
+        return false;
+    }
+    
+    PngWriter w;
+    bool ok = png_begin(&w, outPath, width, height);
+    for(uint32_t y = 0; ok && y < height; y += stripRows)
+    {
+        int nrows = (int)((height - y < stripRows) ? height - y : stripRows);
+        
+        // Only this strip of the page, and nothing hanging over
+        // from the pages around it
+        cairo_t *cr = cairo_create(surface);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_paint(cr);
+        cairo_translate(cr, 0, -(double)y);
+        cairo_scale(cr, scale, scale);
+        cairo_translate(cr, -r.x1, -r.y1);
+        cairo_rectangle(cr, r.x1, r.y1 + y / scale, r.x2 - r.x1, nrows / scale);
+        cairo_clip(cr);
+        noted_canvas_draw(canvas, cr, 1);
+        cairo_destroy(cr);
+        
+        cairo_surface_flush(surface);
+        png_write_rows(&w, surface, nrows);
+        ok = !w.failed;
+    }
+    if(!png_end(&w))
+        ok = false;
+    
+    cairo_surface_destroy(surface);
+    if(!ok)
+        remove(outPath);
+    return ok;
+}
+
+// Starts an 8 bit RGB PNG. Rows are deflated as they come.
+static bool png_begin(PngWriter *w, const char *path, uint32_t width, uint32_t height)
+{
+    static const uint8_t kSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    
+    memset(w, 0, sizeof(PngWriter));
+    w->width = width;
+    w->f = fopen(path, "wb");
+    w->row = malloc(1 + (size_t)width * 3);
+    if(!w->f || !w->row || deflateInit(&w->z, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        w->failed = true;
+        return false;
+    }
+    
+    uint8_t ihdr[13];
+    uint32_t v = htonl(width);
+    memcpy(ihdr, &v, 4);
+    v = htonl(height);
+    memcpy(ihdr + 4, &v, 4);
+    ihdr[8] = 8; // Bits per channel
+    ihdr[9] = 2; // RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // Deflate, adaptive filtering, no interlace
+    
+    if(fwrite(kSignature, 1, 8, w->f) != 8)
+        w->failed = true;
+    png_chunk(w, "IHDR", ihdr, 13);
+    return !w->failed;
+}
+
+static void png_write_rows(PngWriter *w, cairo_surface_t *surface, int nrows)
+{
+    const uint8_t *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    
+    for(int y = 0; y < nrows && !w->failed; ++y)
+    {
+        // RGB24 pixels are native endian words of xRGB
+        const uint32_t *src = (const uint32_t *)(data + (size_t)y * stride);
+        uint8_t *dst = w->row;
+        *dst++ = 0; // No filter
+        for(uint32_t x = 0; x < w->width; ++x)
+        {
+            *dst++ = (uint8_t)(src[x] >> 16);
+            *dst++ = (uint8_t)(src[x] >> 8);
+            *dst++ = (uint8_t)src[x];
+        }
+        
+        w->z.next_in = w->row;
+        w->z.avail_in = (uInt)(dst - w->row);
+        png_flush(w, Z_NO_FLUSH);
+    }
+}
+
+static bool png_end(PngWriter *w)
+{
+    if(!w->failed)
+    {
+        png_flush(w, Z_FINISH);
+        png_chunk(w, "IEND", NULL, 0);
+    }
+    
+    deflateEnd(&w->z);
+    free(w->row);
+    if(w->f && fclose(w->f) != 0)
+        w->failed = true;
+    return !w->failed;
+}
+
+// Deflates the pending input, writing full output as IDAT chunks
+static void png_flush(PngWriter *w, int flush)
+{
+    int status;
+    do
+    {
+        w->z.next_out = w->out;
+        w->z.avail_out = sizeof(w->out);
+        status = deflate(&w->z, flush);
+        if(status == Z_STREAM_ERROR)
+        {
+            w->failed = true;
+            return;
+        }
+        
+        uint32_t n = (uint32_t)(sizeof(w->out) - w->z.avail_out);
+        if(n > 0)
+            png_chunk(w, "IDAT", w->out, n);
+    }
+    while(w->z.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+}
+
+static void png_chunk(PngWriter *w, const char *type, const uint8_t *data, uint32_t size)
+{
+    uint32_t length = htonl(size);
+    uLong crc = crc32(0, (const Bytef *)type, 4);
+    if(size > 0)
+        crc = crc32(crc, data, size);
+    uint32_t fileCrc = htonl((uint32_t)crc);
+    
+    if(fwrite(&length, 4, 1, w->f) != 1
+       || fwrite(type, 1, 4, w->f) != 4
+       || (size > 0 && fwrite(data, 1, size, w->f) != size)
+       || fwrite(&fileCrc, 4, 1, w->f) != 1)
+        w->failed = true;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
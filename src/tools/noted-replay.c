@@ -0,0 +1,511 @@
+/*
+ * Noted by zelbrium
+ * Apache License 2.0
+ *
+ * noted-replay.c: Command line tool to play input recordings
+ *   (see noted_canvas_record_input) back against a fresh canvas,
+ *   as fast as possible or at the speed they were recorded,
+ *   timing every input call. Ends with a checksum of the pages,
+ *   so a change that alters what input does shows up as a new
+ *   checksum. With -s, a snapshot of the canvas is taken after
+ *   every call and drawn on another thread, like an app drawing
+ *   off its main thread would. With -o, the notebook is then
+ *   reopened and saved a few times, and must come back the same.
+ *   A few recordings to start with are in traces/:
+ *   handwriting (lines of cursive), diagram (boxes and arrows,
+ *   moved around with the select tool) and erasing (a page
+ *   scribbled over, then mostly erased). Not part of the app.
+ *   Build with something like:
+ *   cc -std=gnu99 -O2 -pthread -I.. noted-replay.c ../array.c ../notedcanvas.c ../nc-*.c
+ *     $(pkg-config --cflags --libs cairo zlib) -lm
+ */
+
+#include "notedcanvas.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Added to recorded timestamps, since 0 means now
+static const double kTimeBase = 1;
+
+// Pixels across the canvas when drawing snapshots
+static const int kRenderWidth = 1024;
+
+// For -o: blank pages put ahead of the recorded ones, so those are
+// far enough down for their positions to round, and how many times
+// the notebook is then reopened and saved
+static const size_t kRoundTripPages = 16;
+static const int kRoundTrips = 3;
+
+typedef struct
+{
+    unsigned long rects; // Invalidated, once merged
+    double area; // Of those rects
+    unsigned long wetInk; // Wet ink updates
+} Counts;
+
+// Draws the newest snapshot on its own thread, skipping any taken
+// while it was drawing the one before
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    NCSnapshot *latest; // Not drawn yet, or NULL
+    bool done;
+    unsigned long drawn; // Only read once the thread has ended
+    double drawTime;
+} Renderer;
+
+static void usage(void);
+static bool replay(const char *path, const char *basePath, bool realTime, bool wetInk, bool snapshots, bool roundTrip, uint64_t *checksum);
+static bool round_trip(const char *path, const char *canvasPath, uint64_t checksum);
+static NotedCanvas * open_canvas(const char *basePath, char *path);
+static bool copy_file(const char *from, const char *to);
+static uint64_t canvas_checksum(NotedCanvas *canvas);
+static void print_times(double *times, size_t n);
+static void renderer_start(Renderer *r);
+static void renderer_stop(Renderer *r);
+static void renderer_push(Renderer *r, NCSnapshot *snapshot);
+static void * render_thread(void *data);
+static int compare_times(const void *a, const void *b);
+static void on_invalidate(NotedCanvas *canvas, NCRect *rect, void *data);
+static void on_wet_ink(NotedCanvas *canvas, NCRect *rect, void *data);
+static void sleep_until(double time);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+    bool realTime = false, wetInk = false, snapshots = false, roundTrip = false;
+    const char *basePath = NULL;
+    const char *tracePath = NULL;
+    bool check = false;
+    uint64_t expected = 0;
+    
+    int opt;
+    while((opt = getopt(argc, argv, "rwsob:c:t:")) != -1)
+    {
+        char *end;
+        switch(opt)
+        {
+            case 'r':
+                realTime = true;
+                break;
+            case 'w':
+                wetInk = true;
+                break;
+            case 's':
+                snapshots = true;
+                break;
+            case 'o':
+                roundTrip = true;
+                break;
+            case 'b':
+                basePath = optarg;
+                break;
+            case 'c':
+                expected = strtoull(optarg, &end, 16);
+                if(*end != '\0' || end == optarg)
+                {
+                    usage();
+                    return 2;
+                }
+                check = true;
+                break;
+            case 't':
+                tracePath = optarg;
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if(optind >= argc)
+    {
+        usage();
+        return 2;
+    }
+    
+    if(tracePath && !noted_trace_start(tracePath))
+    {
+        fprintf(stderr, "noted-replay: can't trace to %s (tracing needs NC_STATS)\n", tracePath);
+        return 1;
+    }
+    
+    int status = 0;
+    for(int i = optind; i < argc; ++i)
+    {
+        uint64_t checksum;
+        if(!replay(argv[i], basePath, realTime, wetInk, snapshots, roundTrip, &checksum))
+            status = 1;
+        else if(check && checksum != expected)
+        {
+            fprintf(stderr, "noted-replay: %s: checksum %016llx, expected %016llx\n",
+                    argv[i], (unsigned long long)checksum, (unsigned long long)expected);
+            status = 1;
+        }
+    }
+    noted_trace_stop();
+    return status;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: noted-replay [-r] [-w] [-s] [-o] [-b NOTEBOOK] [-c CHECKSUM] [-t TRACE] RECORDING...\n"
+            "Plays each recording back on a new blank notebook, or a\n"
+            "copy of NOTEBOOK, as fast as possible, and prints how\n"
+            "long each input call took, what it invalidated, and a\n"
+            "checksum of the pages after.\n"
+            "-r plays back at the recorded speed.\n"
+            "-w turns on the wet ink layer, as the app does.\n"
+            "-s takes a snapshot after every input call, and draws\n"
+            "the newest on another thread.\n"
+            "-o then adds blank pages ahead of the recorded ones, and\n"
+            "fails if the pages change when the notebook is reopened\n"
+            "and saved again.\n"
+            "-c fails if a recording doesn't end with CHECKSUM.\n"
+            "-t writes a Chrome trace of the canvas to TRACE\n"
+            "(built with -DNC_STATS).\n");
+}
+
+// Plays back the recording at path, and prints what it took
+static bool replay(const char *path, const char *basePath, bool realTime, bool wetInk, bool snapshots, bool roundTrip, uint64_t *checksum)
+{
+    NCRecording *recording = noted_recording_open(path);
+    if(!recording)
+    {
+        fprintf(stderr, "noted-replay: can't read %s\n", path);
+        return false;
+    }
+    
+    char canvasPath[] = "/tmp/noted-replay-XXXXXX";
+    NotedCanvas *canvas = open_canvas(basePath, canvasPath);
+    if(!canvas)
+    {
+        fprintf(stderr, "noted-replay: can't open %s\n", basePath ? basePath : canvasPath);
+        noted_recording_close(recording);
+        return false;
+    }
+    
+    Counts counts = {0};
+    noted_canvas_set_invalidate_callback(canvas, on_invalidate, &counts);
+    if(wetInk)
+        noted_canvas_set_wet_ink_callback(canvas, on_wet_ink, &counts);
+    counts = (Counts){0};
+    
+    Renderer renderer;
+    if(snapshots)
+        renderer_start(&renderer);
+    double snapshotTime = 0;
+    
+    double *times = NULL;
+    size_t ntimes = 0, capacity = 0;
+    unsigned long nsamples = 0;
+    NCInputSample *samples = NULL;
+    size_t samplesCapacity = 0;
+    
+    double start = now();
+    NCRecordEvent e;
+    while(noted_recording_read(recording, &e))
+    {
+        switch(e.kind)
+        {
+            case kNCRecordInput:
+                break;
+            case kNCRecordStyle:
+                noted_canvas_set_stroke_style(canvas, e.style);
+                continue;
+            case kNCRecordSelectMode:
+                noted_canvas_set_select_mode(canvas, e.selectMode);
+                continue;
+            case kNCRecordSimplify:
+                noted_canvas_set_simplify_tolerance(canvas, e.value);
+                continue;
+            case kNCRecordPrediction:
+                noted_canvas_set_prediction(canvas, e.value);
+                continue;
+        }
+        
+        if(ntimes == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            double *grown = realloc(times, sizeof(double) * capacity);
+            if(!grown)
+                break;
+            times = grown;
+        }
+        if(e.nsamples > samplesCapacity)
+        {
+            NCInputSample *grown = realloc(samples, sizeof(NCInputSample) * e.nsamples);
+            if(!grown)
+                break;
+            samples = grown;
+            samplesCapacity = e.nsamples;
+        }
+        for(size_t i = 0; i < e.nsamples; ++i)
+        {
+            samples[i] = e.samples[i];
+            samples[i].timestamp += kTimeBase;
+        }
+        
+        if(realTime)
+            sleep_until(start + e.time);
+        
+        double t = now();
+        if(e.batch)
+            noted_canvas_input_batch(canvas, e.tool, samples, e.nsamples);
+        else
+            noted_canvas_input(canvas, samples[0].state, e.tool, samples[0].x, samples[0].y, samples[0].pressure);
+        times[ntimes++] = now() - t;
+        nsamples += e.nsamples;
+        
+        if(snapshots)
+        {
+            t = now();
+            NCSnapshot *snapshot = noted_canvas_snapshot(canvas);
+            snapshotTime += now() - t;
+            renderer_push(&renderer, snapshot);
+        }
+    }
+    double elapsed = now() - start;
+    if(snapshots)
+        renderer_stop(&renderer);
+    
+    *checksum = canvas_checksum(canvas);
+    printf("%s: %zu input calls (%lu samples) in %.3fs\n", path, ntimes, nsamples, elapsed);
+    print_times(times, ntimes);
+    printf("  invalidated %lu rects, %.3f square units", counts.rects, counts.area);
+    if(wetInk)
+        printf(", %lu wet ink updates", counts.wetInk);
+    if(snapshots && ntimes > 0)
+    {
+        printf("\n  snapshots: mean %.1fus to take, %lu drawn in %.1fms each",
+               snapshotTime / ntimes * 1e6, renderer.drawn,
+               renderer.drawn ? renderer.drawTime / renderer.drawn * 1e3 : 0);
+    }
+    printf("\n  checksum %016llx\n", (unsigned long long)*checksum);
+    
+    // Each page added is saved
+    uint64_t saved = 0;
+    if(roundTrip)
+    {
+        for(size_t i = 0; i < kRoundTripPages; ++i)
+            noted_canvas_insert_page(canvas, 0);
+        saved = canvas_checksum(canvas);
+    }
+    
+    noted_canvas_destroy(canvas);
+    bool ok = !roundTrip || round_trip(path, canvasPath, saved);
+    unlink(canvasPath);
+    noted_recording_close(recording);
+    free(times);
+    free(samples);
+    return ok;
+}
+
+// Reopens the notebook at canvasPath and saves it again a few
+// times, checking its pages still have checksum each time
+static bool round_trip(const char *path, const char *canvasPath, uint64_t checksum)
+{
+    for(int i = 0; i < kRoundTrips; ++i)
+    {
+        NotedCanvas *canvas = noted_canvas_open(canvasPath);
+        if(!canvas)
+        {
+            fprintf(stderr, "noted-replay: %s: can't reopen the notebook\n", path);
+            return false;
+        }
+        
+        uint64_t reopened = canvas_checksum(canvas);
+        
+        // Adding a page and deleting it saves twice, leaving the
+        // pages as they were
+        size_t npages = noted_canvas_get_n_pages(canvas);
+        noted_canvas_insert_page(canvas, npages);
+        noted_canvas_delete_page(canvas, npages);
+        noted_canvas_destroy(canvas);
+        
+        if(reopened != checksum)
+        {
+            fprintf(stderr, "noted-replay: %s: pages changed after %d saves and reopens\n", path, i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Opens a copy of basePath, or a new notebook if it's NULL, at a
+// temporary path written to path
+static NotedCanvas * open_canvas(const char *basePath, char *path)
+{
+    int fd = mkstemp(path);
+    if(fd < 0)
+        return NULL;
+    close(fd);
+    
+    if(!basePath)
+        return noted_canvas_new(path);
+    
+    NotedCanvas *canvas = copy_file(basePath, path) ? noted_canvas_open(path) : NULL;
+    if(!canvas)
+        unlink(path);
+    return canvas;
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out = in ? fopen(to, "wb") : NULL;
+    bool ok = in && out;
+    
+    char buffer[1 << 16];
+    size_t n;
+    while(ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+        ok = fwrite(buffer, 1, n, out) == n;
+    ok = ok && !ferror(in);
+    
+    if(in)
+        fclose(in);
+    if(out && fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+// FNV-1a over a copy of every page, which holds all their content
+// but not their thumbnails, which are made in the background
+static uint64_t canvas_checksum(NotedCanvas *canvas)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t npages = noted_canvas_get_n_pages(canvas);
+    for(size_t i = 0; i < npages; ++i)
+    {
+        size_t size;
+        uint8_t *clip = noted_canvas_page_copy(canvas, i, &size);
+        if(!clip)
+            continue;
+        for(size_t j = 0; j < size; ++j)
+            hash = (hash ^ clip[j]) * 1099511628211ull;
+        free(clip);
+    }
+    return hash;
+}
+
+static void print_times(double *times, size_t n)
+{
+    if(n == 0)
+        return;
+    
+    double total = 0;
+    for(size_t i = 0; i < n; ++i)
+        total += times[i];
+    qsort(times, n, sizeof(double), compare_times);
+    
+    printf("  per call: mean %.1fus, p50 %.1fus, p95 %.1fus, p99 %.1fus, max %.1fus\n",
+           total / n * 1e6, times[n / 2] * 1e6, times[n * 95 / 100] * 1e6,
+           times[n * 99 / 100] * 1e6, times[n - 1] * 1e6);
+}
+
+static void renderer_start(Renderer *r)
+{
+    memset(r, 0, sizeof(Renderer));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    pthread_create(&r->thread, NULL, render_thread, r);
+}
+
+// Waits for the last snapshot pushed to be drawn
+static void renderer_stop(Renderer *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->done = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+}
+
+static void renderer_push(Renderer *r, NCSnapshot *snapshot)
+{
+    pthread_mutex_lock(&r->lock);
+    NCSnapshot *skipped = r->latest;
+    r->latest = snapshot;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    noted_snapshot_release(skipped);
+}
+
+static void * render_thread(void *data)
+{
+    Renderer *r = data;
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, kRenderWidth, kRenderWidth);
+    
+    while(true)
+    {
+        pthread_mutex_lock(&r->lock);
+        while(!r->latest && !r->done)
+            pthread_cond_wait(&r->cond, &r->lock);
+        NCSnapshot *snapshot = r->latest;
+        r->latest = NULL;
+        pthread_mutex_unlock(&r->lock);
+        if(!snapshot)
+            break;
+        
+        // The top of the canvas, a page wide
+        double t = now();
+        cairo_t *cr = cairo_create(surface);
+        cairo_scale(cr, kRenderWidth, kRenderWidth);
+        cairo_rectangle(cr, 0, 0, 1, 1);
+        cairo_clip(cr);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_paint(cr);
+        noted_snapshot_draw(snapshot, cr, 1);
+        cairo_destroy(cr);
+        r->drawTime += now() - t;
+        ++r->drawn;
+        noted_snapshot_release(snapshot);
+    }
+    
+    cairo_surface_destroy(surface);
+    return NULL;
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void on_invalidate(NotedCanvas *canvas, NCRect *rect, void *data)
+{
+    Counts *counts = data;
+    if(!rect)
+        return;
+    ++counts->rects;
+    counts->area += (rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+}
+
+static void on_wet_ink(NotedCanvas *canvas, NCRect *rect, void *data)
+{
+    ++((Counts *)data)->wetInk;
+}
+
+static void sleep_until(double time)
+{
+    double wait = time - now();
+    if(wait <= 0)
+        return;
+    struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+    nanosleep(&ts, NULL);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}